@@ -38,43 +38,113 @@ static const uint8_t DMC_PERIODS[16] = {
 	214, 190, 170, 160, 143, 127, 113, 107, 95, 80, 71, 64, 53, 42, 36, 27
 };
 
+/* CPU cycles at which the frame counter does something (see fc_clock) */
+static const uint16_t FC_STEPS[2][7] = {
+	{ 7457, 14913, 22371, 29828, 29829, 29830, 0xFFFF },  /* 4-step */
+	{ 7457, 14913, 22371, 37281, 37282, 0xFFFF, 0xFFFF }  /* 5-step */
+};
+
 static void update_irq(APU* apu)
 {
-	if (apu->fc_irq_fired || apu->dmc.irq_fired)
+	cpu_set_irq_line(&apu->nes->cpu, IRQ_SOURCE_APU, apu->fc_irq_fired || apu->dmc.irq_fired);
+}
+
+static void set_sample_period(APU* apu, uint32_t clock_rate)
+{
+	/* TODO: proper downsampling (a real NES outputs one sample per cycle) */
+	apu->sample_period = clock_rate / apu->spec.sample_rate;
+	apu->sample_period_frac = clock_rate % apu->spec.sample_rate;
+	apu->sample_frac_acc = 0;
+	apu->sample_countdown = apu->sample_period;
+}
+
+static int init_output(APU* apu, NESInitInfo* init_info)
+{
+	uint32_t frame_size;
+	uint8_t i;
+
+	apu->spec = init_info->audio_spec;
+	if (!apu->spec.sample_rate)
+		apu->spec.sample_rate = APU_SAMPLE_RATE;
+	if (!apu->spec.channels)
+		apu->spec.channels = 1;
+	if (!apu->spec.buffer_size)
+		apu->spec.buffer_size = APU_DEFAULT_BUFFER_SIZE;
+
+	if (apu->spec.channels > 2 || apu->spec.format > AUDIO_FORMAT_F32 ||
+		apu->spec.filter > AUDIO_FILTER_NONE)
 	{
-		cpu_fire_interrupt(&apu->nes->cpu, INT_IRQ);
+		fprintf(stderr, "Error: unsupported audio output format\n");
+		return -1;
 	}
-	else
+	if (apu->spec.sample_rate > CPU_CLOCK_NTSC / 2)
 	{
-		cpu_clear_interrupt(&apu->nes->cpu, INT_IRQ);
+		fprintf(stderr, "Error: unsupported audio sample rate (%u)\n", apu->spec.sample_rate);
+		return -1;
 	}
-}
 
-int apu_init(APU* apu, struct NES* nes, NESInitInfo* init_info)
-{
-	/*uint8_t i;*/
-	memset(apu, 0, sizeof(*apu));
-	apu->snd_cb = init_info->snd_cb;
-	apu->snd_userdata = init_info->snd_userdata;
-	apu->nes = nes;
+	set_sample_period(apu, CPU_CLOCK_NTSC);
+	audio_filter_init(&apu->filter, apu->spec.filter, apu->spec.sample_rate, apu->spec.channels);
 
-	/* TODO: proper downsampling (a real NES outputs ~1789773 samples/second) */
-	/* TODO: adjust buffer size based on host sample rate */
-	apu->sample_buf_size = (4096 / sizeof(uint16_t)) * 4;
-	if (!(apu->sample_buf1 = (uint16_t*)calloc(apu->sample_buf_size, sizeof(uint16_t))))
+	/* Linear panning. Centered channels play at full volume on both sides */
+	for (i = 0; i < AUDIO_PAN_CHANNELS; ++i)
+	{
+		float pan = apu->spec.pan[i];
+		if (pan < -1.0f)
+			pan = -1.0f;
+		else if (pan > 1.0f)
+			pan = 1.0f;
+		apu->pan_gain[0][i] = (uint16_t)(256 * (pan > 0 ? 1.0f - pan : 1.0f));
+		apu->pan_gain[1][i] = (uint16_t)(256 * (pan < 0 ? 1.0f + pan : 1.0f));
+	}
+
+	/* Without output, sample points are skipped entirely */
+	if (init_info->no_audio)
+		return 0;
+
+	apu->sample_buf_size = apu->spec.buffer_size;
+	frame_size = apu->spec.channels * audio_sample_size(apu->spec.format);
+	if (!(apu->mix_buf = (uint16_t*)calloc(apu->sample_buf_size * apu->spec.channels, sizeof(uint16_t))))
+	{
+		fprintf(stderr, "Error: could not allocate audio mix buffer (%d)\n", errno);
+		return -1;
+	}
+
+	/* A caller-owned block is converted into and handed off in place */
+	if (init_info->audio_buffer)
+	{
+		apu->current_read_buf = apu->current_write_buf = init_info->audio_buffer;
+		return 0;
+	}
+	if (!(apu->sample_buf1 = calloc(apu->sample_buf_size, frame_size)))
 	{
 		fprintf(stderr, "Error: could not allocate audio buffer 1 (%d)\n", errno);
+		free(apu->mix_buf);
 		return -1;
 	}
-	if (!(apu->sample_buf2 = (uint16_t*)calloc(apu->sample_buf_size, sizeof(uint16_t))))
+	if (!(apu->sample_buf2 = calloc(apu->sample_buf_size, frame_size)))
 	{
 		fprintf(stderr, "Error: could not allocate audio buffer 2 (%d)\n", errno);
 		free(apu->sample_buf1);
+		free(apu->mix_buf);
 		return -1;
 	}
 
 	apu->current_read_buf = apu->sample_buf1;
 	apu->current_write_buf = apu->sample_buf2;
+	return 0;
+}
+
+int apu_init(APU* apu, struct NES* nes, NESInitInfo* init_info)
+{
+	/*uint8_t i;*/
+	memset(apu, 0, sizeof(*apu));
+	apu->snd_cb = init_info->snd_cb;
+	apu->snd_userdata = init_info->snd_userdata;
+	apu->nes = nes;
+
+	if (init_output(apu, init_info) != 0)
+		return -1;
 
 	/*pulse_mix[0] = 0;
 	for (i = 1; i < 31; ++i)
@@ -95,6 +165,8 @@ int apu_init(APU* apu, struct NES* nes, NESInitInfo* init_info)
 
 void apu_cleanup(APU* apu)
 {
+	free(apu->stem_buf);
+	free(apu->mix_buf);
 	free(apu->sample_buf1);
 	free(apu->sample_buf2);
 	memset(apu, 0, sizeof(APU));
@@ -192,8 +264,20 @@ static void fc_hframe(APU* apu)
 	lc_clock(&apu->noise.lc);
 }
 
+static void fc_update_next_step(APU* apu)
+{
+	const uint16_t* steps = FC_STEPS[apu->fc_sequence];
+	while (*steps <= apu->cycles)
+		++steps;
+	apu->fc_next_step = *steps;
+}
+
 static void fc_clock(APU* apu)
 {
+	/* Nothing happens between sequencer steps */
+	if (apu->cycles < apu->fc_next_step && !apu->fc_reset_delay)
+		return;
+
 	if (apu->fc_reset_delay && --apu->fc_reset_delay == 0)
 	{
 		if (apu->fc_sequence == FC_5STEP)
@@ -247,24 +331,29 @@ static void fc_clock(APU* apu)
 				break;
 		}
 	}
+	fc_update_next_step(apu);
 }
 
-static uint8_t pulse_clock(PulseChannel* channel)
+static void pulse_clock(PulseChannel* channel)
 {
 	/* Clock pulse waveform generator */
-	uint8_t vol = 0;
 	if (channel->timer.value-- == 0)
 	{
 		channel->timer.value = channel->timer.period;
 		channel->phase = (channel->phase + 1) & 7;
 	}
+}
+
+static uint8_t pulse_output(PulseChannel* channel)
+{
+	uint8_t vol = 0;
 	if (channel->timer.period < 8 || (!channel->sweep.negate && channel->sweep.target > 0x7FF) || channel->lc.value == 0)
 		return 0;
 	vol = channel->env.enabled ? channel->env.decay_vol : channel->env.timer.period;
 	return vol * ((channel->duty >> (7 - channel->phase)) & 1);
 }
 
-static uint8_t triangle_clock(TriangleChannel* channel)
+static void triangle_clock(TriangleChannel* channel)
 {
 	/* Triangle waveform generator */
 	uint8_t counters_active = channel->lc.value && channel->lin_ctr.timer.value;
@@ -274,6 +363,10 @@ static uint8_t triangle_clock(TriangleChannel* channel)
 		if (counters_active)
 			channel->phase = (channel->phase + 1) & 0x1F;
 	}
+}
+
+static uint8_t triangle_output(TriangleChannel* channel)
+{
 	/*if (!counters_active)
 		return 0;*/
 
@@ -286,16 +379,25 @@ static uint8_t triangle_clock(TriangleChannel* channel)
 	return TRI_SEQUENCE[channel->phase];
 }
 
-static uint8_t noise_clock(NoiseChannel* channel)
+static void noise_shift(NoiseChannel* channel)
+{
+	uint8_t fb = channel->lfsr & 1;
+	fb ^= channel->mode ? ((channel->lfsr >> 6) & 1) : (channel->lfsr >> 1) & 1;
+	channel->lfsr = ((channel->lfsr >> 1) & 0x3FFF) | fb << 14;
+}
+
+static void noise_clock(NoiseChannel* channel)
 {
 	/* Noise waveform generator */
 	if (channel->timer.value-- == 0)
 	{
-		uint8_t fb = channel->lfsr & 1;
 		channel->timer.value = channel->timer.period;
-		fb ^= channel->mode ? ((channel->lfsr >> 6) & 1) : (channel->lfsr >> 1) & 1;
-		channel->lfsr = ((channel->lfsr >> 1) & 0x3FFF) | fb << 14;
+		noise_shift(channel);
 	}
+}
+
+static uint8_t noise_output(NoiseChannel* channel)
+{
 	if (((channel->lfsr & 1) == 0) && channel->lc.value > 0)
 		return channel->env.enabled ? channel->env.decay_vol : channel->env.timer.period;
 	return 0;
@@ -315,7 +417,7 @@ static void dmc_restart_sample(DMCChannel* channel)
 
    A similar problem occurs when reading data from the PPU through $2007, or polling $2002 for vblank. */
 
-static uint8_t dmc_clock(APU* apu, DMCChannel* channel)
+static void dmc_clock(APU* apu, DMCChannel* channel)
 {
 	/* Refill sample buffer if needed */
 	if (channel->bytes_remaining > 0 && !channel->sample_buf_filled)
@@ -370,7 +472,6 @@ static uint8_t dmc_clock(APU* apu, DMCChannel* channel)
 
 		channel->timer.value = channel->timer.period;
 	}
-	return channel->output;
 }
 
 /* 7  bit  0
@@ -625,8 +726,63 @@ static void (*PULSE_REGS[4])(PulseChannel*, uint8_t) = {
 	pulse_flags1_write, pulse_sweep_write, pulse_flags3_write, pulse_flags4_write
 };
 
+static void catch_up(APU* apu)
+{
+	uint64_t now = apu->nes->sched.now;
+	uint32_t owed = (uint32_t)(now - apu->sync_cycle);
+	apu->sync_cycle = now;
+	apu_run(apu, owed);
+}
+
+static void post_events(APU* apu)
+{
+	/* The frame counter IRQ can only be raised from cycle 29828 of the
+	   4-step sequence (or right after a pending reset). The DMC stalls the
+	   CPU (and may raise its IRQ) once its sample buffer runs dry */
+	Scheduler* sched = &apu->nes->sched;
+	DMCChannel* dmc = &apu->dmc;
+	uint64_t now = apu->sync_cycle;
+	uint64_t time = EVENT_NONE;
+
+	if (apu->fc_reset_delay)
+		time = now;
+	else if (apu->fc_sequence == FC_4STEP && apu->fc_irq_enabled)
+		time = now + (apu->cycles < 29828 ? 29828 - apu->cycles : 0);
+	scheduler_post(sched, EVENT_APU_FRAME, time);
+
+	time = EVENT_NONE;
+	if (dmc->bytes_remaining > 0 && !dmc->sample_buf_filled)
+	{
+		time = now;
+	}
+	else if (dmc->bytes_remaining > 0)
+	{
+		/* The buffer empties when the timer expires on the last bit. The
+		   timer is clocked every other cycle */
+		time = now + 2 * (dmc->timer.value +
+						  (uint64_t)(uint8_t)(dmc->bits_remaining - 1) * (dmc->timer.period + 1));
+	}
+	scheduler_post(sched, EVENT_APU_DMC, time);
+
+	/* Hand off audio on time even if nothing else syncs the APU */
+	time = EVENT_NONE;
+	if (apu->mix_buf)
+	{
+		time = now + apu->sample_countdown +
+			   (uint64_t)(apu->sample_buf_size - apu->sample_buf_insert_pos - 1) * apu->sample_period;
+	}
+	scheduler_post(sched, EVENT_APU_BUFFER, time);
+}
+
+void apu_sync(APU* apu)
+{
+	catch_up(apu);
+	post_events(apu);
+}
+
 void apu_write(APU* apu, uint16_t addr, uint8_t val)
 {
+	catch_up(apu);
 	if (addr >= 0x4000 && addr <= 0x4007)
 	{
 		/* Writing to a pulse register */
@@ -676,51 +832,321 @@ void apu_write(APU* apu, uint16_t addr, uint8_t val)
 			fc_write(apu, val);
 			break;
 	}
+	post_events(apu);
 }
 
 uint8_t apu_read(APU* apu, uint16_t addr)
 {
+	catch_up(apu);
 	if (addr == 0x4015)
 		return status_read(apu);
 	else
 		return 0;
 }
 
+static void swap_buffers(APU* apu)
+{
+	/* Filter and convert the mixed block, then hand it off to the frontend and
+	   recorders. Stems are left unfiltered */
+	uint32_t count = apu->sample_buf_insert_pos;
+	void* tmp = apu->current_write_buf;
+	audio_filter_run(&apu->filter, apu->mix_buf, count);
+	audio_convert(tmp, apu->mix_buf, count * apu->spec.channels, apu->spec.format);
+	apu->current_write_buf = apu->current_read_buf;
+	apu->current_read_buf = tmp;
+	apu->sample_buf_insert_pos = 0;
+
+	if (apu->recorder)
+		recorder_push(apu->recorder, apu->mix_buf, count * apu->spec.channels);
+	if (apu->stem_recorder)
+		recorder_push(apu->stem_recorder, apu->stem_buf, count * APU_STEM_CHANNELS);
+	if (apu->snd_cb)
+		apu->snd_cb(apu->current_read_buf, count, apu->snd_userdata);
+}
+
+static void output_sample(APU* apu)
+{
+	/* Linear approximation of APU non-linear mix.
+	   During testing, using the standard lookup table method resulted in static.
+
+	   TODO: try the lookup table method again after implementing DMC and proper
+	   downsampling
+
+	   See https://wiki.nesdev.com/w/index.php/APU_Mixer for more info */
+	uint16_t levels[AUDIO_PAN_CHANNELS];
+	uint16_t* out = apu->mix_buf + apu->sample_buf_insert_pos * apu->spec.channels;
+	uint32_t left = 0, right = 0;
+	uint8_t i;
+
+	levels[0] = 492 * pulse_output(&apu->pulse1);
+	levels[1] = 492 * pulse_output(&apu->pulse2);
+	levels[2] = 557 * triangle_output(&apu->triangle);
+	levels[3] = 323 * noise_output(&apu->noise);
+	levels[4] = 219 * apu->dmc.output;
+	/*uint16_t pulse_out = pulse_mix[pulse_output(&apu->pulse1) + pulse_output(&apu->pulse2)];
+	uint16_t tnd_out = tnd_mix[(3 * triangle_output(&apu->triangle)) + (2 * noise_output(&apu->noise))];
+	uint16_t val = pulse_out + tnd_out;*/
+
+	if (apu->stem_buf)
+	{
+		/* Same sample points as the mix, so stems line up exactly */
+		uint16_t* stems = apu->stem_buf + apu->sample_buf_insert_pos * APU_STEM_CHANNELS;
+		memcpy(stems, levels, sizeof(levels));
+		stems[AUDIO_PAN_CHANNELS] = levels[0] + levels[1] + levels[2] + levels[3] + levels[4];
+	}
+
+	if (apu->spec.channels == 1)
+	{
+		out[0] = levels[0] + levels[1] + levels[2] + levels[3] + levels[4];
+	}
+	else
+	{
+		for (i = 0; i < AUDIO_PAN_CHANNELS; ++i)
+		{
+			left += levels[i] * apu->pan_gain[0][i];
+			right += levels[i] * apu->pan_gain[1][i];
+		}
+		out[0] = left >> 8;
+		out[1] = right >> 8;
+	}
+
+	/* Spread the fractional part of the sample period over time */
+	apu->sample_countdown = apu->sample_period;
+	apu->sample_frac_acc += apu->sample_period_frac;
+	if (apu->sample_frac_acc >= apu->spec.sample_rate)
+	{
+		apu->sample_frac_acc -= apu->spec.sample_rate;
+		++apu->sample_countdown;
+	}
+
+	if (++apu->sample_buf_insert_pos == apu->sample_buf_size)
+	{
+		//printf("Audio buffer full\n");
+		swap_buffers(apu);
+	}
+}
+
 void apu_tick(APU* apu)
 {
-	uint16_t tri_val = triangle_clock(&apu->triangle);
+	triangle_clock(&apu->triangle);
 	fc_clock(apu);
 
 	if ((apu->cycles % 2) == 0)
 	{
-		/* Linear approximation of APU non-linear mix.
-		   During testing, using the standard lookup table method resulted in static.
+		pulse_clock(&apu->pulse1);
+		pulse_clock(&apu->pulse2);
+		noise_clock(&apu->noise);
+		dmc_clock(apu, &apu->dmc);
+	}
 
-		   TODO: try the lookup table method again after implementing DMC and proper
-		   downsampling
+	/* Channel outputs only matter when a sample is taken */
+	if (apu->mix_buf && --apu->sample_countdown == 0)
+		output_sample(apu);
+	++apu->cycles;
+}
 
-		   See https://wiki.nesdev.com/w/index.php/APU_Mixer for more info */
-		uint16_t pulse_out = 492 * (pulse_clock(&apu->pulse1) + pulse_clock(&apu->pulse2));
-		uint16_t tnd_out = (557 * tri_val) + (323 * noise_clock(&apu->noise)) + (219 * dmc_clock(apu, &apu->dmc));
-		/*uint16_t pulse_out = pulse_mix[pulse_clock(&apu->pulse1) + pulse_clock(&apu->pulse2)];
-		uint16_t tnd_out = tnd_mix[(3 * tri_val) + (2 * noise_clock(&apu->noise))];
-		uint16_t val = pulse_out + tnd_out;*/
+static uint32_t timer_advance(Timer* timer, uint32_t clocks)
+{
+	/* Equivalent to clocking the timer the given number of times.
+	   Returns the number of times it was reloaded */
+	uint32_t wraps;
+	if (clocks <= timer->value)
+	{
+		timer->value -= clocks;
+		return 0;
+	}
+	clocks -= timer->value + 1;
+	wraps = 1 + clocks / (timer->period + 1);
+	timer->value = timer->period - (clocks % (timer->period + 1));
+	return wraps;
+}
+
+static uint32_t quiet_span(APU* apu, uint32_t max_cycles)
+{
+	/* Number of upcoming cycles in which only the channel timers advance (no
+	   frame counter step, sample output, or DMC fetch/output change) */
+	uint32_t span = max_cycles;
+	if (apu->fc_reset_delay || apu->fc_next_step <= apu->cycles ||
+		(apu->dmc.bytes_remaining > 0 && !apu->dmc.sample_buf_filled))
+	{
+		return 0;
+	}
+
+	if (apu->mix_buf && apu->sample_countdown - 1 < span)
+		span = apu->sample_countdown - 1;
+	if (apu->fc_next_step - apu->cycles < span)
+		span = apu->fc_next_step - apu->cycles;
+
+	/* The DMC timer (clocked on even cycles) must not expire, unless the
+	   channel is silent with nothing buffered */
+	if ((!apu->dmc.silence || apu->dmc.sample_buf_filled) &&
+		2u * apu->dmc.timer.value + (apu->cycles & 1) < span)
+	{
+		span = 2u * apu->dmc.timer.value + (apu->cycles & 1);
+	}
+	return span;
+}
+
+static void dmc_advance_silent(DMCChannel* channel, uint32_t wraps)
+{
+	/* With no sample byte to load, timer expiries only cycle the bit
+	   counter (see dmc_clock) */
+	uint32_t to_reload = channel->bits_remaining ? channel->bits_remaining : 256;
+	if (wraps < to_reload)
+		channel->bits_remaining -= wraps;
+	else
+		channel->bits_remaining = 8 - ((wraps - to_reload) % 8);
+}
+
+static void run_quiet_span(APU* apu, uint32_t span)
+{
+	/* Same result as calling apu_tick() span times (see quiet_span) */
+	uint32_t even_cycles = (span + ((apu->cycles & 1) == 0)) / 2;
+	uint32_t wraps;
+
+	wraps = timer_advance(&apu->triangle.timer, span);
+	if (apu->triangle.lc.value && apu->triangle.lin_ctr.timer.value)
+		apu->triangle.phase = (apu->triangle.phase + wraps) & 0x1F;
+
+	apu->pulse1.phase = (apu->pulse1.phase + timer_advance(&apu->pulse1.timer, even_cycles)) & 7;
+	apu->pulse2.phase = (apu->pulse2.phase + timer_advance(&apu->pulse2.timer, even_cycles)) & 7;
+
+	wraps = timer_advance(&apu->noise.timer, even_cycles);
+	while (wraps--)
+		noise_shift(&apu->noise);
+
+	dmc_advance_silent(&apu->dmc, timer_advance(&apu->dmc.timer, even_cycles));
+	if (apu->mix_buf)
+		apu->sample_countdown -= span;
+	apu->cycles += span;
+}
 
-		/* Output sample */
-		if ((apu->cycles % 40) == 0)
+void apu_run(APU* apu, uint32_t cycles)
+{
+	/* Batched equivalent of apu_tick() for when nothing else (e.g., the CPU)
+	   needs to interleave with the APU. Only cycles that have side effects
+	   are clocked individually */
+	while (cycles > 0)
+	{
+		uint32_t span = quiet_span(apu, cycles);
+		if (span > 1)
 		{
-			apu->current_write_buf[apu->sample_buf_insert_pos] = pulse_out + tnd_out;
-			apu->sample_buf_insert_pos = (apu->sample_buf_insert_pos + 1) % apu->sample_buf_size;
-			if (apu->sample_buf_insert_pos == 0)
-			{
-				uint16_t* tmp = apu->current_write_buf;
-				apu->current_write_buf = apu->current_read_buf;
-				apu->current_read_buf = tmp;
-				//printf("Audio buffer full\n");
+			run_quiet_span(apu, span);
+			cycles -= span;
+		}
+		else
+		{
+			apu_tick(apu);
+			--cycles;
+		}
+	}
+}
 
-				apu->snd_cb(apu->current_read_buf, apu->sample_buf_size, apu->snd_userdata);
-			}
+void apu_flush(APU* apu)
+{
+	/* Hand off a partially filled buffer (e.g., at the end of a recording) */
+	apu_sync(apu);
+	if (apu->sample_buf_insert_pos > 0)
+		swap_buffers(apu);
+}
+
+void apu_copy_state(APU* dst, const APU* src)
+{
+	/* dst keeps its own output (buffers, callbacks, and recorders). When both
+	   produce the same format, it also picks up src's partially filled buffer
+	   so that the two continue sample for sample identically */
+	APU out = *dst;
+	uint8_t same_output = (src->sample_buf_size == out.sample_buf_size &&
+						   src->spec.sample_rate == out.spec.sample_rate &&
+						   src->spec.channels == out.spec.channels &&
+						   src->spec.filter == out.spec.filter);
+	*dst = *src;
+	dst->nes = out.nes;
+	dst->snd_cb = out.snd_cb;
+	dst->snd_userdata = out.snd_userdata;
+	dst->spec = out.spec;
+	memcpy(dst->pan_gain, out.pan_gain, sizeof(out.pan_gain));
+	dst->sample_buf_size = out.sample_buf_size;
+	dst->mix_buf = out.mix_buf;
+	dst->sample_buf1 = out.sample_buf1;
+	dst->sample_buf2 = out.sample_buf2;
+	dst->current_read_buf = out.current_read_buf;
+	dst->current_write_buf = out.current_write_buf;
+	dst->recorder = out.recorder;
+	dst->stem_recorder = out.stem_recorder;
+	dst->stem_buf = out.stem_buf;
+
+	if (same_output && dst->mix_buf)
+	{
+		memcpy(dst->mix_buf, src->mix_buf, src->sample_buf_insert_pos * src->spec.channels * sizeof(uint16_t));
+		if (dst->stem_buf)
+		{
+			if (src->stem_buf)
+				memcpy(dst->stem_buf, src->stem_buf, src->sample_buf_insert_pos * APU_STEM_CHANNELS * sizeof(uint16_t));
+			else
+				memset(dst->stem_buf, 0, src->sample_buf_insert_pos * APU_STEM_CHANNELS * sizeof(uint16_t));
 		}
 	}
-	++apu->cycles;
-}
\ No newline at end of file
+	else
+	{
+		dst->filter = out.filter;
+		dst->sample_period = out.sample_period;
+		dst->sample_period_frac = out.sample_period_frac;
+		dst->sample_frac_acc = out.sample_frac_acc;
+		dst->sample_countdown = out.sample_countdown;
+		dst->sample_buf_insert_pos = out.sample_buf_insert_pos;
+	}
+	post_events(dst);
+}
+
+void apu_set_recorder(APU* apu, Recorder* rec)
+{
+	apu->recorder = rec;
+}
+
+void apu_set_clock_rate(APU* apu, uint32_t clock_rate)
+{
+	/* Samples are taken on CPU cycles, so their spacing depends on how many
+	   of those the console runs per second */
+	apu_sync(apu);
+	set_sample_period(apu, clock_rate);
+	post_events(apu);
+}
+
+void apu_restart_output(APU* apu)
+{
+	/* Pending samples are dropped, and the filter and sample clock start
+	   over as if output began at this cycle */
+	apu_sync(apu);
+	set_sample_period(apu, apu->sample_period * apu->spec.sample_rate + apu->sample_period_frac);
+	audio_filter_init(&apu->filter, apu->spec.filter, apu->spec.sample_rate, apu->spec.channels);
+	apu->sample_buf_insert_pos = 0;
+	post_events(apu);
+}
+
+void apu_set_filter(APU* apu, AudioFilterMode mode)
+{
+	apu->spec.filter = mode;
+	audio_filter_init(&apu->filter, mode, apu->spec.sample_rate, apu->spec.channels);
+}
+
+int apu_set_stem_recorder(APU* apu, Recorder* rec)
+{
+	/* Stems are only collected while someone is listening */
+	if (rec && !apu->stem_buf)
+	{
+		apu->stem_buf = (uint16_t*)calloc(apu->sample_buf_size * APU_STEM_CHANNELS, sizeof(uint16_t));
+		if (!apu->stem_buf)
+		{
+			fprintf(stderr, "Error: could not allocate audio stem buffer (%d)\n", errno);
+			return -1;
+		}
+	}
+	else if (!rec)
+	{
+		free(apu->stem_buf);
+		apu->stem_buf = NULL;
+	}
+	apu->stem_recorder = rec;
+	return 0;
+}
@@ -3,6 +3,14 @@
 
 #include <stdint.h>
 
+#include "audio.h"
+#include "cpu.h"
+#include "recorder.h"
+
+#define APU_SAMPLE_RATE 44744  /* Default output rate (one sample every 40 CPU cycles) */
+#define APU_DEFAULT_BUFFER_SIZE 8192
+#define APU_STEM_CHANNELS 6  /* Pulse 1, pulse 2, triangle, noise, DMC, mono mix */
+
 typedef struct {
 	uint16_t value;
 	uint16_t period;
@@ -89,7 +97,10 @@ typedef enum {
 	FC_5STEP
 } FCSequence;
 
-typedef void (*SoundCallback)(uint16_t* read_buf, uint32_t buf_size, void* userdata);
+/* Called with each filled buffer. The buffer holds buf_size sample frames in
+   the negotiated AudioSpec format, and stays valid until the next callback
+   (of any instance sharing it, for a caller-owned buffer) */
+typedef void (*SoundCallback)(void* read_buf, uint32_t buf_size, void* userdata);
 
 struct NES;
 struct NESInitInfo;
@@ -107,12 +118,29 @@ typedef struct {
 	uint8_t fc_irq_enabled;
 	uint8_t fc_irq_fired;
 	uint8_t fc_reset_delay;
+	uint16_t fc_next_step;
+
+	AudioSpec spec;
+	AudioFilter filter;
+	uint16_t pan_gain[2][AUDIO_PAN_CHANNELS];  /* Left/right, 8.8 fixed point */
+
+	/* Samples are taken every sample_period + (sample_period_frac / sample_rate)
+	   CPU cycles on average */
+	uint32_t sample_period;
+	uint32_t sample_period_frac;
+	uint32_t sample_frac_acc;
+	uint32_t sample_countdown;
 
-	uint32_t sample_buf_size;
+	uint32_t sample_buf_size;  /* In sample frames */
 	uint32_t sample_buf_insert_pos;
-	uint16_t *sample_buf1, *sample_buf2;
-	uint16_t *current_read_buf, *current_write_buf;
+	uint16_t* mix_buf;  /* Interleaved native samples. NULL without output */
+	void *sample_buf1, *sample_buf2;  /* Converted to the output format. NULL if caller-owned */
+	void *current_read_buf, *current_write_buf;
+	Recorder* recorder;
+	Recorder* stem_recorder;
+	uint16_t* stem_buf;  /* Interleaved individual channel outputs */
 	uint32_t cycles;
+	uint64_t sync_cycle;  /* Master clock time the APU has been run up to */
 } APU;
 
 int apu_init(APU* apu, struct NES* nes, struct NESInitInfo* init_info);
@@ -120,5 +148,14 @@ void apu_cleanup(APU* apu);
 void apu_write(APU* apu, uint16_t addr, uint8_t val);
 uint8_t apu_read (APU* apu, uint16_t addr);
 void apu_tick(APU* apu);
+void apu_run(APU* apu, uint32_t cycles);
+void apu_sync(APU* apu);
+void apu_flush(APU* apu);
+void apu_copy_state(APU* dst, const APU* src);
+void apu_set_recorder(APU* apu, Recorder* rec);
+int apu_set_stem_recorder(APU* apu, Recorder* rec);
+void apu_set_clock_rate(APU* apu, uint32_t clock_rate);  /* CPU cycles per second (NTSC by default) */
+void apu_set_filter(APU* apu, AudioFilterMode mode);
+void apu_restart_output(APU* apu);  /* Drops pending samples and resets the filter */
 
 #endif
@@ -0,0 +1,132 @@
+/* Output filtering and sample format conversion. Both are done once per
+   buffer. Conversion uses simple loops over contiguous arrays so that the
+   compiler can vectorize them */
+
+#include <string.h>
+
+#include "audio.h"
+
+#define PI 3.14159265358979f
+
+static void init_highpass(AudioFilterStage* stage, float cutoff, uint32_t sample_rate)
+{
+	/* y[i] = a * (y[i-1] + x[i] - x[i-1]) */
+	float rc = 1.0f / (2 * PI * cutoff);
+	float a = rc / (rc + (1.0f / sample_rate));
+	stage->b0 = a;
+	stage->b1 = -a;
+	stage->a1 = a;
+}
+
+static void init_lowpass(AudioFilterStage* stage, float cutoff, uint32_t sample_rate)
+{
+	/* y[i] = y[i-1] + a * (x[i] - y[i-1]) */
+	float dt = 1.0f / sample_rate;
+	float a = dt / ((1.0f / (2 * PI * cutoff)) + dt);
+	stage->b0 = a;
+	stage->b1 = 0;
+	stage->a1 = 1.0f - a;
+}
+
+void audio_filter_init(AudioFilter* filter, AudioFilterMode mode, uint32_t sample_rate, uint8_t channels)
+{
+	uint8_t i;
+	memset(filter, 0, sizeof(AudioFilter));
+	filter->mode = mode;
+	filter->channels = channels;
+
+	/* See https://wiki.nesdev.com/w/index.php/APU_Mixer */
+	for (i = 0; i < 2; ++i)
+	{
+		init_highpass(&filter->stages[i][0], 90.0f, sample_rate);
+		init_highpass(&filter->stages[i][1], 440.0f, sample_rate);
+
+		/* Can't filter above Nyquist */
+		if (sample_rate > 28000)
+			init_lowpass(&filter->stages[i][2], 14000.0f, sample_rate);
+		else
+			filter->stages[i][2].b0 = 1.0f;
+	}
+}
+
+static float filter_sample(AudioFilterStage* stages, float x)
+{
+	uint8_t i;
+	for (i = 0; i < AUDIO_FILTER_STAGES; ++i)
+	{
+		AudioFilterStage* s = &stages[i];
+		/* The tiny bias keeps decaying outputs from going denormal */
+		float y = s->b0*x + s->b1*s->x1 + s->a1*s->y1 + 1e-20f;
+		s->x1 = x;
+		s->y1 = y;
+		x = y;
+	}
+	return x;
+}
+
+void audio_filter_run(AudioFilter* filter, uint16_t* samples, uint32_t frames)
+{
+	/* The filters are recursive, so each channel is processed in order.
+	   The high-pass stages remove the mix's DC offset, so the output is
+	   recentered (and clipped) around the unsigned midpoint */
+	uint32_t i;
+	uint8_t ch;
+	if (filter->mode == AUDIO_FILTER_NONE)
+		return;
+
+	for (i = 0; i < frames; ++i)
+	{
+		for (ch = 0; ch < filter->channels; ++ch)
+		{
+			uint16_t* sample = &samples[i*filter->channels + ch];
+			float y = filter_sample(filter->stages[ch], *sample) + 32768.0f;
+			if (y < 0)
+				y = 0;
+			else if (y > 65535.0f)
+				y = 65535.0f;
+			*sample = (uint16_t)y;
+		}
+	}
+}
+
+uint32_t audio_sample_size(AudioFormat format)
+{
+	switch (format)
+	{
+		case AUDIO_FORMAT_F32:
+			return sizeof(float);
+		default:
+			return sizeof(uint16_t);
+	}
+}
+
+static void convert_s16(int16_t* restrict dst, const uint16_t* restrict src, uint32_t count)
+{
+	uint32_t i;
+	for (i = 0; i < count; ++i)
+		dst[i] = (int16_t)(src[i] ^ 0x8000);
+}
+
+static void convert_f32(float* restrict dst, const uint16_t* restrict src, uint32_t count)
+{
+	uint32_t i;
+	for (i = 0; i < count; ++i)
+		dst[i] = ((int32_t)src[i] - 32768) * (1.0f / 32768.0f);
+}
+
+void audio_convert(void* dst, const uint16_t* src, uint32_t count, AudioFormat format)
+{
+	/* Count is in samples (i.e., frames * channels) */
+	switch (format)
+	{
+		case AUDIO_FORMAT_S16:
+			convert_s16((int16_t*)dst, src, count);
+			break;
+		case AUDIO_FORMAT_F32:
+			convert_f32((float*)dst, src, count);
+			break;
+		default:
+			memcpy(dst, src, count * sizeof(uint16_t));
+			break;
+	}
+}
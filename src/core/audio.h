@@ -0,0 +1,51 @@
+#ifndef AUDIO_H
+#define AUDIO_H
+
+#include <stdint.h>
+
+#define AUDIO_PAN_CHANNELS 5  /* Pulse 1, pulse 2, triangle, noise, DMC */
+
+typedef enum {
+	AUDIO_FORMAT_U16 = 0,  /* Native APU output */
+	AUDIO_FORMAT_S16,
+	AUDIO_FORMAT_F32
+} AudioFormat;
+
+typedef enum {
+	AUDIO_FILTER_NES = 0,  /* High-pass at 90Hz and 440Hz, low-pass at 14kHz */
+	AUDIO_FILTER_NONE
+} AudioFilterMode;
+
+/* Host audio output parameters. Zeroed fields select the defaults */
+typedef struct {
+	AudioFormat format;
+	AudioFilterMode filter;
+	uint32_t sample_rate;  /* Default: APU_SAMPLE_RATE */
+	uint8_t channels;      /* 1 (mono) or 2 (stereo). Default: 1 */
+	uint32_t buffer_size;  /* Sample frames per block handed to the frontend */
+	float pan[AUDIO_PAN_CHANNELS];  /* Stereo only. -1 (left) to 1 (right) */
+} AudioSpec;
+
+/* First-order IIR filter section */
+typedef struct {
+	float b0, b1, a1;
+	float x1, y1;
+} AudioFilterStage;
+
+#define AUDIO_FILTER_STAGES 3
+
+/* The NES output filter chain, modeled after the RC filters on the board.
+   Operates on native samples, recentering them around the u16 midpoint */
+typedef struct {
+	AudioFilterMode mode;
+	uint8_t channels;
+	AudioFilterStage stages[2][AUDIO_FILTER_STAGES];
+} AudioFilter;
+
+void audio_filter_init(AudioFilter* filter, AudioFilterMode mode, uint32_t sample_rate, uint8_t channels);
+void audio_filter_run(AudioFilter* filter, uint16_t* samples, uint32_t frames);
+
+uint32_t audio_sample_size(AudioFormat format);
+void audio_convert(void* dst, const uint16_t* src, uint32_t count, AudioFormat format);
+
+#endif
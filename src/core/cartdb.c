@@ -0,0 +1,198 @@
+/* Per-ROM header override database. The source is a text file with one ROM
+   per line:
+
+	<CRC-32> key=value ...
+
+   Keys are mapper, submapper, mirroring (horizontal, vertical, or 4-screen),
+   prg_rom, chr_rom, prg_ram, prg_nvram, chr_ram (sizes in bytes), and tv
+   (ntsc or pal). Blank lines and lines starting with '#' are ignored.
+   Entries are sorted by CRC on load so that lookups are a binary search */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cartdb.h"
+
+#define MAX_LINE_LENGTH 512
+
+static int parse_field(CartridgeOverride* entry, char* key, char* val)
+{
+	char* end;
+	unsigned long num = strtoul(val, &end, 0);
+	int is_num = (end != val && *end == '\0');
+
+	if (strcmp(key, "mirroring") == 0)
+	{
+		if (strcmp(val, "horizontal") == 0)
+			entry->header.mirror_mode = MIRRORING_HORIZONTAL;
+		else if (strcmp(val, "vertical") == 0)
+			entry->header.mirror_mode = MIRRORING_VERTICAL;
+		else if (strcmp(val, "4-screen") == 0)
+			entry->header.mirror_mode = MIRRORING_4SCREEN;
+		else
+			return -1;
+		entry->fields |= CARTDB_MIRRORING;
+	}
+	else if (strcmp(key, "tv") == 0)
+	{
+		if (strcmp(val, "ntsc") == 0)
+			entry->header.video_mode = VIDEO_NTSC;
+		else if (strcmp(val, "pal") == 0)
+			entry->header.video_mode = VIDEO_PAL;
+		else
+			return -1;
+		entry->fields |= CARTDB_TV_SYSTEM;
+	}
+	else if (!is_num)
+		return -1;
+	else if (strcmp(key, "mapper") == 0 && num < 4096)
+	{
+		entry->header.mapper_num = (uint16_t)num;
+		entry->fields |= CARTDB_MAPPER;
+	}
+	else if (strcmp(key, "submapper") == 0 && num < 16)
+	{
+		entry->header.submapper = (uint8_t)num;
+		entry->fields |= CARTDB_SUBMAPPER;
+	}
+	else if (strcmp(key, "prg_rom") == 0)
+	{
+		entry->header.prg_rom_size = (uint32_t)num;
+		entry->fields |= CARTDB_PRG_ROM;
+	}
+	else if (strcmp(key, "chr_rom") == 0)
+	{
+		entry->header.chr_rom_size = (uint32_t)num;
+		entry->fields |= CARTDB_CHR_ROM;
+	}
+	else if (strcmp(key, "prg_ram") == 0)
+	{
+		entry->header.prg_ram_size = (uint32_t)num;
+		entry->fields |= CARTDB_PRG_RAM;
+	}
+	else if (strcmp(key, "prg_nvram") == 0)
+	{
+		entry->header.prg_nvram_size = (uint32_t)num;
+		entry->fields |= CARTDB_PRG_NVRAM;
+	}
+	else if (strcmp(key, "chr_ram") == 0)
+	{
+		entry->header.chr_ram_size = (uint32_t)num;
+		entry->fields |= CARTDB_CHR_RAM;
+	}
+	else
+		return -1;
+	return 0;
+}
+
+static int parse_line(CartridgeOverride* entry, char* line, uint32_t line_num)
+{
+	char* tok;
+	char* end;
+
+	memset(entry, 0, sizeof(CartridgeOverride));
+	if (!(tok = strtok(line, " \t\r\n")) || tok[0] == '#')
+		return 0;
+	entry->crc = (uint32_t)strtoul(tok, &end, 16);
+	if (end == tok || *end != '\0')
+	{
+		fprintf(stderr, "Warning: invalid CRC in cartridge database (line %u)\n", line_num);
+		return 0;
+	}
+
+	while ((tok = strtok(NULL, " \t\r\n")))
+	{
+		char* val = strchr(tok, '=');
+		if (val)
+			*val++ = '\0';
+		if (!val || parse_field(entry, tok, val) != 0)
+			fprintf(stderr, "Warning: ignoring invalid field in cartridge database (line %u)\n", line_num);
+	}
+	return entry->fields != 0;
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+	uint32_t crc_a = ((CartridgeOverride*)a)->crc;
+	uint32_t crc_b = ((CartridgeOverride*)b)->crc;
+	return (crc_a > crc_b) - (crc_a < crc_b);
+}
+
+int cartdb_load(CartridgeDB* db, const char* path)
+{
+	char line[MAX_LINE_LENGTH];
+	CartridgeOverride entry;
+	uint32_t capacity = 0, line_num = 0;
+	FILE* file;
+	memset(db, 0, sizeof(CartridgeDB));
+
+	if (!(file = fopen(path, "r")))
+	{
+		fprintf(stderr, "Error: unable to open cartridge database (code %d)\n", errno);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), file))
+	{
+		if (!parse_line(&entry, line, ++line_num))
+			continue;
+		if (db->count == capacity)
+		{
+			CartridgeOverride* entries;
+			capacity = capacity ? capacity * 2 : 256;
+			if (!(entries = (CartridgeOverride*)realloc(db->entries, capacity * sizeof(CartridgeOverride))))
+			{
+				fprintf(stderr, "Error: unable to allocate memory for cartridge database (code %d)\n", errno);
+				cartdb_free(db);
+				fclose(file);
+				return -1;
+			}
+			db->entries = entries;
+		}
+		db->entries[db->count++] = entry;
+	}
+	fclose(file);
+
+	qsort(db->entries, db->count, sizeof(CartridgeOverride), compare_entries);
+	return 0;
+}
+
+void cartdb_free(CartridgeDB* db)
+{
+	free(db->entries);
+	memset(db, 0, sizeof(CartridgeDB));
+}
+
+const CartridgeOverride* cartdb_find(const CartridgeDB* db, uint32_t crc)
+{
+	CartridgeOverride key;
+	if (!db || db->count == 0)
+		return NULL;
+	key.crc = crc;
+	return (const CartridgeOverride*)bsearch(&key, db->entries, db->count,
+											 sizeof(CartridgeOverride), compare_entries);
+}
+
+void cartdb_apply(const CartridgeOverride* override, CartridgeHeader* header)
+{
+	const CartridgeHeader* src = &override->header;
+	if (override->fields & CARTDB_MAPPER)
+		header->mapper_num = src->mapper_num;
+	if (override->fields & CARTDB_SUBMAPPER)
+		header->submapper = src->submapper;
+	if (override->fields & CARTDB_MIRRORING)
+		header->mirror_mode = src->mirror_mode;
+	if (override->fields & CARTDB_PRG_ROM)
+		header->prg_rom_size = src->prg_rom_size;
+	if (override->fields & CARTDB_CHR_ROM)
+		header->chr_rom_size = src->chr_rom_size;
+	if (override->fields & CARTDB_PRG_RAM)
+		header->prg_ram_size = src->prg_ram_size;
+	if (override->fields & CARTDB_PRG_NVRAM)
+		header->prg_nvram_size = src->prg_nvram_size;
+	if (override->fields & CARTDB_CHR_RAM)
+		header->chr_ram_size = src->chr_ram_size;
+	if (override->fields & CARTDB_TV_SYSTEM)
+		header->video_mode = src->video_mode;
+}
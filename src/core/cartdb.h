@@ -0,0 +1,38 @@
+#ifndef CARTDB_H
+#define CARTDB_H
+
+#include <stdint.h>
+
+#include "cartridge.h"
+
+/* Header fields replaced by an override */
+#define CARTDB_MAPPER     0x001
+#define CARTDB_SUBMAPPER  0x002
+#define CARTDB_MIRRORING  0x004
+#define CARTDB_PRG_ROM    0x008
+#define CARTDB_CHR_ROM    0x010
+#define CARTDB_PRG_RAM    0x020
+#define CARTDB_PRG_NVRAM  0x040
+#define CARTDB_CHR_RAM    0x080
+#define CARTDB_TV_SYSTEM  0x100
+
+typedef struct {
+	uint32_t crc;
+	uint16_t fields;
+	CartridgeHeader header;  /* Only the fields above are used */
+} CartridgeOverride;
+
+/* Corrections for ROMs with bad or incomplete headers, keyed by the CRC-32
+   of everything after the 16-byte header. Loaded once and shared (read-only)
+   by any number of instances */
+typedef struct CartridgeDB {
+	CartridgeOverride* entries;  /* Sorted by CRC */
+	uint32_t count;
+} CartridgeDB;
+
+int cartdb_load(CartridgeDB* db, const char* path);
+void cartdb_free(CartridgeDB* db);
+const CartridgeOverride* cartdb_find(const CartridgeDB* db, uint32_t crc);
+void cartdb_apply(const CartridgeOverride* override, CartridgeHeader* header);
+
+#endif
@@ -1,14 +1,186 @@
-/* Reads in NES ROM files (iNES ROMS only, for now) */
+/* Reads in NES ROM files (iNES and NES 2.0) */
 
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
+#include "cartdb.h"
 #include "cartridge.h"
+#include "crc32.h"
 
 #define max(x, y) ((x) > (y) ? (x) : (y))
+#define HASH_CHUNK_SIZE 0x10000
+#define ARENA_ALIGN(x) (((x) + 63) & ~(size_t)63)  /* Cache line */
+#define ARENA_HUGE_PAGE_SIZE 0x200000
+
+struct ImageRefs {
+	atomic_uint count;
+};
+
+static uint8_t* map_rom(Cartridge* cart, FILE* rom, long file_size)
+{
+	/* Pages are never written, so they stay shared between processes */
+	void* image = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fileno(rom), 0);
+	if (image == MAP_FAILED)
+		return NULL;
+	if (!(cart->rom_image_refs = (struct ImageRefs*)malloc(sizeof(struct ImageRefs))))
+	{
+		munmap(image, file_size);
+		return NULL;
+	}
+	atomic_init(&cart->rom_image_refs->count, 1);
+	return (uint8_t*)image;
+}
+
+static uint8_t* copy_rom(Cartridge* cart, const void* image, size_t size)
+{
+	/* Images loaded from memory get a mapping of their own, shared by forks
+	   like a file's */
+	void* copy = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (copy == MAP_FAILED)
+		return NULL;
+	memcpy(copy, image, size);
+	if (mprotect(copy, size, PROT_READ) != 0 ||
+		!(cart->rom_image_refs = (struct ImageRefs*)malloc(sizeof(struct ImageRefs))))
+	{
+		munmap(copy, size);
+		return NULL;
+	}
+	atomic_init(&cart->rom_image_refs->count, 1);
+	return (uint8_t*)copy;
+}
+
+static uint8_t* map_arena(size_t size)
+{
+	void* arena = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (arena == MAP_FAILED)
+	{
+		fprintf(stderr, "Error: unable to allocate cartridge memory (code %d)\n", errno);
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	/* Only worthwhile when the arena spans at least one huge page */
+	if (size >= ARENA_HUGE_PAGE_SIZE)
+		madvise(arena, size, MADV_HUGEPAGE);
+#endif
+	return (uint8_t*)arena;
+}
+
+static int read_rom(Cartridge* cart, FILE* rom, uint16_t rom_start_ofs)
+{
+	/* Fallback for files that can't be mapped. Each instance gets its own
+	   copy (in the arena) */
+	if (fseek(rom, rom_start_ofs, SEEK_SET) != 0 || fread(cart->prg_rom.data, 1, cart->prg_rom.size, rom) != cart->prg_rom.size)
+	{
+		fprintf(stderr, "Error: unable to read PRG ROM (code %d)\n", errno);
+		return -1;
+	}
+	if (!cart->chr_is_ram && fread(cart->chr.data, 1, cart->chr.size, rom) != cart->chr.size)
+	{
+		fprintf(stderr, "Error: unable to read CHR ROM (code %d)\n", errno);
+		return -1;
+	}
+	return 0;
+}
+
+int cartridge_alloc(Cartridge* cart, const MapperInfo* mapper_info, void** mapper_data)
+{
+	/* One zeroed allocation holds the mapper state followed by CHR, extra
+	   VRAM, PRG RAM, and PRG ROM (in that order, for locality while
+	   rendering). Memory already mapped from a file is skipped. Each region
+	   starts on a cache line */
+	Memory* mems[4];
+	Memory* regions[4];
+	size_t offsets[4];
+	size_t size = ARENA_ALIGN(mapper_info->data_size);
+	uint8_t count = 0, i;
+
+	mems[0] = &cart->chr;
+	mems[1] = &cart->vram;
+	mems[2] = &cart->prg_ram;
+	mems[3] = &cart->prg_rom;
+	for (i = 0; i < 4; ++i)
+	{
+		if (mems[i]->size && !mems[i]->data)
+		{
+			regions[count] = mems[i];
+			offsets[count++] = size;
+			size += ARENA_ALIGN(mems[i]->size);
+		}
+	}
+
+	cart->mapper_data_size = mapper_info->data_size;
+	*mapper_data = NULL;
+	if (size == 0)
+		return 0;
+	if (!(cart->arena = map_arena(size)))
+		return -1;
+	cart->arena_size = size;
+	for (i = 0; i < count; ++i)
+		regions[i]->data = cart->arena + offsets[i];
+	if (mapper_info->data_size)
+		*mapper_data = cart->arena;
+	return 0;
+}
+
+static int map_nvram(Cartridge* cart, char* rom_path)
+{
+	/* Battery-backed RAM is a shared mapping of the save file (the ROM path
+	   with a .sav extension), so writes land in the page cache directly and
+	   there is no explicit save step */
+	char* save_path;
+	char* ext;
+	struct stat st;
+	void* nvram;
+	int fd;
+
+	if (!(save_path = (char*)malloc(strlen(rom_path) + 5)))
+		return -1;
+	strcpy(save_path, rom_path);
+	if (!(ext = strrchr(save_path, '.')) || strchr(ext, '/'))
+		ext = save_path + strlen(save_path);
+	strcpy(ext, ".sav");
+	fd = open(save_path, O_RDWR | O_CREAT, 0644);
+	free(save_path);
+	if (fd < 0)
+		return -1;
+
+	/* New (or short) save files are zero-filled */
+	if (fstat(fd, &st) != 0 || ((uint32_t)st.st_size < cart->prg_ram.size && ftruncate(fd, cart->prg_ram.size) != 0))
+	{
+		close(fd);
+		return -1;
+	}
+	nvram = mmap(NULL, cart->prg_ram.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (nvram == MAP_FAILED)
+		return -1;
+
+	cart->prg_ram.data = (uint8_t*)nvram;
+	cart->nvram_mapped = 1;
+	return 0;
+}
+
+static uint32_t rom_size(uint8_t lsb, uint8_t msb, uint32_t unit)
+{
+	/* NES 2.0 exponent-multiplier notation (EEEEEEMM): 2^E * (MM*2 + 1) */
+	if (msb == 0xF)
+		return (lsb >> 2) < 30 ? (1u << (lsb >> 2)) * ((lsb & 3) * 2 + 1) : 0xFFFFFFFF;
+	return ((msb << 8) | lsb) * unit;
+}
+
+static uint32_t ram_size(uint8_t shift)
+{
+	/* NES 2.0 RAM sizes are 64 << shift bytes, or none */
+	return shift ? 64u << shift : 0;
+}
 
 /* iNES header format:
 	0-3: "NES"<EOF>
@@ -29,14 +201,182 @@
 	  9: Flags 9
 		  0: TV system (0=NTSC, 1=PAL)
 	    2-7: Reserved (should be 0)
-  10-15: Reserved (should be 0) */
-int cartridge_load(Cartridge* cart, char* path)
+  10-15: Reserved (should be 0)
+
+   NES 2.0 headers redefine bytes 8-15:
+	  8: Mapper bits 8-11 (0-3), submapper (4-7)
+	  9: PRG ROM size MSB (0-3), CHR ROM size MSB (4-7). An MSB of $F means
+		 bytes 4/5 are in exponent-multiplier form
+	 10: PRG RAM size shift (0-3), PRG NVRAM size shift (4-7)
+	 11: CHR RAM size shift (0-3), CHR NVRAM size shift (4-7)
+	 12: Timing (0=NTSC, 1=PAL, 2=multi-region, 3=Dendy)
+  13-15: Console type, miscellaneous ROMs, and default expansion device */
+int cartridge_parse_header(CartridgeHeader* info, const uint8_t* header)
+{
+	/* First 4 bytes of header are "NES" + EOF */
+	if (memcmp(header, "NES\x1A", 4) != 0)
+		return -1;
+
+	memset(info, 0, sizeof(CartridgeHeader));
+	info->nes2 = (header[7] & 0x0C) == 0x08;
+	info->mapper_num = ((header[6] & 0xF0) >> 4) | (header[7] & 0xF0);
+	if (info->nes2)
+	{
+		info->mapper_num |= (header[8] & 0x0F) << 8;
+		info->submapper = header[8] >> 4;
+		info->prg_rom_size = rom_size(header[4], header[9] & 0x0F, 0x4000);
+		info->chr_rom_size = rom_size(header[5], header[9] >> 4, 0x2000);
+		info->prg_ram_size = ram_size(header[10] & 0x0F);
+		info->prg_nvram_size = ram_size(header[10] >> 4);
+		info->chr_ram_size = ram_size(header[11] & 0x0F);
+
+		/* Multi-region games run as NTSC. Dendy timing is closest to PAL */
+		info->video_mode = (header[12] & 1) ? VIDEO_PAL : VIDEO_NTSC;
+	}
+	else
+	{
+		info->prg_rom_size = 0x4000 * header[4];
+		info->chr_rom_size = 0x2000 * header[5];
+		info->chr_ram_size = header[5] ? 0 : 0x2000;
+		if (header[6] & 0x02)
+			info->prg_nvram_size = 0x2000 * max(header[8], 1);
+		else
+			info->prg_ram_size = 0x2000 * max(header[8], 1);
+		info->video_mode = (header[9] & 0x01) ? VIDEO_PAL : VIDEO_NTSC;
+	}
+
+	if (header[6] & 0x08)
+		info->mirror_mode = MIRRORING_4SCREEN;
+	else if (header[6] & 0x01)
+		info->mirror_mode = MIRRORING_VERTICAL;
+	else
+		info->mirror_mode = MIRRORING_HORIZONTAL;
+	info->rom_start_ofs = 16 + ((header[6] & 0x04) ? 0x200 : 0);  /* Skip header and trainer */
+	return 0;
+}
+
+static int hash_image(Cartridge* cart, FILE* rom, long file_size, uint32_t* crc)
+{
+	/* Everything after the header, like ROM databases use */
+	uint8_t buf[HASH_CHUNK_SIZE];
+	long remaining = file_size - 16;
+	size_t n;
+
+	if (cart->rom_image)
+	{
+		*crc = crc32_update(0, cart->rom_image + 16, remaining);
+		return 0;
+	}
+	*crc = 0;
+	if (fseek(rom, 16, SEEK_SET) != 0)
+		return -1;
+	for (; remaining > 0; remaining -= n)
+	{
+		n = remaining < HASH_CHUNK_SIZE ? remaining : HASH_CHUNK_SIZE;
+		if (fread(buf, 1, n, rom) != n)
+			return -1;
+		*crc = crc32_update(*crc, buf, n);
+	}
+	return 0;
+}
+
+static uint32_t round_ram_size(uint32_t size, uint32_t min_size)
+{
+	/* Bank slots can't be smaller than the mapper's granularity */
+	return size ? (size + min_size - 1) & ~(min_size - 1) : 0;
+}
+
+static int load_board(Cartridge* cart, FILE* rom, long file_size, const uint8_t* header, char* path,
+					  const CartridgeDB* db, uint8_t volatile_nvram)
+{
+	/* Sets up the board from its header. ROM comes from the image when there
+	   is one, otherwise it is read from the file. The cartridge is unloaded on
+	   failure */
+	CartridgeHeader info;
+	const CartridgeOverride* override;
+	const MapperInfo* mapper_info;
+	void* mapper_data;
+	uint32_t crc;
+
+	if (cartridge_parse_header(&info, header) != 0)
+	{
+		fprintf(stderr, "Error: invalid ROM image\n");
+		cartridge_unload(cart);
+		return -1;
+	}
+
+	/* Correct known bad headers */
+	if (db && db->count > 0)
+	{
+		if (hash_image(cart, rom, file_size, &crc) != 0)
+		{
+			fprintf(stderr, "Error: unable to read ROM image (code %d)\n", errno);
+			cartridge_unload(cart);
+			return -1;
+		}
+		if ((override = cartdb_find(db, crc)))
+			cartdb_apply(override, &info);
+	}
+
+	/* RAM is sized exactly as described (rounded up to whole bank slots). A
+	   board with no CHR at all still gets CHR RAM so the PPU has something
+	   to fetch from */
+	cart->prg_rom.size = info.prg_rom_size;
+	cart->prg_ram.size = round_ram_size(info.prg_ram_size + info.prg_nvram_size, ADDRESSABLE_PRG_RAM);
+	cart->chr_is_ram = (info.chr_rom_size == 0);
+	cart->chr.size = cart->chr_is_ram ? round_ram_size(max(info.chr_ram_size, 1), ADDRESSABLE_CHR) :
+										info.chr_rom_size;
+	cart->has_nvram = (info.prg_nvram_size != 0);
+	cart->vram.size = (info.mirror_mode == MIRRORING_4SCREEN) ? 0x800 : 0;
+	cart->mirror_mode = info.mirror_mode;
+	cart->video_mode = info.video_mode;
+	cart->board_crc = crc32_update(0, (const uint8_t*)&info, sizeof(info));  /* Zeroed when parsed */
+
+	if (info.rom_start_ofs + (unsigned long)info.prg_rom_size + info.chr_rom_size > (unsigned long)file_size)
+	{
+		fprintf(stderr, "Error: ROM image is truncated\n");
+		cartridge_unload(cart);
+		return -1;
+	}
+	if (!(mapper_info = mapper_get_info(info.mapper_num)))
+	{
+		cartridge_unload(cart);
+		return -1;
+	}
+
+	/* Load ROM */
+	if (cart->rom_image)
+	{
+		cart->prg_rom.data = cart->rom_image + info.rom_start_ofs;
+		if (!cart->chr_is_ram)
+			cart->chr.data = cart->prg_rom.data + cart->prg_rom.size;
+	}
+	if (cart->has_nvram && !volatile_nvram && map_nvram(cart, path) != 0)
+		fprintf(stderr, "Warning: unable to open save file. Battery-backed RAM will not be saved (code %d)\n", errno);
+
+	/* Everything else comes from the arena */
+	if (cartridge_alloc(cart, mapper_info, &mapper_data) != 0 ||
+		(!cart->rom_image && read_rom(cart, rom, info.rom_start_ofs) != 0))
+	{
+		cartridge_unload(cart);
+		return -1;
+	}
+
+	if (mapper_init(&cart->mapper, (struct Cartridge*)cart, mapper_info, mapper_data) != 0)
+	{
+		fprintf(stderr, "Error: unable to initialize mapper\n");
+		cartridge_unload(cart);
+		return -1;
+	}
+	return 0;
+}
+
+int cartridge_load(Cartridge* cart, char* path, const CartridgeDB* db, uint8_t volatile_nvram)
 {
 	FILE* rom;
 	uint8_t header[16];
-	uint8_t mapper_num;
-	uint16_t rom_start_ofs = 0;
 	long file_size;
+	int result;
 	memset(cart, 0, sizeof(Cartridge));
 
 	if (!(rom = fopen(path, "rb")))
@@ -57,96 +397,270 @@ int cartridge_load(Cartridge* cart, char* path)
 		return -1;
 	}
 
-	/* First 4 bytes of header are "NES" + EOF */
-	if (memcmp(header, "NES\x1A", 4) != 0)
+	/* The image is mapped read-only so that instances running the same game
+	   share its pages, and nothing is read until it is touched */
+	if ((cart->rom_image = map_rom(cart, rom, file_size)))
+		cart->rom_image_size = file_size;
+
+	result = load_board(cart, rom, file_size, header, path, db, volatile_nvram);
+	fclose(rom);
+	return result;
+}
+
+int cartridge_load_memory(Cartridge* cart, const void* image, size_t size, const CartridgeDB* db)
+{
+	/* The image is copied, so the caller's buffer can go away. There is no
+	   save file, so battery-backed RAM is volatile */
+	memset(cart, 0, sizeof(Cartridge));
+	if (size < 0x4010)
 	{
-		fprintf(stderr, "Error: invalid ROM image\n");
-		fclose(rom);
+		fprintf(stderr, "Error: input file too small\n");
 		return -1;
 	}
+	if (!(cart->rom_image = copy_rom(cart, image, size)))
+	{
+		fprintf(stderr, "Error: unable to allocate ROM image (code %d)\n", errno);
+		return -1;
+	}
+	cart->rom_image_size = size;
+	return load_board(cart, NULL, (long)size, cart->rom_image, NULL, db, 1);
+}
 
-	/* Parse header */
-	cart->prg_rom.size = 0x4000 * header[4];
-	cart->chr.size = 0x2000 * max(header[5], 1);
-	cart->prg_ram.size = 0x2000 * max(header[8], 1);
-	cart->has_nvram = (header[6] >> 1) & 1;
-	mapper_num = ((header[6] & 0xF0) >> 4) | (header[7] & 0xF0);
-
-	if (header[6] & 0x08)
-		cart->mirror_mode = MIRRORING_4SCREEN;
-	else if (header[6] & 0x01)
-		cart->mirror_mode = MIRRORING_VERTICAL;
-	else
-		cart->mirror_mode = MIRRORING_HORIZONTAL;
-	rom_start_ofs = (header[6] & 0x04) ? 0x200 : 0;  /* Skip over trainer */
-	cart->video_mode = (header[9] & 0x01) ? VIDEO_PAL : VIDEO_NTSC;
+void cartridge_unload(Cartridge* cart)
+{
+	/* Make sure the save is on disk before the mapping goes away */
+	if (cart->nvram_mapped)
+	{
+		msync(cart->prg_ram.data, cart->prg_ram.size, MS_SYNC);
+		munmap(cart->prg_ram.data, cart->prg_ram.size);
+	}
+	if (cart->rom_image && atomic_fetch_sub(&cart->rom_image_refs->count, 1) == 1)
+	{
+		munmap(cart->rom_image, cart->rom_image_size);
+		free(cart->rom_image_refs);
+	}
+	if (cart->arena)
+		munmap(cart->arena, cart->arena_size);
+	mapper_cleanup(&cart->mapper);
+	memset(cart, 0, sizeof(Cartridge));
+}
 
-	/* Load ROM */
-	if (!(cart->prg_rom.data = (uint8_t*)malloc(cart->prg_rom.size)))
+int cartridge_copy_state(Cartridge* dst, const Cartridge* src)
+{
+	/* Both cartridges must have been loaded from the same ROM. ROM mapped
+	   from the image is shared, so only the arena (and the save file's RAM,
+	   if mapped separately) is copied */
+	if (dst->arena_size != src->arena_size || dst->nvram_mapped != src->nvram_mapped ||
+		dst->prg_rom.size != src->prg_rom.size || dst->chr.size != src->chr.size ||
+		dst->mapper.reset != src->mapper.reset)
 	{
-		fprintf(stderr, "Error: unable to allocate memory for PRG ROM (code %d)\n", errno);
-		fclose(rom);
+		fprintf(stderr, "Error: cartridge state is incompatible\n");
 		return -1;
 	}
-	if (!(cart->chr.data = (uint8_t*)malloc(cart->chr.size)))
+	memcpy(dst->arena, src->arena, src->arena_size);
+	if (src->nvram_mapped)
+		memcpy(dst->prg_ram.data, src->prg_ram.data, src->prg_ram.size);
+
+	mapper_copy_state(&dst->mapper, &src->mapper);
+	cartridge_set_mirroring(dst, src->mirror_mode);
+	return 0;
+}
+
+uint32_t cartridge_crc(const Cartridge* cart)
+{
+	/* Everything after the header, like ROM databases use. ROM that was read
+	   into the arena is hashed instead (i.e., without any trainer) */
+	uint32_t crc;
+	if (cart->rom_image)
+		return crc32_update(0, cart->rom_image + 16, cart->rom_image_size - 16);
+	crc = crc32_update(0, cart->prg_rom.data, cart->prg_rom.size);
+	if (!cart->chr_is_ram)
+		crc = crc32_update(crc, cart->chr.data, cart->chr.size);
+	return crc;
+}
+
+static uint8_t state_regions(const Cartridge* cart, Memory* regions)
+{
+	/* Writable memory in snapshot order, wherever it is mapped from. ROM is
+	   never written, so it isn't part of the state */
+	uint8_t count = 0;
+	regions[count].data = (uint8_t*)cart->mapper.data;
+	regions[count++].size = cart->mapper_data_size;
+	if (cart->chr_is_ram)
+		regions[count++] = cart->chr;
+	regions[count++] = cart->vram;
+	regions[count++] = cart->prg_ram;
+	return count;
+}
+
+size_t cartridge_state_size(const Cartridge* cart)
+{
+	Memory regions[4];
+	size_t size = 0;
+	uint8_t count = state_regions(cart, regions), i;
+	for (i = 0; i < count; ++i)
+		size += regions[i].size;
+	return size;
+}
+
+void cartridge_save_state(const Cartridge* cart, CartridgeState* state, uint8_t* mem)
+{
+	Memory regions[4];
+	uint8_t count = state_regions(cart, regions), i;
+
+	memset(state, 0, sizeof(CartridgeState));
+	state->prg_rom_size = cart->prg_rom.size;
+	state->prg_ram_size = cart->prg_ram.size;
+	state->chr_size = cart->chr.size;
+	state->vram_size = cart->vram.size;
+	state->mapper_data_size = cart->mapper_data_size;
+	state->mirror_mode = cart->mirror_mode;
+	mapper_save_state(&cart->mapper, &state->mapper);
+
+	/* Without memory, only the header is filled in */
+	for (i = 0; mem && i < count; ++i)
 	{
-		fprintf(stderr, "Error: unable to allocate CHR memory (code %d)\n", errno);
-		cartridge_unload(cart);
-		fclose(rom);
-		return -1;
+		if (regions[i].size)
+			memcpy(mem, regions[i].data, regions[i].size);
+		mem += regions[i].size;
 	}
-	if (!(cart->prg_ram.data = (uint8_t*)malloc(cart->prg_ram.size)))
+}
+
+uint32_t cartridge_state_crc(const Cartridge* cart, uint32_t crc)
+{
+	/* Same bytes as the saved memory, without copying them */
+	Memory regions[4];
+	uint8_t count = state_regions(cart, regions), i;
+	for (i = 0; i < count; ++i)
+		crc = crc32_update(crc, regions[i].data, regions[i].size);
+	return crc;
+}
+
+int cartridge_load_state(Cartridge* cart, const CartridgeState* state, const uint8_t* mem)
+{
+	/* The state must come from the same ROM (or at least the same board) */
+	Memory regions[4];
+	uint8_t count, i;
+	if (state->prg_rom_size != cart->prg_rom.size || state->prg_ram_size != cart->prg_ram.size ||
+		state->chr_size != cart->chr.size || state->vram_size != cart->vram.size ||
+		state->mapper_data_size != cart->mapper_data_size)
 	{
-		fprintf(stderr, "Error: unable to allocate memory for PRG RAM (code %d)\n", errno);
-		cartridge_unload(cart);
-		fclose(rom);
+		fprintf(stderr, "Error: cartridge state is incompatible\n");
 		return -1;
 	}
 
-	if (fseek(rom, rom_start_ofs, SEEK_CUR) != 0 || fread(cart->prg_rom.data, 1, cart->prg_rom.size, rom) != cart->prg_rom.size)
+	count = state_regions(cart, regions);
+	for (i = 0; i < count; ++i)
 	{
-		fprintf(stderr, "Error: unable to read PRG ROM (code %d)\n", errno);
-		cartridge_unload(cart);
-		fclose(rom);
-		return -1;
+		if (regions[i].size)
+			memcpy(regions[i].data, mem, regions[i].size);
+		mem += regions[i].size;
 	}
-	if (header[5] && fread(cart->chr.data, 1, cart->chr.size, rom) != cart->chr.size)
+	mapper_load_state(&cart->mapper, &state->mapper);
+	cartridge_set_mirroring(cart, state->mirror_mode);
+	return 0;
+}
+
+static void rebase(uint8_t** ptr, const Cartridge* parent, uint8_t* arena)
+{
+	if (*ptr >= parent->arena && *ptr < parent->arena + parent->arena_size)
+		*ptr = arena + (*ptr - parent->arena);
+}
+
+int cartridge_fork(Cartridge* cart, const Cartridge* parent)
+{
+	/* ROM mapped from the image is shared with the parent. Everything else
+	   (mapper state, RAM, and ROM read into the arena) is a flat copy. The
+	   nametables are resolved once CIRAM is attached */
+	uint8_t* arena = NULL;
+	if (parent->nvram_mapped)
 	{
-		fprintf(stderr, "Error: unable to read CHR ROM (code %d)\n", errno);
-		cartridge_unload(cart);
-		fclose(rom);
+		fprintf(stderr, "Error: can't fork a cartridge whose battery-backed RAM is mapped from a save file\n");
 		return -1;
 	}
-	fclose(rom);
-	if (mapper_init(&cart->mapper, (struct Cartridge*)cart, mapper_num) != 0)
+	if (parent->arena_size)
 	{
-		fprintf(stderr, "Error: unable to initialize mapper\n");
-		cartridge_unload(cart);
-		return -1;
+		if (!(arena = map_arena(parent->arena_size)))
+			return -1;
+		memcpy(arena, parent->arena, parent->arena_size);
 	}
+
+	*cart = *parent;
+	cart->arena = arena;
+	rebase(&cart->chr.data, parent, arena);
+	rebase(&cart->vram.data, parent, arena);
+	rebase(&cart->prg_ram.data, parent, arena);
+	rebase(&cart->prg_rom.data, parent, arena);
+	cart->mapper.cartridge = (struct Cartridge*)cart;
+	if (parent->mapper.data)
+		cart->mapper.data = arena + ((uint8_t*)parent->mapper.data - parent->arena);
+	mapper_copy_state(&cart->mapper, &parent->mapper);
+
+	cart->ciram = NULL;
+	memset(cart->nametables, 0, sizeof(cart->nametables));
+	if (cart->rom_image)
+		atomic_fetch_add(&cart->rom_image_refs->count, 1);
 	return 0;
 }
 
-void cartridge_unload(Cartridge* cart)
+void cartridge_end_frame(Cartridge* cart)
 {
-	free(cart->prg_rom.data);
-	free(cart->prg_ram.data);
-	free(cart->chr.data);
-	mapper_cleanup(&cart->mapper);
-	memset(cart, 0, sizeof(Cartridge));
+	/* Periodically schedule write-back of the save file. MS_ASYNC only
+	   queues the dirty pages, so the emulation thread never waits on disk */
+	if (cart->nvram_mapped && ++cart->nvram_frame_count >= cart->nvram_sync_frames)
+	{
+		msync(cart->prg_ram.data, cart->prg_ram.size, MS_ASYNC);
+		cart->nvram_frame_count = 0;
+	}
+}
+
+static void update_nametables(Cartridge* cart)
+{
+	/* Pages 0-1 are CIRAM, and 2-3 are cartridge VRAM */
+	static const uint8_t layouts[5][4] = {
+		{ 0, 1, 0, 1 },  /* Vertical */
+		{ 0, 0, 1, 1 },  /* Horizontal */
+		{ 0, 1, 2, 3 },  /* 4-screen */
+		{ 0, 0, 0, 0 },  /* Single-screen (lower) */
+		{ 1, 1, 1, 1 }   /* Single-screen (upper) */
+	};
+	uint8_t i, page;
+	if (!cart->ciram)
+		return;
+	for (i = 0; i < 4; ++i)
+	{
+		page = layouts[cart->mirror_mode][i];
+		if (page >= 2 && cart->vram.data)
+			cart->nametables[i] = cart->vram.data + (page & 1) * 0x400;
+		else
+			cart->nametables[i] = cart->ciram + (page & 1) * 0x400;
+	}
+}
+
+void cartridge_attach_ciram(Cartridge* cart, uint8_t* ciram)
+{
+	cart->ciram = ciram;
+	update_nametables(cart);
+}
+
+void cartridge_set_mirroring(Cartridge* cart, MirrorMode mode)
+{
+	cart->mirror_mode = mode;
+	update_nametables(cart);
 }
 
 uint8_t cartridge_read(Cartridge* cart, uint16_t addr)
 {
-	if (addr < 0x8000)
-		return *mapper_get_banked_mem(&cart->mapper.prg_ram_banks, addr);
+	/* TODO: open bus for unmapped expansion area reads */
+	if (addr < 0x6000)
+		return 0;
+	else if (addr < 0x8000)
+		return cart->prg_ram.size ? *mapper_get_banked_mem(&cart->mapper.prg_ram_banks, addr - 0x6000) : 0;
 	return *mapper_get_banked_mem(&cart->mapper.prg_rom_banks, addr - 0x8000);
 }
 
 void cartridge_write(Cartridge* cart, uint16_t addr, uint8_t val)
 {
-	if (addr < 0x8000)
-		*mapper_get_banked_mem(&cart->mapper.prg_ram_banks, addr) = val;
-	else
-		cart->mapper.write(&cart->mapper, addr, val);
+	/* Expansion area, PRG RAM, or mapper registers */
+	cart->mapper.write_handlers[addr >> WRITE_WINDOW_SHIFT](&cart->mapper, addr, val);
 }
@@ -1,6 +1,7 @@
 #ifndef CARTRIDGE_H
 #define CARTRIDGE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "mappers/mapper.h"
@@ -12,7 +13,9 @@
 typedef enum {
 	MIRRORING_VERTICAL,
 	MIRRORING_HORIZONTAL,
-	MIRRORING_4SCREEN
+	MIRRORING_4SCREEN,
+	MIRRORING_SINGLE_LOWER,  /* One-screen, using the first CIRAM page */
+	MIRRORING_SINGLE_UPPER  /* One-screen, using the second CIRAM page */
 } MirrorMode;
 
 typedef enum {
@@ -25,17 +28,84 @@ typedef struct {
 	uint32_t size;
 } Memory;
 
+/* Board description decoded from a ROM header. Sizes are in bytes */
+typedef struct {
+	uint32_t prg_rom_size;
+	uint32_t chr_rom_size;
+	uint32_t prg_ram_size;  /* Volatile */
+	uint32_t prg_nvram_size;  /* Battery-backed */
+	uint32_t chr_ram_size;
+	uint16_t mapper_num;
+	uint8_t submapper;
+	uint8_t nes2;  /* NES 2.0 header */
+	uint16_t rom_start_ofs;  /* File offset of PRG ROM */
+	MirrorMode mirror_mode;
+	VideoMode video_mode;
+} CartridgeHeader;
+
+/* Cartridge part of a snapshot. Followed by cartridge_state_size() bytes of
+   memory: mapper data, CHR RAM, extra VRAM, then PRG RAM */
+typedef struct {
+	uint32_t prg_rom_size;
+	uint32_t prg_ram_size;
+	uint32_t chr_size;
+	uint32_t vram_size;
+	uint32_t mapper_data_size;
+	MirrorMode mirror_mode;
+	MapperState mapper;
+} CartridgeState;
+
+struct CartridgeDB;
+struct ImageRefs;
+
 typedef struct Cartridge
 {
 	MirrorMode mirror_mode;
 	VideoMode video_mode;
+	uint32_t board_crc;  /* Of the board description, after any database correction */
 	Mapper mapper;
 	uint8_t has_nvram;
+	uint8_t chr_is_ram;
 	Memory prg_rom, prg_ram, chr;
+	Memory vram;  /* Extra nametable RAM on 4-screen boards */
+
+	/* 1KB pages for the nametables at $2000, $2400, $2800, and $2C00.
+	   Resolved whenever the mirroring mode changes */
+	uint8_t* nametables[4];
+	uint8_t* ciram;  /* The console's 2KB of nametable RAM */
+
+	/* Read-only mapping of the ROM file. PRG and CHR ROM point into it when
+	   set, otherwise they are copied into the arena */
+	uint8_t* rom_image;
+	size_t rom_image_size;
+	struct ImageRefs* rom_image_refs;  /* Forks share the mapping */
+
+	/* Writable memory and mapper state not mapped from a file */
+	uint8_t* arena;
+	size_t arena_size;
+	uint32_t mapper_data_size;
+
+	/* Battery-backed PRG RAM is mapped from the save file when set */
+	uint8_t nvram_mapped;
+	uint32_t nvram_sync_frames;  /* Frames between save file write-backs */
+	uint32_t nvram_frame_count;
 } Cartridge;
 
-int cartridge_load(Cartridge* cart, char* path);
+int cartridge_parse_header(CartridgeHeader* info, const uint8_t* header);
+int cartridge_load(Cartridge* cart, char* path, const struct CartridgeDB* db, uint8_t volatile_nvram);
+int cartridge_load_memory(Cartridge* cart, const void* image, size_t size, const struct CartridgeDB* db);
+int cartridge_alloc(Cartridge* cart, const MapperInfo* mapper_info, void** mapper_data);
 void cartridge_unload(Cartridge* cart);
+int cartridge_copy_state(Cartridge* dst, const Cartridge* src);
+int cartridge_fork(Cartridge* cart, const Cartridge* parent);
+uint32_t cartridge_crc(const Cartridge* cart);
+size_t cartridge_state_size(const Cartridge* cart);
+void cartridge_save_state(const Cartridge* cart, CartridgeState* state, uint8_t* mem);
+uint32_t cartridge_state_crc(const Cartridge* cart, uint32_t crc);
+int cartridge_load_state(Cartridge* cart, const CartridgeState* state, const uint8_t* mem);
+void cartridge_end_frame(Cartridge* cart);
+void cartridge_attach_ciram(Cartridge* cart, uint8_t* ciram);
+void cartridge_set_mirroring(Cartridge* cart, MirrorMode mode);
 
 uint8_t cartridge_read(Cartridge* cart, uint16_t addr);
 void cartridge_write(Cartridge* cart, uint16_t addr, uint8_t val);
@@ -41,4 +41,9 @@ void controller_set_button(Controller* c, ControllerButton btn, uint8_t pressed)
 		c->state &= ~btn;
 	else
 		c->state |= btn;
-}
\ No newline at end of file
+}
+
+void controller_set_buttons(Controller* c, uint8_t buttons)
+{
+	c->state = ~buttons;
+}
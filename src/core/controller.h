@@ -22,6 +22,7 @@ typedef struct {
 
 void controller_init(Controller* c);
 void controller_set_button(Controller* c, ControllerButton btn, uint8_t pressed);
+void controller_set_buttons(Controller* c, uint8_t buttons);  /* ControllerButton flags */
 void controller_update(Controller* c);
 void controller_write_input(Controller* c, uint8_t val);
 uint8_t controller_read_output(Controller* c);
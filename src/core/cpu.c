@@ -38,11 +38,18 @@
 
 static void catchup(NES* nes)
 {
+	/* The APU runs lazily, catching up when the CPU touches its registers
+	   or one of its events comes due (see scheduler.c). The PPU stays in
+	   lockstep: its dot loop is faster interleaved with the CPU's work than
+	   batched */
 	++nes->cpu.cycles;
-	ppu_tick(&nes->ppu);
-	ppu_tick(&nes->ppu);
-	ppu_tick(&nes->ppu);
-	apu_tick(&nes->apu);
+	++nes->sched.now;
+	if (!nes->audio_only)
+	{
+		ppu_tick(&nes->ppu);
+		ppu_tick(&nes->ppu);
+		ppu_tick(&nes->ppu);
+	}
 }
 
 /* Memory access wrappers to facilitate cycle accuracy.
@@ -104,7 +111,9 @@ static uint8_t stack_pop(CPU* cpu)
 
 static uint16_t stack_pop16(CPU* cpu)
 {
-	return stack_pop(cpu) | (stack_pop(cpu) << 8);
+	/* The operands of | can be evaluated in either order */
+	uint8_t lo = stack_pop(cpu);
+	return lo | (stack_pop(cpu) << 8);
 }
 
 /*** CPU instructions ***/
@@ -821,7 +830,8 @@ static void update_eff_addr(CPU* cpu)
 
 		/* Relative addressing: effective address is the next byte + PC */
 		case AMODE_REL:
-			cpu->eff_addr = (int8_t)get(cpu->nes, cpu->pc++) + cpu->pc;
+			cpu->eff_addr = (int8_t)get(cpu->nes, cpu->pc++);
+			cpu->eff_addr += cpu->pc;
 			break;
 
 		/* Absolute addressing: the effective address is the next two bytes */
@@ -883,6 +893,13 @@ uint16_t cpu_step(CPU* cpu)
 	/*static FILE* log;*/
 
 	/*uint16_t old_cycles = cpu->cycles;*/
+	if (cpu->nes->sched.now >= cpu->nes->sched.next)
+	{
+		/* Due devices may raise interrupts or stall the CPU. Catch them up
+		   before either is checked */
+		nes_run_events(cpu->nes);
+	}
+
 	if (cpu->idle_cycles)
 	{
 		--cpu->idle_cycles;
@@ -952,6 +969,20 @@ uint8_t cpu_interrupt_status(CPU* cpu, Interrupt type)
 	return (cpu->pending_interrupts & type) != 0;
 }
 
+void cpu_set_irq_line(CPU* cpu, IRQSource source, uint8_t asserted)
+{
+	/* IRQ stays pending until every device has released the line */
+	if (asserted)
+		cpu->irq_sources |= source;
+	else
+		cpu->irq_sources &= ~source;
+
+	if (cpu->irq_sources)
+		cpu->pending_interrupts |= INT_IRQ;
+	else
+		cpu->pending_interrupts &= ~INT_IRQ;
+}
+
 /*void cpu_begin_oam_dma(CPU* cpu, uint16_t addr_start)
 {
 	if (!cpu->oam_dma_started)
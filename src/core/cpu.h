@@ -4,6 +4,8 @@
 #include <stdint.h>
 
 #define CPU_CLOCK_RATE 1773448
+#define CPU_CLOCK_NTSC 1789773
+#define CPU_CLOCK_PAL 1662607
 
 typedef enum {
 	INT_RST = 1,
@@ -11,6 +13,12 @@ typedef enum {
 	INT_IRQ = 4
 } Interrupt;
 
+/* Devices sharing the (wired-OR) IRQ line */
+typedef enum {
+	IRQ_SOURCE_APU = 1,
+	IRQ_SOURCE_MAPPER = 2
+} IRQSource;
+
 typedef enum {
 	AMODE_ACC,  /* Accumulator addressing */
 	AMODE_IMP,  /* Implied addressing */
@@ -44,6 +52,7 @@ typedef struct
 	uint8_t oam_dma_bytes_copied;*/
 	uint8_t opcode;
 	uint8_t pending_interrupts;
+	uint8_t irq_sources;  /* IRQSource flags of devices asserting IRQ */
 	AddressingMode instr_amode;
 	uint16_t eff_addr/*, oam_dma_addr*/;
 	uint16_t cycles, idle_cycles;
@@ -56,6 +65,7 @@ uint16_t cpu_step(CPU* cpu);
 void cpu_fire_interrupt(CPU* cpu, Interrupt type);
 void cpu_clear_interrupt(CPU* cpu, Interrupt type);
 uint8_t cpu_interrupt_status(CPU* cpu, Interrupt type);
+void cpu_set_irq_line(CPU* cpu, IRQSource source, uint8_t asserted);
 /*oid cpu_begin_oam_dma(CPU* cpu, uint16_t addr_start);*/
 
 #endif
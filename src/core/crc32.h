@@ -0,0 +1,11 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* CRC-32 (IEEE 802.3), as used by zip files and ROM databases. Pass 0 to
+   start a new checksum, or a previous result to continue one */
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t len);
+
+#endif
@@ -0,0 +1,387 @@
+/* ROM library indexer. Only the iNES header and the ROM payload are read
+   (no cartridge is created), files are hashed in parallel, and results are
+   cached in an index file keyed by path, size, and modification time */
+
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "crc32.h"
+#include "library.h"
+
+#define INDEX_MAGIC "PNESLIB2"
+#define HASH_CHUNK_SIZE 0x10000
+#define MAX_DIR_DEPTH 32
+#define MAX_THREADS 64
+
+typedef struct {
+	Library* lib;
+	atomic_uint next;
+} ScanJob;
+
+static int add_entry(Library* lib, char* path, struct stat* st)
+{
+	/* Takes ownership of path */
+	LibraryEntry* entry;
+	if (lib->count == lib->capacity)
+	{
+		uint32_t capacity = lib->capacity ? lib->capacity * 2 : 256;
+		LibraryEntry* entries = (LibraryEntry*)realloc(lib->entries, capacity * sizeof(LibraryEntry));
+		if (!entries)
+		{
+			fprintf(stderr, "Error: unable to allocate memory for ROM library (code %d)\n", errno);
+			free(path);
+			return -1;
+		}
+		lib->entries = entries;
+		lib->capacity = capacity;
+	}
+
+	entry = &lib->entries[lib->count++];
+	memset(entry, 0, sizeof(LibraryEntry));
+	entry->path = path;
+	if (st)
+	{
+		entry->mtime = (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+		entry->size = st->st_size;
+	}
+	entry->stale = 1;
+	return 0;
+}
+
+static int is_rom(const char* name)
+{
+	size_t len = strlen(name);
+	return len > 4 && strcasecmp(name + len - 4, ".nes") == 0;
+}
+
+static int add_dir(Library* lib, const char* dir, uint8_t depth)
+{
+	DIR* d;
+	struct dirent* ent;
+	struct stat st;
+	int ret = 0;
+
+	if (depth > MAX_DIR_DEPTH || !(d = opendir(dir)))
+		return depth ? 0 : -1;  /* Unreadable subdirectories are skipped */
+
+	while (ret == 0 && (ent = readdir(d)))
+	{
+		char* path;
+		if (ent->d_name[0] == '.')
+			continue;
+		if (!(path = (char*)malloc(strlen(dir) + strlen(ent->d_name) + 2)))
+		{
+			ret = -1;
+			break;
+		}
+		sprintf(path, "%s/%s", dir, ent->d_name);
+
+		if (stat(path, &st) != 0)
+			free(path);
+		else if (S_ISDIR(st.st_mode))
+		{
+			ret = add_dir(lib, path, depth + 1);
+			free(path);
+		}
+		else if (S_ISREG(st.st_mode) && is_rom(ent->d_name))
+			ret = add_entry(lib, path, &st);
+		else
+			free(path);
+	}
+	closedir(d);
+	return ret;
+}
+
+static int compare_entries(const void* a, const void* b)
+{
+	return strcmp(((LibraryEntry*)a)->path, ((LibraryEntry*)b)->path);
+}
+
+static void index_rom(LibraryEntry* entry)
+{
+	uint8_t buf[HASH_CHUNK_SIZE];
+	FILE* rom = fopen(entry->path, "rb");
+	size_t n;
+
+	entry->valid = 0;
+	entry->crc = 0;
+	if (!rom)
+		return;
+	if (fread(buf, 1, 16, rom) == 16 && cartridge_parse_header(&entry->header, buf) == 0)
+	{
+		/* Everything after the header is hashed, matching the keys used by
+		   ROM databases (and CartridgeDB) */
+		while ((n = fread(buf, 1, sizeof(buf), rom)) > 0)
+			entry->crc = crc32_update(entry->crc, buf, n);
+		entry->valid = !ferror(rom) && entry->header.rom_start_ofs + (int64_t)entry->header.prg_rom_size +
+					   entry->header.chr_rom_size <= entry->size;
+	}
+	fclose(rom);
+}
+
+static void* scan_thread(void* userdata)
+{
+	/* Threads claim entries one at a time, so large ROMs don't leave
+	   others idle */
+	ScanJob* job = (ScanJob*)userdata;
+	uint32_t i;
+	while ((i = atomic_fetch_add_explicit(&job->next, 1, memory_order_relaxed)) < job->lib->count)
+	{
+		if (job->lib->entries[i].stale)
+			index_rom(&job->lib->entries[i]);
+	}
+	return NULL;
+}
+
+static void hash_entries(Library* lib, uint32_t threads)
+{
+	pthread_t workers[MAX_THREADS];
+	ScanJob job;
+	uint32_t i, started = 0;
+
+	if (threads == 0)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? (uint32_t)cores : 1;
+	}
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+	if (threads > lib->rehashed)
+		threads = lib->rehashed ? lib->rehashed : 1;
+
+	job.lib = lib;
+	atomic_init(&job.next, 0);
+	for (i = 1; i < threads; ++i)
+	{
+		if (pthread_create(&workers[started], NULL, scan_thread, &job) == 0)
+			++started;
+	}
+
+	/* The calling thread works too (and finishes the job alone if no
+	   workers could be started) */
+	scan_thread(&job);
+	for (i = 0; i < started; ++i)
+		pthread_join(workers[i], NULL);
+}
+
+/* Index file format (little-endian):
+	0-7: "PNESLIB2"
+	8-11: Number of entries
+	Then, for each entry:
+	   0-7: Modification time
+	  8-15: File size
+	 16-19: CRC-32
+	 20-23: PRG ROM size
+	 24-27: CHR ROM size
+	 28-31: PRG RAM size
+	 32-35: PRG NVRAM size
+	 36-39: CHR RAM size
+	 40-41: Mapper number
+	 42-43: PRG ROM file offset
+	    44: Submapper
+	    45: NES 2.0 header
+	    46: Mirroring
+	    47: TV system
+	    48: Valid
+	 49-50: Path length (n)
+	51-...: Path (n bytes, no terminator) */
+#define INDEX_ENTRY_SIZE 51
+
+static void put_le(uint8_t* buf, uint64_t val, uint8_t size)
+{
+	uint8_t i;
+	for (i = 0; i < size; ++i)
+		buf[i] = (val >> (i * 8)) & 0xFF;
+}
+
+static uint64_t get_le(const uint8_t* buf, uint8_t size)
+{
+	uint64_t val = 0;
+	while (size-- > 0)
+		val = (val << 8) | buf[size];
+	return val;
+}
+
+static int load_index(Library* index, const char* path)
+{
+	uint8_t buf[INDEX_ENTRY_SIZE];
+	uint32_t count, i;
+	FILE* file;
+
+	memset(index, 0, sizeof(Library));
+	if (!(file = fopen(path, "rb")))
+		return 0;  /* First scan */
+	if (fread(buf, 1, 12, file) != 12 || memcmp(buf, INDEX_MAGIC, 8) != 0)
+	{
+		fprintf(stderr, "Warning: ignoring invalid ROM library index\n");
+		fclose(file);
+		return 0;
+	}
+
+	count = (uint32_t)get_le(buf + 8, 4);
+	for (i = 0; i < count; ++i)
+	{
+		LibraryEntry* entry;
+		uint16_t path_len;
+		char* entry_path;
+
+		if (fread(buf, 1, INDEX_ENTRY_SIZE, file) != INDEX_ENTRY_SIZE)
+			break;
+		path_len = (uint16_t)get_le(buf + 49, 2);
+		if (!(entry_path = (char*)malloc(path_len + 1)))
+			break;
+		if (fread(entry_path, 1, path_len, file) != path_len)
+		{
+			free(entry_path);
+			break;
+		}
+		entry_path[path_len] = '\0';
+		if (add_entry(index, entry_path, NULL) != 0)
+			break;
+
+		entry = &index->entries[index->count - 1];
+		entry->mtime = (int64_t)get_le(buf, 8);
+		entry->size = (int64_t)get_le(buf + 8, 8);
+		entry->crc = (uint32_t)get_le(buf + 16, 4);
+		entry->header.prg_rom_size = (uint32_t)get_le(buf + 20, 4);
+		entry->header.chr_rom_size = (uint32_t)get_le(buf + 24, 4);
+		entry->header.prg_ram_size = (uint32_t)get_le(buf + 28, 4);
+		entry->header.prg_nvram_size = (uint32_t)get_le(buf + 32, 4);
+		entry->header.chr_ram_size = (uint32_t)get_le(buf + 36, 4);
+		entry->header.mapper_num = (uint16_t)get_le(buf + 40, 2);
+		entry->header.rom_start_ofs = (uint16_t)get_le(buf + 42, 2);
+		entry->header.submapper = buf[44];
+		entry->header.nes2 = buf[45];
+		entry->header.mirror_mode = (MirrorMode)buf[46];
+		entry->header.video_mode = (VideoMode)buf[47];
+		entry->valid = buf[48];
+
+		/* A corrupt entry is read from the ROM again */
+		entry->stale = buf[46] > MIRRORING_SINGLE_UPPER || buf[47] > VIDEO_PAL;
+	}
+	fclose(file);
+
+	/* Indexes are always written sorted, but don't trust the file */
+	qsort(index->entries, index->count, sizeof(LibraryEntry), compare_entries);
+	return 0;
+}
+
+static int save_index(Library* lib, const char* path)
+{
+	uint8_t buf[INDEX_ENTRY_SIZE];
+	char* tmp_path;
+	FILE* file;
+	uint32_t i;
+	int ret = 0;
+
+	/* Written to a temporary file first so an interrupted scan never
+	   leaves a truncated index behind */
+	if (!(tmp_path = (char*)malloc(strlen(path) + 5)))
+		return -1;
+	sprintf(tmp_path, "%s.tmp", path);
+	if (!(file = fopen(tmp_path, "wb")))
+	{
+		fprintf(stderr, "Error: unable to write ROM library index (code %d)\n", errno);
+		free(tmp_path);
+		return -1;
+	}
+
+	memcpy(buf, INDEX_MAGIC, 8);
+	put_le(buf + 8, lib->count, 4);
+	if (fwrite(buf, 1, 12, file) != 12)
+		ret = -1;
+	for (i = 0; ret == 0 && i < lib->count; ++i)
+	{
+		LibraryEntry* entry = &lib->entries[i];
+		uint16_t path_len = (uint16_t)strlen(entry->path);
+		put_le(buf, (uint64_t)entry->mtime, 8);
+		put_le(buf + 8, (uint64_t)entry->size, 8);
+		put_le(buf + 16, entry->crc, 4);
+		put_le(buf + 20, entry->header.prg_rom_size, 4);
+		put_le(buf + 24, entry->header.chr_rom_size, 4);
+		put_le(buf + 28, entry->header.prg_ram_size, 4);
+		put_le(buf + 32, entry->header.prg_nvram_size, 4);
+		put_le(buf + 36, entry->header.chr_ram_size, 4);
+		put_le(buf + 40, entry->header.mapper_num, 2);
+		put_le(buf + 42, entry->header.rom_start_ofs, 2);
+		buf[44] = entry->header.submapper;
+		buf[45] = entry->header.nes2;
+		buf[46] = entry->header.mirror_mode;
+		buf[47] = entry->header.video_mode;
+		buf[48] = entry->valid;
+		put_le(buf + 49, path_len, 2);
+		if (fwrite(buf, 1, INDEX_ENTRY_SIZE, file) != INDEX_ENTRY_SIZE ||
+			fwrite(entry->path, 1, path_len, file) != path_len)
+			ret = -1;
+	}
+
+	if (fclose(file) != 0 || ret != 0 || rename(tmp_path, path) != 0)
+	{
+		fprintf(stderr, "Error: unable to write ROM library index (code %d)\n", errno);
+		remove(tmp_path);
+		ret = -1;
+	}
+	free(tmp_path);
+	return ret;
+}
+
+int library_scan(Library* lib, const char* dir, const char* index_path, uint32_t threads)
+{
+	Library index;
+	uint32_t indexed_count, i;
+	memset(lib, 0, sizeof(Library));
+
+	if (add_dir(lib, dir, 0) != 0)
+	{
+		fprintf(stderr, "Error: unable to read ROM library directory (code %d)\n", errno);
+		library_free(lib);
+		return -1;
+	}
+	qsort(lib->entries, lib->count, sizeof(LibraryEntry), compare_entries);
+
+	/* Reuse indexed results for unchanged files */
+	load_index(&index, index_path);
+	for (i = 0; i < lib->count; ++i)
+	{
+		LibraryEntry* entry = &lib->entries[i];
+		LibraryEntry* cached = index.count ? (LibraryEntry*)bsearch(entry, index.entries, index.count,
+																	 sizeof(LibraryEntry), compare_entries) : NULL;
+		if (cached && !cached->stale && cached->mtime == entry->mtime && cached->size == entry->size)
+		{
+			entry->valid = cached->valid;
+			entry->crc = cached->crc;
+			entry->header = cached->header;
+			entry->stale = 0;
+		}
+		else
+			++lib->rehashed;
+	}
+	indexed_count = index.count;
+	library_free(&index);
+
+	/* Every file matched the index, and none were deleted */
+	if (lib->rehashed == 0 && lib->count == indexed_count)
+		return 0;
+
+	hash_entries(lib, threads);
+	for (i = 0; i < lib->count; ++i)
+		lib->entries[i].stale = 0;
+	return save_index(lib, index_path);
+}
+
+void library_free(Library* lib)
+{
+	uint32_t i;
+	for (i = 0; i < lib->count; ++i)
+		free(lib->entries[i].path);
+	free(lib->entries);
+	memset(lib, 0, sizeof(Library));
+}
@@ -0,0 +1,32 @@
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <stdint.h>
+
+#include "cartridge.h"
+
+typedef struct {
+	char* path;
+	int64_t mtime;  /* Nanoseconds */
+	int64_t size;
+	uint8_t valid;  /* Header could be parsed and the payload was complete */
+	uint8_t stale;  /* Needs (re)hashing */
+	uint32_t crc;  /* CRC-32 of everything after the 16-byte header */
+	CartridgeHeader header;
+} LibraryEntry;
+
+/* Decoded headers and checksums for every ROM under a directory. Results
+   are kept in an on-disk index, and files whose size and modification time
+   haven't changed are not read again */
+typedef struct {
+	LibraryEntry* entries;  /* Sorted by path */
+	uint32_t count;
+	uint32_t capacity;
+	uint32_t rehashed;  /* Entries read during the last scan */
+} Library;
+
+/* threads is the number of indexing threads (0 for one per core) */
+int library_scan(Library* lib, const char* dir, const char* index_path, uint32_t threads);
+void library_free(Library* lib);
+
+#endif
@@ -19,7 +19,7 @@ static void reset(Mapper* mapper)
 		mapper_set_prg_rom_bank(mapper, 1, 0);
 }
 
-static void write(Mapper* mapper, uint16_t addr, uint8_t val)
+static void write_bank_select(Mapper* mapper, uint16_t addr, uint8_t val)
 {
 	/* Select 8 KB CHR ROM bank for PPU $0000-$1FFF */
 	mapper_set_chr_bank(mapper, 0, val);
@@ -31,6 +31,8 @@ int cnrom_init(Mapper* mapper)
 	mapper->prg_ram_banks.bank_count = 1;
 	mapper->chr_banks.bank_count = 1;
 	mapper->reset = reset;
-	mapper->write = write;
+	mapper_set_write_handler(mapper, 0x8000, 0xFFFF, write_bank_select);
 	return 0;
 }
+
+const MapperInfo cnrom_info = { cnrom_init, 0 };
@@ -9,17 +9,16 @@
 #include "../cartridge.h"
 #include "mapper.h"
 
-typedef int (*MapperInitializer)(Mapper* mapper);
-
 /* Implemented mappers */
-int nrom_init(Mapper* mapper);
-int mmc1_init(Mapper* mapper);
-int uxrom_init(Mapper* mapper);
-int cnrom_init(Mapper* mapper);
+extern const MapperInfo nrom_info;
+extern const MapperInfo mmc1_info;
+extern const MapperInfo uxrom_info;
+extern const MapperInfo cnrom_info;
+extern const MapperInfo mmc3_info;
 
-static MapperInitializer initializers[256] =
+static const MapperInfo* mappers[256] =
 {
-	nrom_init, mmc1_init, uxrom_init, cnrom_init, NULL, NULL, NULL, NULL,
+	&nrom_info, &mmc1_info, &uxrom_info, &cnrom_info, &mmc3_info, NULL, NULL, NULL,
 	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
 	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
 	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
@@ -53,47 +52,70 @@ static MapperInitializer initializers[256] =
 	NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL
 };
 
-static int alloc_banks(MemoryBanks* banks, uint16_t addressable_memory)
+static int init_banks(MemoryBanks* banks, uint16_t addressable_memory, uint8_t slot_shift)
 {
-	banks->banks = (uint8_t**)malloc(banks->bank_count * sizeof(uint8_t*));
-	if (!banks->banks)
+	/* Banks must be a whole number of slots */
+	banks->slot_shift = slot_shift;
+	if (banks->bank_count == 0)
 		return -1;
 	banks->bank_size = addressable_memory / banks->bank_count;
+	if ((addressable_memory >> slot_shift) > MAX_BANK_SLOTS ||
+		banks->bank_size < (1 << slot_shift) ||
+		banks->bank_size % (1 << slot_shift) != 0)
+	{
+		return -1;
+	}
 	return 0;
 }
 
-int mapper_init(Mapper* mapper, struct Cartridge* cart, uint8_t mapper_num)
+const MapperInfo* mapper_get_info(uint16_t mapper_num)
 {
-	MapperInitializer init = initializers[mapper_num];
-	if (!init)
-	{
+	const MapperInfo* info = mapper_num < 256 ? mappers[mapper_num] : NULL;
+	if (!info)
 		fprintf(stderr, "Error: unsupported mapper (%d)\n", mapper_num);
-		return -1;
-	}
+	return info;
+}
+
+static void write_nop(Mapper* mapper, uint16_t addr, uint8_t val)
+{
+	/* No registers or memory in this window */
+}
+
+static void write_prg_ram(Mapper* mapper, uint16_t addr, uint8_t val)
+{
+	*mapper_get_banked_mem(&mapper->prg_ram_banks, addr - 0x6000) = val;
+}
+
+int mapper_init(Mapper* mapper, struct Cartridge* cart, const MapperInfo* info, void* data)
+{
 	memset(mapper, 0, sizeof(Mapper));
 	mapper->cartridge = cart;
+	mapper->data = data;
+	mapper_set_write_handler(mapper, 0x0000, 0xFFFF, NULL);
+	if (cart->prg_ram.size)
+		mapper_set_write_handler(mapper, 0x6000, 0x7FFF, write_prg_ram);
 
-	if (init(mapper) != 0)
+	if (info->init(mapper) != 0)
 	{
 		fprintf(stderr, "Error: could not initialize mapper (code %d)\n", errno);
 		mapper_cleanup(mapper);
 		return -1;
 	}
-	if (alloc_banks(&mapper->prg_rom_banks, ADDRESSABLE_PRG_ROM) != 0)
+	if (init_banks(&mapper->prg_rom_banks, ADDRESSABLE_PRG_ROM, PRG_ROM_SLOT_SHIFT) != 0)
 	{
-		fprintf(stderr, "Error: unable to allocate memory for PRG ROM bank offsets (code %d)\n", errno);
+		fprintf(stderr, "Error: unsupported PRG ROM bank layout (%d banks)\n", mapper->prg_rom_banks.bank_count);
 		mapper_cleanup(mapper);
 		return -1;
 	}
-	if (alloc_banks(&mapper->prg_ram_banks, ADDRESSABLE_PRG_RAM) != 0)
+	if (init_banks(&mapper->prg_ram_banks, ADDRESSABLE_PRG_RAM, PRG_RAM_SLOT_SHIFT) != 0)
 	{
-		fprintf(stderr, "Error: unable to allocate memory for PRG RAM bank offsets (code %d)\n", errno);
+		fprintf(stderr, "Error: unsupported PRG RAM bank layout (%d banks)\n", mapper->prg_ram_banks.bank_count);
 		mapper_cleanup(mapper);
 		return -1;
 	}
-	if (alloc_banks(&mapper->chr_banks, ADDRESSABLE_CHR) != 0)
+	if (init_banks(&mapper->chr_banks, ADDRESSABLE_CHR, CHR_SLOT_SHIFT) != 0)
 	{
-		fprintf(stderr, "Error: unable to allocate memory for CHR bank offsets (code %d)\n", errno);
+		fprintf(stderr, "Error: unsupported CHR bank layout (%d banks)\n", mapper->chr_banks.bank_count);
 		mapper_cleanup(mapper);
 		return -1;
 	}
@@ -103,17 +125,100 @@ int mapper_init(Mapper* mapper, struct Cartridge* cart, uint8_t mapper_num)
 
 void mapper_cleanup(Mapper* mapper)
 {
-	free(mapper->prg_rom_banks.banks);
-	free(mapper->prg_ram_banks.banks);
-	free(mapper->chr_banks.banks);
-	free(mapper->data);
+	/* The cartridge owns the data */
 	memset(mapper, 0, sizeof(Mapper));
 }
 
+static void relocate_banks(MemoryBanks* banks, const Memory* from, const Memory* to)
+{
+	/* Rebase slots pointing into one cartridge's memory onto another's */
+	uint8_t i;
+	for (i = 0; i < MAX_BANK_SLOTS; ++i)
+	{
+		if (banks->slots[i] >= from->data && banks->slots[i] < from->data + from->size)
+			banks->slots[i] = to->data + (banks->slots[i] - from->data);
+	}
+}
+
+void mapper_copy_state(Mapper* dst, const Mapper* src)
+{
+	/* Both mappers belong to cartridges loaded from the same ROM. Their
+	   data is copied along with the rest of the cartridge memory */
+	struct Cartridge* cart = dst->cartridge;
+	void* data = dst->data;
+	*dst = *src;
+	dst->cartridge = cart;
+	dst->data = data;
+	relocate_banks(&dst->prg_rom_banks, &src->cartridge->prg_rom, &cart->prg_rom);
+	relocate_banks(&dst->prg_ram_banks, &src->cartridge->prg_ram, &cart->prg_ram);
+	relocate_banks(&dst->chr_banks, &src->cartridge->chr, &cart->chr);
+}
+
+static void save_slots(const MemoryBanks* banks, const Memory* mem, uint32_t* slots)
+{
+	uint8_t i;
+	for (i = 0; i < MAX_BANK_SLOTS; ++i)
+	{
+		if (mem->data && banks->slots[i] >= mem->data && banks->slots[i] < mem->data + mem->size)
+			slots[i] = (uint32_t)(banks->slots[i] - mem->data);
+		else
+			slots[i] = MAPPER_SLOT_UNMAPPED;
+	}
+}
+
+static void load_slots(MemoryBanks* banks, const Memory* mem, const uint32_t* slots)
+{
+	/* Offsets past the end of the memory (i.e., from another board) stay
+	   unmapped */
+	uint8_t i;
+	for (i = 0; i < MAX_BANK_SLOTS; ++i)
+		banks->slots[i] = (slots[i] < mem->size) ? mem->data + slots[i] : NULL;
+}
+
+void mapper_save_state(const Mapper* mapper, MapperState* state)
+{
+	const struct Cartridge* cart = mapper->cartridge;
+	save_slots(&mapper->prg_rom_banks, &cart->prg_rom, state->prg_rom_slots);
+	save_slots(&mapper->prg_ram_banks, &cart->prg_ram, state->prg_ram_slots);
+	save_slots(&mapper->chr_banks, &cart->chr, state->chr_slots);
+	state->irq = mapper->irq;
+}
+
+void mapper_load_state(Mapper* mapper, const MapperState* state)
+{
+	/* The mapper's data is restored along with the rest of the cartridge
+	   memory */
+	struct Cartridge* cart = mapper->cartridge;
+	load_slots(&mapper->prg_rom_banks, &cart->prg_rom, state->prg_rom_slots);
+	load_slots(&mapper->prg_ram_banks, &cart->prg_ram, state->prg_ram_slots);
+	load_slots(&mapper->chr_banks, &cart->chr, state->chr_slots);
+	mapper->irq = state->irq;
+}
+
+void mapper_set_write_handler(Mapper* mapper, uint16_t start, uint16_t end, MapperWriteFunc handler)
+{
+	/* Registers the handler for every window overlapping start-end. NULL
+	   marks the windows as having nothing writable */
+	uint8_t i;
+	for (i = start >> WRITE_WINDOW_SHIFT; i <= (end >> WRITE_WINDOW_SHIFT); ++i)
+		mapper->write_handlers[i] = handler ? handler : write_nop;
+}
+
 static void mapper_set_bank(MemoryBanks* banks, Memory* mem, uint8_t bank_slot, int16_t bank_num)
 {
-	uint32_t ofs = (bank_num * banks->bank_size) % mem->size;
-	banks->banks[bank_slot % banks->bank_count] = mem->data + ofs;
+	/* Point every slot covered by the bank into it, so that lookups don't
+	   need to know the bank size */
+	uint32_t ofs;
+	uint8_t slots_per_bank = banks->bank_size >> banks->slot_shift;
+	uint8_t first = (bank_slot % banks->bank_count) * slots_per_bank;
+	uint8_t i;
+
+	/* Boards without the memory (e.g., no PRG RAM) leave the slots unmapped */
+	if (mem->size == 0)
+		return;
+	ofs = (bank_num * banks->bank_size) % mem->size;
+	for (i = 0; i < slots_per_bank; ++i)
+		banks->slots[first + i] = mem->data + ((ofs + (i << banks->slot_shift)) % mem->size);
 }
 
 void mapper_set_prg_rom_bank(Mapper* mapper, uint8_t bank_slot, int16_t bank_num)
@@ -138,9 +243,3 @@ void mapper_set_chr_bank(Mapper* mapper, uint8_t bank_slot, int16_t bank_num)
 					bank_slot,
 					bank_num);
 }
-
-uint8_t* mapper_get_banked_mem(MemoryBanks* banks, uint16_t addr)
-{
-	uint8_t bank_num = (addr / banks->bank_size) % banks->bank_count;
-	return &banks->banks[bank_num][addr % banks->bank_size];
-}
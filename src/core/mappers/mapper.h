@@ -5,9 +5,21 @@
 
 struct Cartridge;
 
+/* Address space granularity of each bank table. Banks larger than a slot
+   span several consecutive slots */
+#define PRG_ROM_SLOT_SHIFT 12  /* 4KB */
+#define PRG_RAM_SLOT_SHIFT 13  /* 8KB */
+#define CHR_SLOT_SHIFT 10      /* 1KB */
+#define MAX_BANK_SLOTS 8
+
+/* CPU writes are dispatched by 4KB window */
+#define WRITE_WINDOW_SHIFT 12
+#define WRITE_WINDOW_COUNT 16
+
 typedef struct {
-	uint8_t** banks;
-	uint8_t bank_count;
+	uint8_t* slots[MAX_BANK_SLOTS];
+	uint8_t slot_shift;
+	uint8_t bank_count;  /* Set by the mapper */
 	uint16_t bank_size;
 } MemoryBanks;
 
@@ -15,22 +27,61 @@ struct Mapper;
 
 typedef void (*MapperResetFunc)(struct Mapper* mapper);
 typedef void (*MapperWriteFunc)(struct Mapper* mapper, uint16_t addr, uint8_t val);
+typedef void (*MapperScanlineFunc)(struct Mapper* mapper);
+typedef int (*MapperInitializer)(struct Mapper* mapper);
+
+/* Mapper-specific state is allocated along with the rest of the cartridge
+   memory, so each mapper declares its size up front */
+typedef struct {
+	MapperInitializer init;
+	uint32_t data_size;
+} MapperInfo;
 
 typedef struct Mapper {
 	struct Cartridge* cartridge;
-	void* data;  /* Mapper-specific internal data */
+	void* data;  /* Mapper-specific internal data (zeroed before init) */
 	MemoryBanks prg_rom_banks, prg_ram_banks, chr_banks;
 	MapperResetFunc reset;
-	MapperWriteFunc write;
+
+	/* Handlers for CPU writes to $4020-$FFFF, indexed by window. By default,
+	   $6000-$7FFF writes PRG RAM and other windows ignore writes */
+	MapperWriteFunc write_handlers[WRITE_WINDOW_COUNT];
+
+	/* Optional. Called once per rendered scanline, at the dot where PPU A12
+	   is predicted to rise (see ppu.c) */
+	MapperScanlineFunc scanline;
+	uint8_t irq;  /* Set while the mapper asserts the CPU IRQ line */
 } Mapper;
 
-int mapper_init(Mapper* mapper, struct Cartridge* cart, uint8_t mapper_num);
+/* Mapper state without pointers, for snapshots. Bank slots are offsets into
+   their memory (MAPPER_SLOT_UNMAPPED if none). Everything else either lives
+   in the cartridge memory or is fixed at init */
+#define MAPPER_SLOT_UNMAPPED UINT32_MAX
+
+typedef struct {
+	uint32_t prg_rom_slots[MAX_BANK_SLOTS];
+	uint32_t prg_ram_slots[MAX_BANK_SLOTS];
+	uint32_t chr_slots[MAX_BANK_SLOTS];
+	uint8_t irq;
+} MapperState;
+
+const MapperInfo* mapper_get_info(uint16_t mapper_num);  /* NULL if unsupported */
+int mapper_init(Mapper* mapper, struct Cartridge* cart, const MapperInfo* info, void* data);
 void mapper_cleanup(Mapper* mapper);
+void mapper_copy_state(Mapper* dst, const Mapper* src);
+void mapper_save_state(const Mapper* mapper, MapperState* state);
+void mapper_load_state(Mapper* mapper, const MapperState* state);
+void mapper_set_write_handler(Mapper* mapper, uint16_t start, uint16_t end, MapperWriteFunc handler);
 
 void mapper_set_prg_rom_bank(Mapper* mapper, uint8_t bank_slot, int16_t bank_num);
 void mapper_set_prg_ram_bank(Mapper* mapper, uint8_t bank_slot, int16_t bank_num);
 void mapper_set_chr_bank(Mapper* mapper, uint8_t bank_slot, int16_t bank_num);
 
-uint8_t* mapper_get_banked_mem(MemoryBanks* banks, uint16_t addr);
+/* Called on every PRG and CHR access. Addresses are relative to the start
+   of the banked region */
+static inline uint8_t* mapper_get_banked_mem(MemoryBanks* banks, uint16_t addr)
+{
+	return &banks->slots[addr >> banks->slot_shift][addr & ((1 << banks->slot_shift) - 1)];
+}
 
 #endif
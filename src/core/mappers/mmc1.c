@@ -7,10 +7,6 @@
 
 /* TODO: When the CPU writes to the serial port on consecutive cycles, the MMC1 ignores all writes but the first. */
 
-#include <errno.h>
-#include <stdio.h>
-#include <stdlib.h>
-
 #include "../cartridge.h"
 #include "mapper.h"
 
@@ -44,14 +40,16 @@ static void write_reg_ctrl(Mapper* mapper, uint8_t val)
 	switch (val & 3)
 	{
 		case 0:
+			cartridge_set_mirroring(mapper->cartridge, MIRRORING_SINGLE_LOWER);
+			break;
 		case 1:
-			/* TODO: one-screen mirroring */
+			cartridge_set_mirroring(mapper->cartridge, MIRRORING_SINGLE_UPPER);
 			break;
 		case 2:
-			mapper->cartridge->mirror_mode = MIRRORING_VERTICAL;
+			cartridge_set_mirroring(mapper->cartridge, MIRRORING_VERTICAL);
 			break;
 		case 3:
-			mapper->cartridge->mirror_mode = MIRRORING_HORIZONTAL;
+			cartridge_set_mirroring(mapper->cartridge, MIRRORING_HORIZONTAL);
 			break;
 	}
 
@@ -135,61 +133,80 @@ static void reset(Mapper* mapper)
 	mapper_set_chr_bank(mapper, 1, 1);
 }
 
-static void write(Mapper* mapper, uint16_t addr, uint8_t val)
+static int shift_in(Mapper* mapper, uint8_t val, uint8_t* reg_val)
 {
 	/* The MMC1 is configured via a serial port. Writing a value with bit 7
 	   set clears an internal shift register. Otherwise, bit 0 is shifted in.
 	   Register contents are written to the control register specified by bits
-	   13 and 14 of the address on the fifth write */
+	   13 and 14 of the address on the fifth write. Returns 1 when the value
+	   is complete */
 	MMC1Data* data = (MMC1Data*)mapper->data;
 
 	/* Reset. The 1 bit is used to determine when the last write occurs */
 	if (val & 0x80)
 	{
 		data->shift_reg = 0x80;
+		return 0;
 	}
-	else
+
+	/* TODO: When the CPU writes to the serial port on consecutive cycles,
+	   the MMC1 ignores all writes but the first */
+	data->shift_reg = (data->shift_reg >> 1) | ((val & 1) << 7);
+
+	/* Shifted last bit (5th write) */
+	if (data->shift_reg & 4)
 	{
-		/* TODO: When the CPU writes to the serial port on consecutive cycles,
-		   the MMC1 ignores all writes but the first */
-		data->shift_reg = (data->shift_reg >> 1) | ((val & 1) << 7);
-
-		/* Shifted last bit (5th write) */
-		if (data->shift_reg & 4)
-		{
-			/* Address determines which register to write to */
-			data->shift_reg >>= 3;
-			switch ((addr >> 13) & 3)
-			{
-				case 0:
-					write_reg_ctrl(mapper, data->shift_reg);
-					break;
-				case 1:
-					write_reg_chr_bank0(mapper, data->shift_reg);
-					break;
-				case 2:
-					write_reg_chr_bank1(mapper, data->shift_reg);
-					break;
-				case 3:
-					write_reg_prg_bank(mapper, data->shift_reg);
-					break;
-			}
-			data->shift_reg = 0x80;
-		}
+		*reg_val = data->shift_reg >> 3;
+		data->shift_reg = 0x80;
+		return 1;
 	}
+	return 0;
+}
+
+/* Each register has its own 8KB window, so the address is never decoded */
+static void write_ctrl_port(Mapper* mapper, uint16_t addr, uint8_t val)
+{
+	uint8_t reg_val;
+	(void)addr;
+	if (shift_in(mapper, val, &reg_val))
+		write_reg_ctrl(mapper, reg_val);
+}
+
+static void write_chr_bank0_port(Mapper* mapper, uint16_t addr, uint8_t val)
+{
+	uint8_t reg_val;
+	(void)addr;
+	if (shift_in(mapper, val, &reg_val))
+		write_reg_chr_bank0(mapper, reg_val);
+}
+
+static void write_chr_bank1_port(Mapper* mapper, uint16_t addr, uint8_t val)
+{
+	uint8_t reg_val;
+	(void)addr;
+	if (shift_in(mapper, val, &reg_val))
+		write_reg_chr_bank1(mapper, reg_val);
+}
+
+static void write_prg_bank_port(Mapper* mapper, uint16_t addr, uint8_t val)
+{
+	uint8_t reg_val;
+	(void)addr;
+	if (shift_in(mapper, val, &reg_val))
+		write_reg_prg_bank(mapper, reg_val);
 }
 
 int mmc1_init(Mapper* mapper)
 {
-	if (!(mapper->data = malloc(sizeof(MMC1Data))))
-	{
-		fprintf(stderr, "Error: unable to allocate memory for MMC1 registers (code %d)\n", errno);
-		return -1;
-	}
 	mapper->prg_rom_banks.bank_count = 2;
 	mapper->prg_ram_banks.bank_count = 1;
 	mapper->chr_banks.bank_count = 2;
 	mapper->reset = reset;
-	mapper->write = write;
+	mapper_set_write_handler(mapper, 0x8000, 0x9FFF, write_ctrl_port);
+	mapper_set_write_handler(mapper, 0xA000, 0xBFFF, write_chr_bank0_port);
+	mapper_set_write_handler(mapper, 0xC000, 0xDFFF, write_chr_bank1_port);
+	mapper_set_write_handler(mapper, 0xE000, 0xFFFF, write_prg_bank_port);
 	return 0;
 }
+
+const MapperInfo mmc1_info = { mmc1_init, sizeof(MMC1Data) };
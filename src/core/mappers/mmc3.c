@@ -0,0 +1,156 @@
+/* MMC3 (TxROM boards; iNES mapper 4):
+	-4 8KB PRG ROM banks
+	  -Two are switchable
+	  -One is fixed to the second-last bank, at $8000 or $C000
+	  -The last is fixed to the last bank
+	-8 1KB CHR banks, switched as 2 2KB banks and 4 1KB banks
+	-Scanline counter, clocked by rising edges on PPU A12, which can
+	 generate IRQs
+*/
+
+#include <string.h>
+
+#include "../cartridge.h"
+#include "mapper.h"
+
+typedef struct {
+	uint8_t bank_select;
+	uint8_t bank_regs[8];
+	uint8_t irq_latch;
+	uint8_t irq_counter;
+	uint8_t irq_reload;
+	uint8_t irq_enabled;
+} MMC3Data;
+
+static void update_prg_banks(Mapper* mapper)
+{
+	/* PRG ROM bank mode (bit 6 of bank select):
+		0: $8000 swappable (R6), $C000 fixed to second-last bank
+		1: $C000 swappable (R6), $8000 fixed to second-last bank
+	   $A000 is always R7 and $E000 is always the last bank */
+	MMC3Data* data = (MMC3Data*)mapper->data;
+	uint8_t swap = (data->bank_select >> 6) & 1;
+	mapper_set_prg_rom_bank(mapper, swap * 2, data->bank_regs[6] & 0x3F);
+	mapper_set_prg_rom_bank(mapper, 1, data->bank_regs[7] & 0x3F);
+	mapper_set_prg_rom_bank(mapper, (swap ^ 1) * 2, -2);
+	mapper_set_prg_rom_bank(mapper, 3, -1);
+}
+
+static void update_chr_banks(Mapper* mapper)
+{
+	/* CHR A12 inversion (bit 7 of bank select) swaps the 2KB banks (R0, R1)
+	   at $0000-$0FFF with the 1KB banks (R2-R5) at $1000-$1FFF */
+	MMC3Data* data = (MMC3Data*)mapper->data;
+	uint8_t inv = (data->bank_select & 0x80) ? 4 : 0;
+	uint8_t i;
+	mapper_set_chr_bank(mapper, inv, data->bank_regs[0] & 0xFE);
+	mapper_set_chr_bank(mapper, inv + 1, data->bank_regs[0] | 1);
+	mapper_set_chr_bank(mapper, inv + 2, data->bank_regs[1] & 0xFE);
+	mapper_set_chr_bank(mapper, inv + 3, data->bank_regs[1] | 1);
+	for (i = 0; i < 4; ++i)
+		mapper_set_chr_bank(mapper, (inv ^ 4) + i, data->bank_regs[2 + i]);
+}
+
+static void reset(Mapper* mapper)
+{
+	MMC3Data* data = (MMC3Data*)mapper->data;
+	memset(data, 0, sizeof(MMC3Data));
+	mapper->irq = 0;
+
+	mapper_set_prg_ram_bank(mapper, 0, 0);
+	update_prg_banks(mapper);
+	update_chr_banks(mapper);
+}
+
+static void scanline(Mapper* mapper)
+{
+	/* The counter is reloaded when it is zero (or a reload was requested),
+	   and decremented otherwise. Reaching zero triggers an IRQ if enabled */
+	MMC3Data* data = (MMC3Data*)mapper->data;
+	if (data->irq_counter == 0 || data->irq_reload)
+	{
+		data->irq_counter = data->irq_latch;
+		data->irq_reload = 0;
+	}
+	else
+	{
+		--data->irq_counter;
+	}
+
+	if (data->irq_counter == 0 && data->irq_enabled)
+		mapper->irq = 1;
+}
+
+/* Each 8KB window has its own handler. Address bit 0 selects the register:
+	$8000 (even): bank select
+	$8001 (odd):  bank data
+	$A000 (even): mirroring
+	$A001 (odd):  PRG RAM protect
+	$C000 (even): IRQ latch
+	$C001 (odd):  IRQ reload
+	$E000 (even): IRQ disable (and acknowledge)
+	$E001 (odd):  IRQ enable */
+static void write_bank_regs(Mapper* mapper, uint16_t addr, uint8_t val)
+{
+	MMC3Data* data = (MMC3Data*)mapper->data;
+	if (!(addr & 1))
+	{
+		data->bank_select = val;
+		update_prg_banks(mapper);
+		update_chr_banks(mapper);
+	}
+	else
+	{
+		data->bank_regs[data->bank_select & 7] = val;
+		if ((data->bank_select & 7) >= 6)
+			update_prg_banks(mapper);
+		else
+			update_chr_banks(mapper);
+	}
+}
+
+static void write_mirroring(Mapper* mapper, uint16_t addr, uint8_t val)
+{
+	/* TODO: PRG RAM write protection (odd). Left enabled for compatibility */
+	if (!(addr & 1) && mapper->cartridge->mirror_mode != MIRRORING_4SCREEN)
+		cartridge_set_mirroring(mapper->cartridge, (val & 1) ? MIRRORING_HORIZONTAL : MIRRORING_VERTICAL);
+}
+
+static void write_irq_counter(Mapper* mapper, uint16_t addr, uint8_t val)
+{
+	MMC3Data* data = (MMC3Data*)mapper->data;
+	if (!(addr & 1))
+	{
+		data->irq_latch = val;
+	}
+	else
+	{
+		data->irq_counter = 0;
+		data->irq_reload = 1;
+	}
+}
+
+static void write_irq_enable(Mapper* mapper, uint16_t addr, uint8_t val)
+{
+	MMC3Data* data = (MMC3Data*)mapper->data;
+	(void)val;  /* Only the address matters */
+	data->irq_enabled = addr & 1;
+	if (!data->irq_enabled)
+		mapper->irq = 0;  /* Disabling also acknowledges */
+}
+
+int mmc3_init(Mapper* mapper)
+{
+	mapper->prg_rom_banks.bank_count = 4;
+	mapper->prg_ram_banks.bank_count = 1;
+	mapper->chr_banks.bank_count = 8;
+	mapper->reset = reset;
+	mapper_set_write_handler(mapper, 0x8000, 0x9FFF, write_bank_regs);
+	mapper_set_write_handler(mapper, 0xA000, 0xBFFF, write_mirroring);
+	mapper_set_write_handler(mapper, 0xC000, 0xDFFF, write_irq_counter);
+	mapper_set_write_handler(mapper, 0xE000, 0xFFFF, write_irq_enable);
+	mapper->scanline = scanline;
+	return 0;
+}
+
+const MapperInfo mmc3_info = { mmc3_init, sizeof(MMC3Data) };
@@ -16,17 +16,13 @@ static void reset(Mapper* mapper)
 		mapper_set_prg_rom_bank(mapper, 1, 0);
 }
 
-static void write(Mapper* mapper, uint16_t addr, uint8_t val)
-{
-	/* No bank switching or special logic */
-}
-
 int nrom_init(Mapper* mapper)
 {
 	mapper->prg_rom_banks.bank_count = 2;
 	mapper->prg_ram_banks.bank_count = 1;
 	mapper->chr_banks.bank_count = 1;
-	mapper->reset = reset;
-	mapper->write = write;
+	mapper->reset = reset;  /* No registers */
 	return 0;
 }
+
+const MapperInfo nrom_info = { nrom_init, 0 };
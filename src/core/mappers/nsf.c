@@ -0,0 +1,37 @@
+/* NSF player board (no iNES number; used for NSF music playback):
+	-8 4KB PRG ROM banks, switchable through $5FF8-$5FFF
+	-8KB PRG RAM at $6000-$7FFF
+	-CHR is unused, but a bank is mapped so PPU accesses stay valid
+*/
+
+#include "../cartridge.h"
+#include "mapper.h"
+
+static void reset(Mapper* mapper)
+{
+	/* Non-bankswitched tunes are loaded into a flat 32KB image */
+	uint8_t i = 0;
+	for (; i < 8; ++i)
+		mapper_set_prg_rom_bank(mapper, i, i);
+	mapper_set_prg_ram_bank(mapper, 0, 0);
+	mapper_set_chr_bank(mapper, 0, 0);
+}
+
+static void write_bank_select(Mapper* mapper, uint16_t addr, uint8_t val)
+{
+	/* $5FF8-$5FFF select the 4KB bank at $8000, $9000, ..., $F000 */
+	if (addr >= 0x5FF8)
+		mapper_set_prg_rom_bank(mapper, addr - 0x5FF8, val);
+}
+
+int nsf_mapper_init(Mapper* mapper)
+{
+	mapper->prg_rom_banks.bank_count = 8;
+	mapper->prg_ram_banks.bank_count = 1;
+	mapper->chr_banks.bank_count = 1;
+	mapper->reset = reset;
+	mapper_set_write_handler(mapper, 0x5000, 0x5FFF, write_bank_select);
+	return 0;
+}
+
+const MapperInfo nsf_mapper_info = { nsf_mapper_init, 0 };
@@ -16,7 +16,7 @@ static void reset(Mapper* mapper)
 	mapper_set_chr_bank(mapper, 0, 0);
 }
 
-static void write(Mapper* mapper, uint16_t addr, uint8_t val)
+static void write_bank_select(Mapper* mapper, uint16_t addr, uint8_t val)
 {
 	/* 7  bit  0
 	   ---- ----
@@ -33,6 +33,8 @@ int uxrom_init(Mapper* mapper)
 	mapper->prg_ram_banks.bank_count = 1;
 	mapper->chr_banks.bank_count = 1;
 	mapper->reset = reset;
-	mapper->write = write;
+	mapper_set_write_handler(mapper, 0x8000, 0xFFFF, write_bank_select);
 	return 0;
 }
+
+const MapperInfo uxrom_info = { uxrom_init, 0 };
@@ -34,7 +34,7 @@ uint8_t memory_get(NES* nes, uint16_t addr)
 		return controller_read_output(&nes->c1);
 	else if (addr == 0x4017)
 		return controller_read_output(&nes->c2);
-	else if (addr >= 0x8000 && addr < 0xFFFF)
+	else if (addr > 0x401F)
 		return cartridge_read(&nes->cartridge, addr);
 	else
 		return 0;
@@ -66,11 +66,21 @@ void memory_set(NES* nes, uint16_t addr, uint8_t val)
 		apu_write(&nes->apu, addr, val);
 	else if (addr == 0x4016)
 	{
+		/* The controllers reload their buttons for as long as the strobe is
+		   high, so input set when it rises is what the game reads */
+		if ((val & 1) && !(nes->c1.input & 1) && nes->latch_cb)
+			nes->latch_cb(nes, nes->latch_userdata);
 		controller_write_input(&nes->c1, val);
 		controller_write_input(&nes->c2, val);
 	}
 	else if (addr < 0x4018)
 		apu_write(&nes->apu, addr, val);
 	else if (addr > 0x401F)
+	{
+		/* Bank switches must not affect DMC fetches that are already due.
+		   Mapper registers can assert or acknowledge IRQs */
+		apu_sync(&nes->apu);
 		cartridge_write(&nes->cartridge, addr, val);
+		cpu_set_irq_line(&nes->cpu, IRQ_SOURCE_MAPPER, nes->cartridge.mapper.irq);
+	}
 }
@@ -0,0 +1,616 @@
+/* Input movies. Files are FM2-style text: "key value" header lines, then a
+   "|commands|port 0|port 1||" line per frame. Each port lists the buttons
+   in RLDUTSBA order (bit 7 to bit 0), with '.' for released ones.
+   Keyframes are kept in a binary file next to it: a header, then a seek
+   index with an entry per keyframe, then the states the index points to */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cartridge.h"
+#include "movie.h"
+
+#define MOVIE_VERSION 3
+#define MOVIE_INITIAL_FRAMES 3600  /* A minute */
+#define KEYFRAME_MAGIC "PNKF"
+#define KEYFRAME_VERSION 1
+#define KEYFRAME_SUFFIX ".keys"
+
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t rom_crc;
+	uint32_t count;
+} KeyframeHeader;
+
+typedef struct {
+	uint32_t frame;
+	uint32_t hash;
+	uint32_t size;
+	uint32_t reserved;
+	uint64_t offset;  /* From the start of the file */
+} KeyframeEntry;
+
+typedef enum {
+	SEGMENT_UNVERIFIED = 0,
+	SEGMENT_MATCHED,
+	SEGMENT_MISMATCHED
+} SegmentResult;
+
+/* Segments are claimed one at a time, so threads that get shorter (or
+   quieter) ones just take more */
+typedef struct {
+	const Movie* movie;
+	const NES* parent;
+	atomic_uint next;
+	uint8_t* results;  /* SegmentResult per segment */
+} Verifier;
+
+static const char button_names[] = "RLDUTSBA";
+
+static int reserve(Movie* movie, uint32_t frames)
+{
+	uint32_t capacity = movie->capacity ? movie->capacity : MOVIE_INITIAL_FRAMES;
+	uint8_t* inputs;
+	if (frames <= movie->capacity)
+		return 0;
+	while (capacity < frames)
+		capacity *= 2;
+	if (!(inputs = (uint8_t*)realloc(movie->inputs, (size_t)capacity * MOVIE_PORTS)))
+	{
+		fprintf(stderr, "Error: unable to allocate movie (code %d)\n", errno);
+		return -1;
+	}
+	movie->inputs = inputs;
+	movie->capacity = capacity;
+	return 0;
+}
+
+static void apply_input(NES* nes, const uint8_t* input)
+{
+	controller_set_buttons(&nes->c1, input[0]);
+	controller_set_buttons(&nes->c2, input[1]);
+}
+
+static void on_latch(NES* nes, void* userdata)
+{
+	static const uint8_t released[MOVIE_PORTS];
+	Movie* movie = (Movie*)userdata;
+	uint32_t frame = movie_frame(movie, nes);
+
+	if (movie->mode == MOVIE_RECORDING && frame >= movie->frame_count)
+	{
+		/* The first latch of a frame fixes its input. Frames that never
+		   latched are given the same, since nothing read them */
+		if (reserve(movie, frame + 1) != 0)
+		{
+			apply_input(nes, movie->held);
+			return;
+		}
+		while (movie->frame_count <= frame)
+			memcpy(movie->inputs + (size_t)movie->frame_count++ * MOVIE_PORTS, movie->held, MOVIE_PORTS);
+	}
+	apply_input(nes, frame < movie->frame_count ? movie->inputs + (size_t)frame * MOVIE_PORTS : released);
+}
+
+static int resume(Movie* movie, NES* nes, const MovieKeyframe* keyframe)
+{
+	if (nes_load_state(nes, keyframe->state, keyframe->size) != 0)
+		return -1;
+	movie->start_frame = nes->ppu.frames - keyframe->frame;
+	nes_set_latch_callback(nes, on_latch, movie);
+	return 0;
+}
+
+int movie_record(Movie* movie, NES* nes)
+{
+	memset(movie, 0, sizeof(Movie));
+	movie->mode = MOVIE_RECORDING;
+	movie->rom_crc = cartridge_crc(&nes->cartridge);
+	movie->start_frame = nes->ppu.frames;
+	movie->keyframe_interval = MOVIE_KEYFRAME_INTERVAL;
+	if (reserve(movie, MOVIE_INITIAL_FRAMES) != 0 || movie_add_keyframe(movie, nes) != 0)
+	{
+		movie_free(movie);
+		return -1;
+	}
+	nes_set_latch_callback(nes, on_latch, movie);
+	return 0;
+}
+
+int movie_play(Movie* movie, NES* nes)
+{
+	uint32_t crc = cartridge_crc(&nes->cartridge);
+	if (movie->rom_crc && movie->rom_crc != crc)
+	{
+		fprintf(stderr, "Error: movie was recorded with a different ROM (CRC %08X, not %08X)\n",
+				movie->rom_crc, crc);
+		return -1;
+	}
+	movie->mode = MOVIE_PLAYING;
+	movie->start_frame = nes->ppu.frames;
+	nes_set_latch_callback(nes, on_latch, movie);
+	return 0;
+}
+
+void movie_set_buttons(Movie* movie, uint8_t port, uint8_t buttons)
+{
+	movie->held[port % MOVIE_PORTS] = buttons;
+}
+
+int movie_update(Movie* movie, NES* nes)
+{
+	/* The first call of a frame is right where nes_run_frame stops, which
+	   is where replays compare states */
+	uint32_t frame = movie_frame(movie, nes);
+	if (movie->mode != MOVIE_RECORDING || !movie->keyframe_interval || frame % movie->keyframe_interval != 0)
+		return 0;
+	return movie_add_keyframe(movie, nes);
+}
+
+int movie_add_keyframe(Movie* movie, NES* nes)
+{
+	MovieKeyframe* keyframe;
+	uint32_t frame = movie_frame(movie, nes);
+
+	if (movie->keyframe_count && movie->keyframes[movie->keyframe_count - 1].frame >= frame)
+		return 0;
+	if (movie->keyframe_count == movie->keyframe_capacity)
+	{
+		uint32_t capacity = movie->keyframe_capacity ? movie->keyframe_capacity * 2 : 16;
+		if (!(keyframe = (MovieKeyframe*)realloc(movie->keyframes, capacity * sizeof(MovieKeyframe))))
+		{
+			fprintf(stderr, "Error: unable to allocate keyframe (code %d)\n", errno);
+			return -1;
+		}
+		movie->keyframes = keyframe;
+		movie->keyframe_capacity = capacity;
+	}
+
+	/* Hashing brings the APU up to date, which can change the state size */
+	keyframe = &movie->keyframes[movie->keyframe_count];
+	keyframe->frame = frame;
+	keyframe->hash = nes_state_hash(nes);
+	keyframe->size = (uint32_t)nes_state_size(nes);
+	if (!(keyframe->state = (uint8_t*)malloc(keyframe->size)))
+	{
+		fprintf(stderr, "Error: unable to allocate keyframe (code %d)\n", errno);
+		return -1;
+	}
+	nes_save_state(nes, keyframe->state, keyframe->size);
+	++movie->keyframe_count;
+	return 0;
+}
+
+int movie_seek(Movie* movie, NES* nes, uint32_t frame)
+{
+	const MovieKeyframe* keyframe = NULL;
+	uint32_t current = movie_frame(movie, nes), i;
+
+	if (movie->mode != MOVIE_PLAYING || frame > movie->frame_count)
+	{
+		fprintf(stderr, "Error: can't seek to frame %u\n", frame);
+		return -1;
+	}
+	for (i = 0; i < movie->keyframe_count && movie->keyframes[i].frame <= frame; ++i)
+		keyframe = &movie->keyframes[i];
+	if (keyframe && (current > frame || keyframe->frame > current))
+	{
+		if (resume(movie, nes, keyframe) != 0)
+			return -1;
+	}
+	else if (current > frame)
+	{
+		fprintf(stderr, "Error: no keyframe to seek back to frame %u from\n", frame);
+		return -1;
+	}
+	while (movie_frame(movie, nes) < frame && nes->cpu.is_running)
+		nes_run_frame(nes);
+	return 0;
+}
+
+static uint8_t verify_segment(const Movie* movie, NES* nes, uint32_t index)
+{
+	/* The copy shares the inputs, but starts where the segment does */
+	const MovieKeyframe* end = &movie->keyframes[index + 1];
+	Movie view = *movie;
+	uint8_t matched;
+
+	view.mode = MOVIE_PLAYING;
+	if (resume(&view, nes, &movie->keyframes[index]) != 0)
+		return SEGMENT_MISMATCHED;
+	while (movie_frame(&view, nes) < end->frame && nes->cpu.is_running)
+		nes_run_frame(nes);
+	matched = movie_frame(&view, nes) == end->frame && nes_state_hash(nes) == end->hash;
+	nes_set_latch_callback(nes, NULL, NULL);
+	return matched ? SEGMENT_MATCHED : SEGMENT_MISMATCHED;
+}
+
+static void* verify_thread(void* userdata)
+{
+	/* Segments left unclaimed if this fails are picked up by the others */
+	Verifier* verifier = (Verifier*)userdata;
+	uint32_t segments = verifier->movie->keyframe_count - 1, i;
+	NES* nes = (NES*)malloc(sizeof(NES));
+
+	if (!nes || nes_fork_detached(nes, verifier->parent) != 0)
+	{
+		free(nes);
+		return NULL;
+	}
+	while ((i = atomic_fetch_add_explicit(&verifier->next, 1, memory_order_relaxed)) < segments)
+		verifier->results[i] = verify_segment(verifier->movie, nes, i);
+	nes_unload_rom(nes);
+	nes_cleanup(nes);
+	free(nes);
+	return NULL;
+}
+
+int movie_verify(const Movie* movie, const NES* nes, uint32_t threads, MovieVerification* result)
+{
+	Verifier verifier;
+	pthread_t* workers;
+	uint32_t segments = movie->keyframe_count ? movie->keyframe_count - 1 : 0, started = 0, i;
+	int ret = 0;
+
+	memset(result, 0, sizeof(MovieVerification));
+	result->first_mismatch = UINT32_MAX;
+	if (segments == 0)
+	{
+		fprintf(stderr, "Error: movie has no keyframes to verify\n");
+		return -1;
+	}
+	if (threads == 0)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? (uint32_t)cores : 1;
+	}
+	if (threads > segments)
+		threads = segments;
+
+	verifier.movie = movie;
+	verifier.parent = nes;
+	atomic_init(&verifier.next, 0);
+	verifier.results = (uint8_t*)calloc(segments, 1);
+	workers = (pthread_t*)malloc(threads * sizeof(pthread_t));
+	if (!verifier.results || !workers)
+	{
+		fprintf(stderr, "Error: unable to allocate verifier (code %d)\n", errno);
+		free(verifier.results);
+		free(workers);
+		return -1;
+	}
+
+	/* The caller verifies too. Fewer threads than asked for just means
+	   more segments each */
+	while (started < threads - 1 && pthread_create(&workers[started], NULL, verify_thread, &verifier) == 0)
+		++started;
+	verify_thread(&verifier);
+	for (i = 0; i < started; ++i)
+		pthread_join(workers[i], NULL);
+
+	for (i = 0; i < segments; ++i)
+	{
+		if (verifier.results[i] == SEGMENT_UNVERIFIED)
+			ret = -1;
+		else if (verifier.results[i] == SEGMENT_MISMATCHED && result->mismatches++ == 0)
+			result->first_mismatch = movie->keyframes[i + 1].frame;
+	}
+	result->segments = segments;
+	if (ret != 0)
+		fprintf(stderr, "Error: unable to start any verifier\n");
+	free(verifier.results);
+	free(workers);
+	return ret;
+}
+
+uint32_t movie_frame(const Movie* movie, const NES* nes)
+{
+	return nes->ppu.frames - movie->start_frame;
+}
+
+uint8_t movie_finished(const Movie* movie, const NES* nes)
+{
+	return movie->mode == MOVIE_PLAYING && movie_frame(movie, nes) >= movie->frame_count;
+}
+
+void movie_stop(Movie* movie, NES* nes)
+{
+	uint32_t frame = movie_frame(movie, nes);
+	if (nes->latch_userdata == movie)
+		nes_set_latch_callback(nes, NULL, NULL);
+	if (movie->mode != MOVIE_RECORDING)
+		return;
+
+	/* Input latched for the unfinished frame is dropped, and trailing frames
+	   that never latched are filled in */
+	if (frame < movie->frame_count)
+		movie->frame_count = frame;
+	else if (reserve(movie, frame) == 0)
+	{
+		while (movie->frame_count < frame)
+			memcpy(movie->inputs + (size_t)movie->frame_count++ * MOVIE_PORTS, movie->held, MOVIE_PORTS);
+	}
+	while (movie->keyframe_count && movie->keyframes[movie->keyframe_count - 1].frame > movie->frame_count)
+		free(movie->keyframes[--movie->keyframe_count].state);
+}
+
+static int parse_port(char** str, uint8_t* buttons)
+{
+	/* Ports without a controller are empty */
+	char* p = *str;
+	uint8_t i;
+	*buttons = 0;
+	if (*p == '|')
+	{
+		*str = p + 1;
+		return 0;
+	}
+	for (i = 0; i < 8; ++i, ++p)
+	{
+		if (*p == '\0' || *p == '|' || *p == '\n')
+			return -1;
+		if (*p != '.' && *p != ' ')
+			*buttons |= 0x80 >> i;
+	}
+	if (*p != '|')
+		return -1;
+	*str = p + 1;
+	return 0;
+}
+
+static int parse_frame(char* line, uint8_t* input)
+{
+	/* Commands (resets, etc.) aren't supported */
+	char* end;
+	uint8_t i;
+	if (strtol(line + 1, &end, 10) != 0 || *end != '|')
+		return -1;
+	++end;
+	for (i = 0; i < MOVIE_PORTS; ++i)
+	{
+		if (parse_port(&end, &input[i]) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static char* keyframe_path(const char* path)
+{
+	char* keys_path = (char*)malloc(strlen(path) + sizeof(KEYFRAME_SUFFIX));
+	if (!keys_path)
+	{
+		fprintf(stderr, "Error: unable to allocate path (code %d)\n", errno);
+		return NULL;
+	}
+	strcpy(keys_path, path);
+	strcat(keys_path, KEYFRAME_SUFFIX);
+	return keys_path;
+}
+
+static int read_keyframes(Movie* movie, FILE* file)
+{
+	KeyframeHeader header;
+	KeyframeEntry* index;
+	uint32_t i;
+
+	if (fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, KEYFRAME_MAGIC, 4) != 0 ||
+		header.version != KEYFRAME_VERSION || header.rom_crc != movie->rom_crc || header.count == 0)
+	{
+		return -1;
+	}
+	index = (KeyframeEntry*)calloc(header.count, sizeof(KeyframeEntry));
+	movie->keyframes = (MovieKeyframe*)calloc(header.count, sizeof(MovieKeyframe));
+	if (!index || !movie->keyframes || fread(index, sizeof(KeyframeEntry), header.count, file) != header.count)
+	{
+		free(index);
+		return -1;
+	}
+	movie->keyframe_capacity = header.count;
+
+	/* Keyframes have to be in order, and within the movie */
+	for (i = 0; i < header.count; ++i)
+	{
+		MovieKeyframe* keyframe = &movie->keyframes[i];
+		if (index[i].frame > movie->frame_count || (i > 0 && index[i].frame <= index[i - 1].frame) ||
+			!(keyframe->state = (uint8_t*)malloc(index[i].size ? index[i].size : 1)))
+		{
+			break;
+		}
+		keyframe->frame = index[i].frame;
+		keyframe->hash = index[i].hash;
+		keyframe->size = index[i].size;
+		++movie->keyframe_count;
+		if (fseek(file, (long)index[i].offset, SEEK_SET) != 0 ||
+			fread(keyframe->state, 1, keyframe->size, file) != keyframe->size)
+		{
+			break;
+		}
+	}
+	free(index);
+	return i == header.count ? 0 : -1;
+}
+
+static int load_keyframes(Movie* movie, const char* path)
+{
+	/* Movies don't need keyframes, so a missing file is fine */
+	char* keys_path = keyframe_path(path);
+	FILE* file;
+	int ret;
+
+	if (!keys_path)
+		return -1;
+	file = fopen(keys_path, "rb");
+	free(keys_path);
+	if (!file)
+	{
+		if (errno == ENOENT)
+			return 0;
+		fprintf(stderr, "Error: unable to open keyframe file (code %d)\n", errno);
+		return -1;
+	}
+	if ((ret = read_keyframes(movie, file)) != 0)
+		fprintf(stderr, "Error: invalid keyframe file\n");
+	fclose(file);
+	return ret;
+}
+
+static int save_keyframes(const Movie* movie, const char* path)
+{
+	/* Keyframes left from an earlier recording are removed */
+	KeyframeHeader header;
+	KeyframeEntry entry;
+	uint64_t offset = sizeof(KeyframeHeader) + (uint64_t)movie->keyframe_count * sizeof(KeyframeEntry);
+	char* keys_path = keyframe_path(path);
+	FILE* file;
+	uint32_t i;
+	int ret;
+
+	if (!keys_path)
+		return -1;
+	if (!movie->keyframe_count)
+	{
+		remove(keys_path);
+		free(keys_path);
+		return 0;
+	}
+	file = fopen(keys_path, "wb");
+	free(keys_path);
+	if (!file)
+	{
+		fprintf(stderr, "Error: unable to create keyframe file (code %d)\n", errno);
+		return -1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, KEYFRAME_MAGIC, 4);
+	header.version = KEYFRAME_VERSION;
+	header.rom_crc = movie->rom_crc;
+	header.count = movie->keyframe_count;
+	fwrite(&header, sizeof(header), 1, file);
+	for (i = 0; i < movie->keyframe_count; ++i)
+	{
+		memset(&entry, 0, sizeof(entry));
+		entry.frame = movie->keyframes[i].frame;
+		entry.hash = movie->keyframes[i].hash;
+		entry.size = movie->keyframes[i].size;
+		entry.offset = offset;
+		offset += entry.size;
+		fwrite(&entry, sizeof(entry), 1, file);
+	}
+	for (i = 0; i < movie->keyframe_count; ++i)
+		fwrite(movie->keyframes[i].state, 1, movie->keyframes[i].size, file);
+
+	ret = ferror(file) ? -1 : 0;
+	if (fclose(file) != 0 || ret != 0)
+	{
+		fprintf(stderr, "Error: unable to write keyframe file (code %d)\n", errno);
+		return -1;
+	}
+	return 0;
+}
+
+int movie_load(Movie* movie, const char* path)
+{
+	char line[256];
+	uint32_t line_num = 0;
+	FILE* file;
+
+	memset(movie, 0, sizeof(Movie));
+	movie->mode = MOVIE_PLAYING;
+	if (!(file = fopen(path, "r")))
+	{
+		fprintf(stderr, "Error: unable to open movie file (code %d)\n", errno);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), file))
+	{
+		++line_num;
+		if (line[0] == '|')
+		{
+			if (reserve(movie, movie->frame_count + 1) != 0 ||
+				parse_frame(line, movie->inputs + (size_t)movie->frame_count * MOVIE_PORTS) != 0)
+			{
+				fprintf(stderr, "Error: invalid movie frame (line %u)\n", line_num);
+				movie_free(movie);
+				fclose(file);
+				return -1;
+			}
+			++movie->frame_count;
+		}
+		else if (strncmp(line, "version ", 8) == 0 && atoi(line + 8) != MOVIE_VERSION)
+		{
+			fprintf(stderr, "Error: unsupported movie version (%d)\n", atoi(line + 8));
+			movie_free(movie);
+			fclose(file);
+			return -1;
+		}
+		else if (strncmp(line, "romCRC32 ", 9) == 0)
+			movie->rom_crc = (uint32_t)strtoul(line + 9, NULL, 16);
+	}
+	fclose(file);
+	if (load_keyframes(movie, path) != 0)
+	{
+		movie_free(movie);
+		return -1;
+	}
+	return 0;
+}
+
+int movie_save(const Movie* movie, const char* path, const char* rom_name)
+{
+	char line[32];
+	uint32_t frame;
+	uint8_t port, i;
+	FILE* file;
+	int ret;
+
+	if (!(file = fopen(path, "w")))
+	{
+		fprintf(stderr, "Error: unable to create movie file (code %d)\n", errno);
+		return -1;
+	}
+	fprintf(file, "version %d\nemuVersion 1\nrerecordCount 0\nromFilename %s\nromCRC32 %08X\n"
+			"fourscore 0\nmicrophone 0\nport0 1\nport1 1\nport2 0\n",
+			MOVIE_VERSION, rom_name ? rom_name : "", movie->rom_crc);
+	for (frame = 0; frame < movie->frame_count; ++frame)
+	{
+		char* p = line;
+		*p++ = '|';
+		*p++ = '0';
+		*p++ = '|';
+		for (port = 0; port < MOVIE_PORTS; ++port)
+		{
+			uint8_t buttons = movie->inputs[(size_t)frame * MOVIE_PORTS + port];
+			for (i = 0; i < 8; ++i)
+				*p++ = (buttons & (0x80 >> i)) ? button_names[i] : '.';
+			*p++ = '|';
+		}
+		*p++ = '|';
+		*p++ = '\n';
+		fwrite(line, 1, p - line, file);
+	}
+
+	ret = ferror(file) ? -1 : 0;
+	if (fclose(file) != 0 || ret != 0)
+	{
+		fprintf(stderr, "Error: unable to write movie file (code %d)\n", errno);
+		return -1;
+	}
+	return save_keyframes(movie, path);
+}
+
+void movie_free(Movie* movie)
+{
+	uint32_t i;
+	for (i = 0; i < movie->keyframe_count; ++i)
+		free(movie->keyframes[i].state);
+	free(movie->keyframes);
+	free(movie->inputs);
+	memset(movie, 0, sizeof(Movie));
+}
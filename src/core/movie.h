@@ -0,0 +1,92 @@
+#ifndef MOVIE_H
+#define MOVIE_H
+
+#include <stdint.h>
+
+#include "nes.h"
+
+#define MOVIE_PORTS 2
+#define MOVIE_KEYFRAME_INTERVAL 600  /* Ten seconds */
+
+typedef enum {
+	MOVIE_RECORDING,
+	MOVIE_PLAYING
+} MovieMode;
+
+/* Save state taken between frames, for seeking and for verifying a replay
+   a segment at a time */
+typedef struct {
+	uint32_t frame;  /* Movie frame that runs next */
+	uint32_t hash;   /* See nes_state_hash */
+	uint32_t size;
+	uint8_t* state;
+} MovieKeyframe;
+
+/* Input log, one entry per frame and controller, played back from power-on.
+   Input only reaches the game when it latches the controllers, so a frame's
+   input is applied there: while recording, the buttons held at a frame's
+   first latch are recorded and kept for the rest of the frame. Playback
+   applies the same input at the same points, which makes it bit-identical
+   no matter how fast it runs. Saved as text in the style of FCEUX's FM2 */
+typedef struct {
+	MovieMode mode;
+	uint8_t* inputs;  /* MOVIE_PORTS ControllerButton flags per frame */
+	uint32_t frame_count;
+	uint32_t capacity;  /* In frames */
+	uint32_t rom_crc;   /* See cartridge_crc. 0 if unknown */
+	uint32_t start_frame;  /* PPU frame count the movie started at */
+	uint8_t held[MOVIE_PORTS];  /* Recording: buttons that the next frame latches */
+
+	/* Sorted by frame. Saved next to the movie, since FM2 has no room for
+	   them (see movie_save) */
+	MovieKeyframe* keyframes;
+	uint32_t keyframe_count;
+	uint32_t keyframe_capacity;
+	uint32_t keyframe_interval;  /* Recording: frames between keyframes (0 for none) */
+} Movie;
+
+typedef struct {
+	uint32_t segments;        /* Replayed from one keyframe to the next */
+	uint32_t mismatches;      /* Segments that didn't end in the next keyframe's state */
+	uint32_t first_mismatch;  /* Frame the first of them should have ended at */
+} MovieVerification;
+
+/* Movies start at power-on, so these must be called right after the ROM is
+   loaded into a newly initialized NES. They take over its latch callback */
+int movie_record(Movie* movie, NES* nes);
+int movie_play(Movie* movie, NES* nes);  /* After movie_load */
+
+/* Recording only. Takes effect at the next frame that latches */
+void movie_set_buttons(Movie* movie, uint8_t port, uint8_t buttons);
+
+/* Recording only. Takes a keyframe every keyframe_interval frames, so it
+   must be called right after each nes_update (or nes_run_frame). A keyframe
+   can also be taken between frames explicitly (e.g., before stopping, so
+   that the whole movie can be verified) */
+int movie_update(Movie* movie, NES* nes);
+int movie_add_keyframe(Movie* movie, NES* nes);
+
+/* Playback only. Restores the last keyframe at or before the frame (unless
+   the NES is already between them), then runs up to it */
+int movie_seek(Movie* movie, NES* nes, uint32_t frame);
+
+/* Replays the segments between keyframes in parallel, each on a detached
+   fork of the NES (which must have the ROM loaded, but needn't be playing
+   the movie), and checks that each one ends in the state of the next
+   keyframe. 0 threads for one per core */
+int movie_verify(const Movie* movie, const NES* nes, uint32_t threads, MovieVerification* result);
+
+/* Frames the NES has run since the movie started */
+uint32_t movie_frame(const Movie* movie, const NES* nes);
+uint8_t movie_finished(const Movie* movie, const NES* nes);  /* Playback has run every frame */
+
+/* Detaches the movie. A recording ends at the current frame, keeping the
+   keyframes taken up to it */
+void movie_stop(Movie* movie, NES* nes);
+
+/* Keyframes go in a second file at the same path, with ".keys" appended */
+int movie_load(Movie* movie, const char* path);
+int movie_save(const Movie* movie, const char* path, const char* rom_name);
+void movie_free(Movie* movie);
+
+#endif
@@ -1,29 +1,84 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "cartridge.h"
+#include "crc32.h"
 #include "nes.h"
 
-void nes_init(NES* nes, NESInitInfo* init_info)
+#define STATE_MAGIC "PNST"
+#define STATE_VERSION 1
+#define STATE_ALIGN(x) (((x) + 7) & ~(size_t)7)
+
+/* Snapshot header. Devices are stored as they are, but with their pointers
+   cleared, since the instance loading a snapshot keeps its own. This ties
+   snapshots to builds with the same struct layout, which header_size
+   roughly checks. The header is followed by the cartridge memory, then any
+   samples still pending in the mix buffer */
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t header_size;
+	uint32_t cart_size;
+	uint32_t sample_count;  /* Native samples (not frames) */
+	CPU cpu;
+	PPU ppu;
+	APU apu;
+	Controller c1, c2;
+	uint8_t ram[RAMSIZE];
+	Scheduler sched;
+	uint8_t audio_only;
+	CartridgeState cart;
+} NESState;
+
+int nes_init(NES* nes, NESInitInfo* init_info)
 {
 	/* Initialize the system */
 	memset(nes, 0, sizeof(*nes));
 
+	nes->ram = init_info->ram ? init_info->ram : nes->own_ram;
 	memset(nes->ram, 0, RAMSIZE);
+	scheduler_init(&nes->sched);
 	cpu_init(&nes->cpu, nes);
-	ppu_init(&nes->ppu, nes, init_info);
-	apu_init(&nes->apu, nes, init_info);
 	controller_init(&nes->c1);
 	controller_init(&nes->c2);
+	nes->nvram_sync_frames = init_info->nvram_sync_frames ?
+							 init_info->nvram_sync_frames : NES_DEFAULT_NVRAM_SYNC_FRAMES;
+	nes->volatile_nvram = init_info->volatile_nvram;
+	nes->cart_db = init_info->cart_db;
+
+	if (ppu_init(&nes->ppu, nes, init_info) != 0)
+		return -1;
+	if (apu_init(&nes->apu, nes, init_info) != 0)
+	{
+		ppu_cleanup(&nes->ppu);
+		return -1;
+	}
+	return 0;
 }
 
-int nes_load_rom(NES* nes, char* path)
+static void power_on(NES* nes)
 {
-	if (cartridge_load(&nes->cartridge, path) != 0)
-		return -1;
+	nes->cartridge.nvram_sync_frames = nes->nvram_sync_frames;
+	cartridge_attach_ciram(&nes->cartridge, nes->ppu.vram);
 
 	/* Start system */
 	cpu_power(&nes->cpu);
+}
+
+int nes_load_rom(NES* nes, char* path)
+{
+	if (cartridge_load(&nes->cartridge, path, nes->cart_db, nes->volatile_nvram) != 0)
+		return -1;
+	power_on(nes);
+	return 0;
+}
+
+int nes_load_rom_memory(NES* nes, const void* image, size_t size)
+{
+	if (cartridge_load_memory(&nes->cartridge, image, size, nes->cart_db) != 0)
+		return -1;
+	power_on(nes);
 	return 0;
 }
 
@@ -33,9 +88,244 @@ void nes_unload_rom(NES* nes)
 	nes->cpu.is_running = 0;
 }
 
+static void copy_devices(NES* dst, const NES* src)
+{
+	/* Everything but the cartridge and the frame being drawn. dst keeps its
+	   own callbacks and output buffers */
+	RenderCallback render_cb = dst->ppu.render_cb;
+	void* render_userdata = dst->ppu.render_userdata;
+	uint32_t* framebuffer = dst->ppu.framebuffer;
+	uint8_t owns_framebuffer = dst->ppu.owns_framebuffer;
+	uint8_t* indexed_framebuffer = dst->ppu.indexed_framebuffer;
+
+	dst->cpu = src->cpu;
+	dst->cpu.nes = dst;
+	dst->ppu = src->ppu;
+	dst->ppu.nes = dst;
+	dst->ppu.render_cb = render_cb;
+	dst->ppu.render_userdata = render_userdata;
+	dst->ppu.framebuffer = framebuffer;
+	dst->ppu.owns_framebuffer = owns_framebuffer;
+	dst->ppu.indexed_framebuffer = indexed_framebuffer;
+	dst->c1 = src->c1;
+	dst->c2 = src->c2;
+	memcpy(dst->ram, src->ram, RAMSIZE);
+	dst->sched = src->sched;
+	dst->audio_only = src->audio_only;
+
+	/* Last, since it reposts its events relative to dst's output */
+	apu_copy_state(&dst->apu, &src->apu);
+}
+
+int nes_copy_state(NES* dst, const NES* src)
+{
+	/* Make dst, which must have the same ROM loaded, continue exactly where
+	   src is */
+	if (cartridge_copy_state(&dst->cartridge, &src->cartridge) != 0)
+		return -1;
+	copy_devices(dst, src);
+	if (dst->ppu.framebuffer && src->ppu.framebuffer && dst->ppu.framebuffer != src->ppu.framebuffer)
+		memcpy(dst->ppu.framebuffer, src->ppu.framebuffer, 256 * 240 * sizeof(uint32_t));
+	if (dst->ppu.indexed_framebuffer && src->ppu.indexed_framebuffer &&
+		dst->ppu.indexed_framebuffer != src->ppu.indexed_framebuffer)
+	{
+		memcpy(dst->ppu.indexed_framebuffer, src->ppu.indexed_framebuffer, 256 * 240);
+	}
+	return 0;
+}
+
+static int fork_from(NES* nes, const NES* parent, NESInitInfo* init_info)
+{
+	if (nes_init(nes, init_info) != 0)
+		return -1;
+	if (cartridge_fork(&nes->cartridge, &parent->cartridge) != 0)
+	{
+		nes_cleanup(nes);
+		return -1;
+	}
+	cartridge_attach_ciram(&nes->cartridge, nes->ppu.vram);
+	copy_devices(nes, parent);
+	return 0;
+}
+
+int nes_fork(NES* nes, const NES* parent)
+{
+	/* Start a new instance where the parent is, sharing its ROM, output
+	   configuration (including caller-owned buffers), and callbacks. The
+	   partially drawn frame isn't copied, so forking between frames (i.e.,
+	   after nes_run_frame) keeps the child's output exact */
+	NESInitInfo init_info;
+	memset(&init_info, 0, sizeof(init_info));
+	init_info.render_cb = parent->ppu.render_cb;
+	init_info.render_userdata = parent->ppu.render_userdata;
+	init_info.snd_cb = parent->apu.snd_cb;
+	init_info.snd_userdata = parent->apu.snd_userdata;
+	init_info.audio_spec = parent->apu.spec;
+	init_info.nvram_sync_frames = parent->nvram_sync_frames;
+	init_info.volatile_nvram = parent->volatile_nvram;
+	init_info.cart_db = parent->cart_db;
+	init_info.no_framebuffer = !parent->ppu.framebuffer;
+	if (!parent->ppu.owns_framebuffer)
+		init_info.framebuffer = parent->ppu.framebuffer;
+	init_info.indexed_framebuffer = parent->ppu.indexed_framebuffer;
+	init_info.no_audio = !parent->apu.mix_buf;
+	if (parent->apu.mix_buf && !parent->apu.sample_buf1)
+		init_info.audio_buffer = parent->apu.current_read_buf;
+	return fork_from(nes, parent, &init_info);
+}
+
+int nes_fork_detached(NES* nes, const NES* parent)
+{
+	/* Nothing is shared with the parent but its ROM, so the fork can run on
+	   another thread */
+	NESInitInfo init_info;
+	memset(&init_info, 0, sizeof(init_info));
+	init_info.audio_spec = parent->apu.spec;
+	init_info.volatile_nvram = parent->volatile_nvram;
+	init_info.cart_db = parent->cart_db;
+	init_info.no_framebuffer = 1;
+	init_info.no_audio = 1;
+	return fork_from(nes, parent, &init_info);
+}
+
+static uint32_t pending_samples(const APU* apu)
+{
+	return apu->mix_buf ? apu->sample_buf_insert_pos * apu->spec.channels : 0;
+}
+
+size_t nes_state_size(const NES* nes)
+{
+	/* Only valid until the NES runs again, since pending samples vary */
+	return sizeof(NESState) + STATE_ALIGN(cartridge_state_size(&nes->cartridge)) +
+		   pending_samples(&nes->apu) * sizeof(uint16_t);
+}
+
+static void fill_state(const NES* nes, NESState* state, uint8_t* cart_mem)
+{
+	/* Zeroed first so that identical states are byte for byte identical */
+	memset(state, 0, sizeof(NESState));
+	memcpy(state->magic, STATE_MAGIC, 4);
+	state->version = STATE_VERSION;
+	state->header_size = sizeof(NESState);
+	state->cart_size = (uint32_t)cartridge_state_size(&nes->cartridge);
+	state->sample_count = pending_samples(&nes->apu);
+	state->cpu = nes->cpu;
+	state->cpu.nes = NULL;
+	state->ppu = nes->ppu;
+	state->ppu.nes = NULL;
+	state->ppu.render_cb = NULL;
+	state->ppu.render_userdata = NULL;
+	state->ppu.framebuffer = NULL;
+	state->ppu.owns_framebuffer = 0;
+	state->ppu.indexed_framebuffer = NULL;
+	state->apu = nes->apu;
+	state->apu.nes = NULL;
+	state->apu.snd_cb = NULL;
+	state->apu.snd_userdata = NULL;
+	state->apu.mix_buf = NULL;
+	state->apu.sample_buf1 = state->apu.sample_buf2 = NULL;
+	state->apu.current_read_buf = state->apu.current_write_buf = NULL;
+	state->apu.recorder = state->apu.stem_recorder = NULL;
+	state->apu.stem_buf = NULL;
+	state->c1 = nes->c1;
+	state->c2 = nes->c2;
+	memcpy(state->ram, nes->ram, RAMSIZE);
+	state->sched = nes->sched;
+	state->audio_only = nes->audio_only;
+	cartridge_save_state(&nes->cartridge, &state->cart, cart_mem);
+}
+
+int nes_save_state(const NES* nes, void* buf, size_t size)
+{
+	uint8_t* data = (uint8_t*)buf;
+	NESState state;
+	size_t cart_size = cartridge_state_size(&nes->cartridge);
+
+	if (size < nes_state_size(nes))
+	{
+		fprintf(stderr, "Error: state buffer is too small\n");
+		return -1;
+	}
+
+	fill_state(nes, &state, data + sizeof(NESState));
+	memcpy(data, &state, sizeof(NESState));
+	data += sizeof(NESState);
+	memset(data + cart_size, 0, STATE_ALIGN(cart_size) - cart_size);
+	data += STATE_ALIGN(cart_size);
+	if (state.sample_count)
+		memcpy(data, nes->apu.mix_buf, state.sample_count * sizeof(uint16_t));
+	return 0;
+}
+
+uint32_t nes_state_hash(NES* nes)
+{
+	/* The emulated machine only, leaving out how its output is produced
+	   (the audio format and filter, buffering, and the events that hand
+	   samples off). Instances with different outputs that run the same
+	   input hash the same at the same point. The APU is brought up to date
+	   first, since how far it lags behind depends on the output too */
+	NESState state;
+	apu_sync(&nes->apu);
+	fill_state(nes, &state, NULL);
+	state.sample_count = 0;
+	memset(&state.apu.spec, 0, sizeof(state.apu.spec));
+	memset(&state.apu.filter, 0, sizeof(state.apu.filter));
+	memset(state.apu.pan_gain, 0, sizeof(state.apu.pan_gain));
+	state.apu.sample_period = state.apu.sample_period_frac = 0;
+	state.apu.sample_frac_acc = state.apu.sample_countdown = 0;
+	state.apu.sample_buf_size = state.apu.sample_buf_insert_pos = 0;
+	state.sched.next = 0;
+	state.sched.events[EVENT_APU_BUFFER] = 0;
+	return cartridge_state_crc(&nes->cartridge, crc32_update(0, (const uint8_t*)&state, sizeof(NESState)));
+}
+
+int nes_load_state(NES* nes, const void* buf, size_t size)
+{
+	/* Continue exactly where the snapshot was taken. The NES must have the
+	   same ROM loaded, and keeps its own callbacks and output buffers */
+	const uint8_t* data = (const uint8_t*)buf;
+	NESState state;
+	NES src;
+	size_t samples_ofs;
+
+	if (size < sizeof(NESState))
+	{
+		fprintf(stderr, "Error: invalid state\n");
+		return -1;
+	}
+	memcpy(&state, data, sizeof(NESState));
+	samples_ofs = sizeof(NESState) + STATE_ALIGN(state.cart_size);
+	if (memcmp(state.magic, STATE_MAGIC, 4) != 0 || state.version != STATE_VERSION ||
+		state.header_size != sizeof(NESState) || state.cart_size != cartridge_state_size(&nes->cartridge) ||
+		(state.sample_count && state.sample_count != state.apu.sample_buf_insert_pos * state.apu.spec.channels) ||
+		size < samples_ofs + state.sample_count * sizeof(uint16_t))
+	{
+		fprintf(stderr, "Error: state is invalid or incompatible\n");
+		return -1;
+	}
+	if (cartridge_load_state(&nes->cartridge, &state.cart, data + sizeof(NESState)) != 0)
+		return -1;
+
+	/* Pending samples are only picked up if the output format matches */
+	src.cpu = state.cpu;
+	src.ppu = state.ppu;
+	src.apu = state.apu;
+	src.apu.mix_buf = (uint16_t*)(data + samples_ofs);
+	if (!state.sample_count)
+		src.apu.sample_buf_insert_pos = 0;
+	src.c1 = state.c1;
+	src.c2 = state.c2;
+	src.ram = state.ram;
+	src.sched = state.sched;
+	src.audio_only = state.audio_only;
+	copy_devices(nes, &src);
+	return 0;
+}
+
 void nes_cleanup(NES* nes)
 {
 	apu_cleanup(&nes->apu);
+	ppu_cleanup(&nes->ppu);
 }
 
 int nes_update(NES* nes)
@@ -55,3 +345,32 @@ int nes_update(NES* nes)
 	controller_update(&nes->c2);
 	return cycles;
 }
+
+int nes_run_frame(NES* nes)
+{
+	/* Run until the PPU outputs a frame. Returns the number of cycles run.
+	   Audio-only playback never outputs frames, so nothing is run */
+	uint32_t frame = nes->ppu.frames;
+	int cycles = 0;
+	while (nes->ppu.frames == frame && nes->cpu.is_running && !nes->audio_only)
+		cycles += nes_update(nes);
+	return cycles;
+}
+
+void nes_run_events(NES* nes)
+{
+	/* Bring each device with a due event up to date. Syncing posts the
+	   device's next events, which moves the horizon forward */
+	Scheduler* sched = &nes->sched;
+	if (scheduler_due(sched, EVENT_APU_FRAME) || scheduler_due(sched, EVENT_APU_DMC) ||
+		scheduler_due(sched, EVENT_APU_BUFFER))
+	{
+		apu_sync(&nes->apu);
+	}
+}
+
+void nes_set_latch_callback(NES* nes, LatchCallback cb, void* userdata)
+{
+	nes->latch_cb = cb;
+	nes->latch_userdata = userdata;
+}
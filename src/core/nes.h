@@ -1,21 +1,44 @@
 #ifndef NES_H
 #define NES_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "apu.h"
+#include "cartdb.h"
 #include "cartridge.h"
 #include "controller.h"
 #include "cpu.h"
 #include "ppu.h"
+#include "scheduler.h"
 
 #define RAMSIZE 0x800
+#define NES_DEFAULT_NVRAM_SYNC_FRAMES 60
+
+struct NES;
+
+/* Called when the game strobes the controllers, right before they latch
+   their buttons. Input set here is exactly what the game reads */
+typedef void (*LatchCallback)(struct NES* nes, void* userdata);
 
 typedef struct NESInitInfo {
 	RenderCallback render_cb;
 	SoundCallback snd_cb;
 	void* render_userdata;
 	void* snd_userdata;
+	AudioSpec audio_spec;
+	uint32_t nvram_sync_frames;  /* Save file write-back interval (0 for default) */
+	const CartridgeDB* cart_db;  /* Optional header overrides. Must outlive the NES */
+	uint8_t volatile_nvram;  /* Keep battery-backed RAM in memory only (no save file) */
+
+	/* Compact instances. Caller-owned buffers must outlive the NES, and may
+	   be shared by instances that run on the same thread */
+	uint32_t* framebuffer;   /* 256x240 frame to draw into (NULL to allocate one) */
+	uint8_t no_framebuffer;  /* No RGBA frame. render_cb still marks each frame, with NULL */
+	uint8_t* indexed_framebuffer;  /* 256x240 NES color indices to draw into as well (optional) */
+	uint8_t* ram;            /* 2KB block to keep system RAM in (NULL for the NES's own) */
+	void* audio_buffer;      /* Block handed to snd_cb: buffer_size frames of the spec's format */
+	uint8_t no_audio;        /* Don't produce samples at all */
 } NESInitInfo;
 
 typedef struct NES {
@@ -24,14 +47,37 @@ typedef struct NES {
 	APU apu;
 	Controller c1;
 	Controller c2;
-	uint8_t ram[RAMSIZE];	
+	uint8_t* ram;  /* own_ram, or a caller-owned block */
+	uint8_t own_ram[RAMSIZE];
 	Cartridge cartridge;
+	Scheduler sched;
+	uint8_t audio_only;  /* Skip PPU emulation entirely (e.g., NSF playback) */
+	uint32_t nvram_sync_frames;
+	uint8_t volatile_nvram;
+	const CartridgeDB* cart_db;
+	LatchCallback latch_cb;
+	void* latch_userdata;
 } NES;
 
-void nes_init(NES* nes, NESInitInfo* init_info);
+int nes_init(NES* nes, NESInitInfo* init_info);
 void nes_cleanup(NES* nes);
 int nes_load_rom(NES* nes, char* path);
 void nes_unload_rom(NES* nes);
+int nes_load_rom_memory(NES* nes, const void* image, size_t size);
+int nes_copy_state(NES* dst, const NES* src);
+
+/* Snapshots of the machine, for save states. They can only be loaded by an
+   instance with the same ROM, from the same build. The frame being drawn
+   isn't included, so take them between frames */
+size_t nes_state_size(const NES* nes);
+int nes_save_state(const NES* nes, void* buf, size_t size);
+int nes_load_state(NES* nes, const void* buf, size_t size);
+uint32_t nes_state_hash(NES* nes);  /* Independent of the output configuration */
+int nes_fork(NES* nes, const NES* parent);
+int nes_fork_detached(NES* nes, const NES* parent);  /* Without any output (callbacks, frames, or samples) */
 int nes_update(NES* nes);
+int nes_run_frame(NES* nes);
+void nes_run_events(NES* nes);
+void nes_set_latch_callback(NES* nes, LatchCallback cb, void* userdata);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,378 @@
+/* Rollback netplay over UDP. Every packet carries all of the local input the
+   peer hasn't acknowledged yet, so a lost packet costs nothing once a later
+   one arrives. Packets also carry the latest checkpoint (the state hash of
+   a frame whose input is final on both sides), which the peers compare to
+   detect desyncs */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "cartridge.h"
+#include "netplay.h"
+
+#define PACKET_MAGIC0 'P'
+#define PACKET_MAGIC1 'N'
+#define PACKET_VERSION 1
+#define PACKET_HEADER_SIZE 24
+#define PACKET_MAX_INPUTS 64
+
+static void put_le32(uint8_t* buf, uint32_t val)
+{
+	buf[0] = val & 0xFF;
+	buf[1] = (val >> 8) & 0xFF;
+	buf[2] = (val >> 16) & 0xFF;
+	buf[3] = val >> 24;
+}
+
+static uint32_t get_le32(const uint8_t* buf)
+{
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static uint32_t next_rand(Netplay* np)
+{
+	/* Its own generator, so simulated loss is repeatable */
+	np->sim_rand = np->sim_rand * 1103515245 + 12345;
+	return (np->sim_rand >> 16) & 0x7FFF;
+}
+
+static void on_latch(NES* nes, void* userdata)
+{
+	Netplay* np = (Netplay*)userdata;
+	controller_set_buttons(&nes->c1, np->current[0]);
+	controller_set_buttons(&nes->c2, np->current[1]);
+}
+
+static void add_check(NetplayCheck* checks, uint32_t frame, uint32_t hash)
+{
+	NetplayCheck* check = &checks[(frame / NETPLAY_CHECK_INTERVAL) % NETPLAY_CHECKS];
+	check->frame = frame;
+	check->hash = hash;
+}
+
+static const NetplayCheck* find_check(const NetplayCheck* checks, uint32_t frame)
+{
+	const NetplayCheck* check = &checks[(frame / NETPLAY_CHECK_INTERVAL) % NETPLAY_CHECKS];
+	return check->frame == frame ? check : NULL;
+}
+
+static void compare_check(Netplay* np, uint32_t frame, uint32_t own, uint32_t peer)
+{
+	++np->stats.checks;
+	if (own != peer && np->stats.desyncs++ == 0)
+	{
+		np->stats.first_desync = frame;
+		fprintf(stderr, "Error: netplay desync at frame %u\n", frame);
+	}
+}
+
+int netplay_init(Netplay* np, NES* nes, const NetplayInfo* info)
+{
+	struct sockaddr_in addr;
+	uint32_t i;
+
+	memset(np, 0, sizeof(Netplay));
+	np->socket = -1;
+	np->nes = nes;
+	np->player = info->player & 1;
+	np->input_delay = info->input_delay < NETPLAY_MAX_DELAY ? info->input_delay : NETPLAY_MAX_DELAY;
+	np->rom_crc = cartridge_crc(&nes->cartridge);
+	np->local_end = np->input_delay;  /* Frames before the delay has passed have no input */
+	np->last_peer_check = UINT32_MAX;
+	np->sim_latency = info->sim_latency;
+	np->sim_loss = info->sim_loss;
+	np->sim_rand = info->sim_seed;
+	for (i = 0; i < NETPLAY_CHECKS; ++i)
+		np->own_checks[i].frame = np->peer_checks[i].frame = UINT32_MAX;
+
+	/* Room for a state plus a frame's worth of pending samples */
+	np->state_capacity = nes_state_size(nes) + 4096;
+	for (i = 0; i < NETPLAY_STATE_SLOTS; ++i)
+	{
+		if (!(np->states[i] = (uint8_t*)malloc(np->state_capacity)))
+		{
+			fprintf(stderr, "Error: unable to allocate netplay states (code %d)\n", errno);
+			netplay_cleanup(np);
+			return -1;
+		}
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(info->local_port);
+	if ((np->socket = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ||
+		fcntl(np->socket, F_SETFL, fcntl(np->socket, F_GETFL) | O_NONBLOCK) != 0 ||
+		bind(np->socket, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		fprintf(stderr, "Error: unable to open netplay socket (code %d)\n", errno);
+		netplay_cleanup(np);
+		return -1;
+	}
+	nes_set_latch_callback(nes, on_latch, np);
+	return 0;
+}
+
+int netplay_connect(Netplay* np, const char* host, uint16_t port)
+{
+	memset(&np->peer, 0, sizeof(np->peer));
+	np->peer.sin_family = AF_INET;
+	np->peer.sin_port = htons(port);
+	if (inet_pton(AF_INET, host, &np->peer.sin_addr) != 1)
+	{
+		fprintf(stderr, "Error: invalid netplay peer address \"%s\"\n", host);
+		return -1;
+	}
+	np->connected = 1;
+	return 0;
+}
+
+uint16_t netplay_local_port(const Netplay* np)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	if (getsockname(np->socket, (struct sockaddr*)&addr, &len) != 0)
+		return 0;
+	return ntohs(addr.sin_port);
+}
+
+void netplay_cleanup(Netplay* np)
+{
+	uint32_t i;
+	if (np->socket >= 0)
+		close(np->socket);
+	for (i = 0; i < NETPLAY_STATE_SLOTS; ++i)
+		free(np->states[i]);
+	if (np->nes && np->nes->latch_userdata == np)
+		nes_set_latch_callback(np->nes, NULL, NULL);
+	np->socket = -1;
+	memset(np->states, 0, sizeof(np->states));
+}
+
+uint32_t netplay_confirmed_frame(const Netplay* np)
+{
+	return np->remote_end < np->frame ? np->remote_end : np->frame;
+}
+
+static uint8_t predict(const Netplay* np, uint32_t frame)
+{
+	/* Players mostly keep holding what they were */
+	if (frame < np->remote_end)
+		return np->remote[frame % NETPLAY_RING];
+	return np->remote_end ? np->remote[(np->remote_end - 1) % NETPLAY_RING] : 0;
+}
+
+static int run_frame(Netplay* np, uint32_t frame)
+{
+	/* Saves the frame's starting state first, so it can be run again */
+	uint32_t slot = frame % NETPLAY_STATE_SLOTS;
+	size_t size;
+
+	if (frame % NETPLAY_CHECK_INTERVAL == 0)
+		np->state_hashes[slot] = nes_state_hash(np->nes);
+	size = nes_state_size(np->nes);
+	if (size > np->state_capacity)
+	{
+		uint32_t i;
+		for (i = 0; i < NETPLAY_STATE_SLOTS; ++i)
+		{
+			uint8_t* state = (uint8_t*)realloc(np->states[i], size);
+			if (!state)
+			{
+				fprintf(stderr, "Error: unable to allocate netplay states (code %d)\n", errno);
+				return -1;
+			}
+			np->states[i] = state;
+		}
+		np->state_capacity = size;
+	}
+	nes_save_state(np->nes, np->states[slot], size);
+	np->state_sizes[slot] = size;
+
+	np->used_remote[frame % NETPLAY_RING] = predict(np, frame);
+	np->current[np->player] = np->local[frame % NETPLAY_RING];
+	np->current[np->player ^ 1] = np->used_remote[frame % NETPLAY_RING];
+	nes_run_frame(np->nes);
+	return 0;
+}
+
+static int roll_back(Netplay* np)
+{
+	uint32_t slot = np->rollback_to % NETPLAY_STATE_SLOTS, count = np->frame - np->rollback_to, f;
+	if (nes_load_state(np->nes, np->states[slot], np->state_sizes[slot]) != 0)
+		return -1;
+	for (f = np->rollback_to; f < np->frame; ++f)
+	{
+		if (run_frame(np, f) != 0)
+			return -1;
+	}
+
+	++np->stats.rollbacks;
+	np->stats.resimulated += count;
+	if (count > np->stats.max_rollback)
+		np->stats.max_rollback = count;
+	np->rollback_to = np->frame;
+	return 0;
+}
+
+static void update_checks(Netplay* np)
+{
+	/* A frame's starting state is final once every earlier frame has been
+	   run with real input */
+	const NetplayCheck* peer;
+	uint32_t frame = np->next_check;
+	if (frame >= np->frame || frame > np->remote_end)
+		return;
+	add_check(np->own_checks, frame, np->state_hashes[frame % NETPLAY_STATE_SLOTS]);
+	if ((peer = find_check(np->peer_checks, frame)))
+		compare_check(np, frame, np->state_hashes[frame % NETPLAY_STATE_SLOTS], peer->hash);
+	np->next_check += NETPLAY_CHECK_INTERVAL;
+}
+
+static void receive_packet(Netplay* np, const uint8_t* data, size_t size)
+{
+	uint32_t start, ack, check_frame, check_hash, count, f;
+	const NetplayCheck* own;
+
+	if (size < PACKET_HEADER_SIZE || data[0] != PACKET_MAGIC0 || data[1] != PACKET_MAGIC1 ||
+		data[2] != PACKET_VERSION || size != PACKET_HEADER_SIZE + (size_t)data[3])
+	{
+		return;
+	}
+	if (get_le32(data + 4) != np->rom_crc)
+	{
+		fprintf(stderr, "Error: netplay peer is running a different ROM\n");
+		return;
+	}
+	count = data[3];
+	start = get_le32(data + 8);
+	ack = get_le32(data + 12);
+	check_frame = get_le32(data + 16);
+	check_hash = get_le32(data + 20);
+	++np->stats.received;
+
+	if (ack > np->peer_ack && ack <= np->local_end)
+		np->peer_ack = ack;
+
+	/* Only input that continues what we have is taken. Anything past a gap
+	   is sent again */
+	for (f = np->remote_end; f >= start && f < start + count; ++f)
+	{
+		uint8_t input = data[PACKET_HEADER_SIZE + (f - start)];
+		np->remote[f % NETPLAY_RING] = input;
+		if (f < np->frame && input != np->used_remote[f % NETPLAY_RING] && f < np->rollback_to)
+			np->rollback_to = f;
+		np->remote_end = f + 1;
+	}
+
+	if (check_frame != UINT32_MAX && (np->last_peer_check == UINT32_MAX || check_frame > np->last_peer_check))
+	{
+		np->last_peer_check = check_frame;
+		if ((own = find_check(np->own_checks, check_frame)))
+			compare_check(np, check_frame, own->hash, check_hash);
+		else
+			add_check(np->peer_checks, check_frame, check_hash);
+	}
+}
+
+static void receive(Netplay* np)
+{
+	uint8_t data[PACKET_HEADER_SIZE + PACKET_MAX_INPUTS];
+	struct sockaddr_in from;
+	socklen_t len = sizeof(from);
+	ssize_t size;
+	while ((size = recvfrom(np->socket, data, sizeof(data), 0, (struct sockaddr*)&from, &len)) >= 0)
+	{
+		if (np->connected && from.sin_addr.s_addr == np->peer.sin_addr.s_addr && from.sin_port == np->peer.sin_port)
+			receive_packet(np, data, (size_t)size);
+		len = sizeof(from);
+	}
+}
+
+static void flush_queue(Netplay* np)
+{
+	while (np->queue_count && np->queue[np->queue_head].due <= np->tick)
+	{
+		NetplayPacket* packet = &np->queue[np->queue_head];
+		sendto(np->socket, packet->data, packet->size, 0, (struct sockaddr*)&np->peer, sizeof(np->peer));
+		np->queue_head = (np->queue_head + 1) % NETPLAY_QUEUE;
+		--np->queue_count;
+	}
+}
+
+static void send_input(Netplay* np)
+{
+	/* Everything the peer hasn't acknowledged, oldest first */
+	NetplayPacket* packet;
+	const NetplayCheck* check;
+	uint32_t count = np->local_end - np->peer_ack, f;
+
+	if (!np->connected)
+		return;
+	if (count > PACKET_MAX_INPUTS)
+		count = PACKET_MAX_INPUTS;
+	++np->stats.sent;
+	if (np->sim_loss && next_rand(np) % 100 < np->sim_loss)
+	{
+		++np->stats.dropped;
+		return;
+	}
+	if (np->queue_count == NETPLAY_QUEUE)
+	{
+		++np->stats.dropped;
+		return;
+	}
+
+	packet = &np->queue[(np->queue_head + np->queue_count++) % NETPLAY_QUEUE];
+	packet->due = np->tick + np->sim_latency;
+	packet->size = (uint16_t)(PACKET_HEADER_SIZE + count);
+	packet->data[0] = PACKET_MAGIC0;
+	packet->data[1] = PACKET_MAGIC1;
+	packet->data[2] = PACKET_VERSION;
+	packet->data[3] = (uint8_t)count;
+	put_le32(packet->data + 4, np->rom_crc);
+	put_le32(packet->data + 8, np->peer_ack);
+	put_le32(packet->data + 12, np->remote_end);
+	check = np->next_check >= NETPLAY_CHECK_INTERVAL ?
+			find_check(np->own_checks, np->next_check - NETPLAY_CHECK_INTERVAL) : NULL;
+	put_le32(packet->data + 16, check ? check->frame : UINT32_MAX);
+	put_le32(packet->data + 20, check ? check->hash : 0);
+	for (f = 0; f < count; ++f)
+		packet->data[PACKET_HEADER_SIZE + f] = np->local[(np->peer_ack + f) % NETPLAY_RING];
+	flush_queue(np);
+}
+
+int netplay_tick(Netplay* np, uint8_t buttons)
+{
+	int ret = 0;
+	++np->tick;
+	flush_queue(np);
+	receive(np);
+
+	if (np->rollback_to < np->frame && roll_back(np) != 0)
+		return -1;
+
+	/* Past the rollback window, the peer has to catch up first */
+	if (np->frame >= np->remote_end + NETPLAY_MAX_ROLLBACK)
+		++np->stats.stalls;
+	else
+	{
+		np->local[np->local_end % NETPLAY_RING] = buttons;
+		++np->local_end;
+		if (run_frame(np, np->frame) != 0)
+			return -1;
+		++np->frame;
+		np->rollback_to = np->frame;
+		ret = 1;
+	}
+
+	update_checks(np);
+	send_input(np);
+	return ret;
+}
@@ -0,0 +1,113 @@
+#ifndef NETPLAY_H
+#define NETPLAY_H
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nes.h"
+
+#define NETPLAY_MAX_ROLLBACK 8  /* Frames run ahead of the peer's input */
+#define NETPLAY_MAX_DELAY 4
+#define NETPLAY_CHECK_INTERVAL 60  /* Frames between desync checks */
+#define NETPLAY_RING 64  /* Power of 2, and enough for every unacknowledged input */
+#define NETPLAY_STATE_SLOTS (NETPLAY_MAX_ROLLBACK + 1)
+#define NETPLAY_CHECKS 8
+#define NETPLAY_QUEUE 256
+
+typedef struct {
+	uint16_t local_port;   /* UDP port to listen on (0 for any) */
+	uint8_t player;        /* Controller the local player uses (0 or 1) */
+	uint8_t input_delay;   /* Frames local input is held back, trading lag for rollbacks */
+
+	/* Simulated network conditions for outgoing packets, for testing */
+	uint32_t sim_latency;  /* In frames (about 17ms each) */
+	uint8_t sim_loss;      /* Percentage of packets dropped */
+	uint32_t sim_seed;
+} NetplayInfo;
+
+typedef struct {
+	uint32_t rollbacks;     /* Mispredictions corrected */
+	uint32_t max_rollback;  /* Most frames re-simulated at once */
+	uint64_t resimulated;   /* Frames re-simulated in total */
+	uint32_t stalls;        /* Ticks spent waiting for the peer's input */
+	uint32_t checks;        /* Checkpoints compared with the peer */
+	uint32_t desyncs;       /* Checkpoints that didn't match */
+	uint32_t first_desync;  /* Frame of the first one */
+	uint32_t sent, received, dropped;  /* Packets (dropped by the simulation) */
+} NetplayStats;
+
+typedef struct {
+	uint32_t frame;  /* UINT32_MAX if unused */
+	uint32_t hash;   /* See nes_state_hash */
+} NetplayCheck;
+
+typedef struct {
+	uint32_t due;  /* Tick it is sent at */
+	uint16_t size;
+	uint8_t data[128];
+} NetplayPacket;
+
+/* Two-player session with rollback. Remote input that hasn't arrived is
+   predicted to be whatever was last received, and each frame's starting
+   state is kept. When the real input turns out different, the NES goes back
+   to the state of the first mispredicted frame and runs the frames since
+   again, all within a single tick. Input is applied when the game latches
+   the controllers, like movies, so both peers run exactly the same frames */
+typedef struct {
+	NES* nes;
+	int socket;
+	struct sockaddr_in peer;
+	uint8_t connected;
+	uint8_t player;
+	uint8_t input_delay;
+	uint32_t rom_crc;
+	uint8_t current[2];  /* Input of the frame being run */
+
+	uint32_t frame;         /* Next frame to run */
+	uint32_t local_end;     /* Local input is known before this frame */
+	uint32_t remote_end;    /* Remote input is known before this frame */
+	uint32_t peer_ack;      /* The peer has our input before this frame */
+	uint32_t rollback_to;   /* First mispredicted frame (frame if none) */
+	uint8_t local[NETPLAY_RING];
+	uint8_t remote[NETPLAY_RING];
+	uint8_t used_remote[NETPLAY_RING];  /* Remote input each frame was run with */
+
+	uint8_t* states[NETPLAY_STATE_SLOTS];  /* Starting state of each recent frame */
+	size_t state_sizes[NETPLAY_STATE_SLOTS];
+	size_t state_capacity;
+	uint32_t state_hashes[NETPLAY_STATE_SLOTS];  /* Checkpoint frames only */
+
+	NetplayCheck own_checks[NETPLAY_CHECKS];
+	NetplayCheck peer_checks[NETPLAY_CHECKS];
+	uint32_t next_check;       /* Next frame to checkpoint */
+	uint32_t last_peer_check;  /* Frame of the last checkpoint received (UINT32_MAX if none) */
+
+	uint32_t tick;
+	uint32_t sim_latency;
+	uint8_t sim_loss;
+	uint32_t sim_rand;
+	NetplayPacket queue[NETPLAY_QUEUE];  /* Held back by the simulated latency */
+	uint32_t queue_head, queue_count;
+
+	NetplayStats stats;
+} Netplay;
+
+/* Starts a session on an NES that just loaded its ROM, with volatile
+   battery RAM. Both peers must start from the same state (e.g., power-on).
+   Takes over the NES's latch callback */
+int netplay_init(Netplay* np, NES* nes, const NetplayInfo* info);
+int netplay_connect(Netplay* np, const char* host, uint16_t port);  /* IPv4 address */
+uint16_t netplay_local_port(const Netplay* np);
+void netplay_cleanup(Netplay* np);
+
+/* Call once per frame (i.e., every 1/60s). Runs the next frame with the
+   local player's buttons (ControllerButton flags), after correcting any
+   mispredicted ones. Returns 1 if a frame was run, 0 if the session is
+   waiting for the peer, and -1 on error */
+int netplay_tick(Netplay* np, uint8_t buttons);
+
+/* Every frame before this one was run with the peer's real input */
+uint32_t netplay_confirmed_frame(const Netplay* np);
+
+#endif
@@ -0,0 +1,293 @@
+/* NSF (NES Sound Format) loader and audio-only player.
+   Runs the CPU and APU only. The PPU is never clocked; instead, the player
+   calls the tune's PLAY routine at the frame rate, just as the NMI handler of
+   a hardware NSF player would */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "nsf.h"
+
+#define NSF_HEADER_SIZE 0x80
+
+/* The player "returns" here after INIT and PLAY. Nothing is mapped at this
+   address, so no tune can legitimately execute code from it */
+#define NSF_RETURN_ADDR 0x4100
+
+#define NSF_DEFAULT_NTSC_SPEED 16639  /* Microseconds between PLAY calls */
+#define NSF_DEFAULT_PAL_SPEED 19997
+
+extern const MapperInfo nsf_mapper_info;
+
+static uint16_t read16(uint8_t* buf)
+{
+	return buf[0] | (buf[1] << 8);
+}
+
+static void read_string(char* dst, uint8_t* src)
+{
+	memcpy(dst, src, 32);
+	dst[32] = '\0';
+}
+
+/* NSF header format:
+	0-4: "NESM"<EOF>
+	  5: Version number
+	  6: Total songs
+	  7: Starting song (1-based)
+	8-9: Load address ($8000-$FFFF)
+  10-11: Init address
+  12-13: Play address
+  14-45: Song name
+  46-77: Artist
+ 78-109: Copyright holder
+110-111: Play speed in microseconds (NTSC)
+112-119: Initial bankswitch values (all 0 if not bankswitched)
+120-121: Play speed in microseconds (PAL)
+    122: PAL/NTSC bits
+		  0: 0=NTSC, 1=PAL
+		  1: Dual PAL/NTSC tune
+    123: Extra sound chip support
+124-127: Reserved (NSF2 fields) */
+static int parse_header(NSF* nsf, uint8_t* header)
+{
+	uint8_t i;
+	uint16_t speed;
+
+	if (memcmp(header, "NESM\x1A", 5) != 0)
+	{
+		fprintf(stderr, "Error: invalid NSF file\n");
+		return -1;
+	}
+
+	nsf->version = header[5];
+	nsf->total_songs = header[6];
+	nsf->starting_song = header[7] ? header[7] - 1 : 0;
+	nsf->load_addr = read16(&header[8]);
+	nsf->init_addr = read16(&header[10]);
+	nsf->play_addr = read16(&header[12]);
+	read_string(nsf->name, &header[14]);
+	read_string(nsf->artist, &header[46]);
+	read_string(nsf->copyright, &header[78]);
+
+	nsf->bankswitched = 0;
+	for (i = 0; i < 8; ++i)
+	{
+		nsf->bank_init[i] = header[112 + i];
+		nsf->bankswitched |= (header[112 + i] != 0);
+	}
+
+	/* Dual-standard tunes are played as NTSC */
+	nsf->video_mode = ((header[122] & 3) == 1) ? VIDEO_PAL : VIDEO_NTSC;
+	nsf->extra_chips = header[123];
+	if (nsf->extra_chips)
+		fprintf(stderr, "Warning: NSF expansion audio is not supported\n");
+
+	if (nsf->load_addr < 0x8000 || nsf->total_songs == 0)
+	{
+		fprintf(stderr, "Error: unsupported NSF layout\n");
+		return -1;
+	}
+
+	/* Convert the PLAY rate to CPU cycles (24.8 fixed point) */
+	if (nsf->video_mode == VIDEO_PAL)
+	{
+		speed = read16(&header[120]);
+		nsf->play_period = (int32_t)(((uint64_t)(speed ? speed : NSF_DEFAULT_PAL_SPEED) *
+									  CPU_CLOCK_PAL * 256) / 1000000);
+	}
+	else
+	{
+		speed = read16(&header[110]);
+		nsf->play_period = (int32_t)(((uint64_t)(speed ? speed : NSF_DEFAULT_NTSC_SPEED) *
+									  CPU_CLOCK_NTSC * 256) / 1000000);
+	}
+	return 0;
+}
+
+static int load_cartridge(NSF* nsf, uint8_t* data, uint32_t data_size)
+{
+	Cartridge* cart = &nsf->nes->cartridge;
+	void* mapper_data;
+	uint32_t ofs;
+	memset(cart, 0, sizeof(Cartridge));
+
+	/* Bankswitched tunes are padded so that the load address lands at the
+	   correct offset within a 4KB bank. Others are placed in a flat 32KB image */
+	if (nsf->bankswitched)
+	{
+		ofs = nsf->load_addr & 0xFFF;
+		cart->prg_rom.size = (ofs + data_size + 0xFFF) & ~0xFFF;
+	}
+	else
+	{
+		ofs = nsf->load_addr - 0x8000;
+		cart->prg_rom.size = 0x8000;
+		if (data_size > cart->prg_rom.size - ofs)
+			data_size = cart->prg_rom.size - ofs;
+	}
+	cart->prg_ram.size = 0x2000;
+	cart->chr.size = 0x2000;
+	cart->chr_is_ram = 1;
+	cart->mirror_mode = MIRRORING_VERTICAL;
+	cart->video_mode = nsf->video_mode;
+
+	if (cartridge_alloc(cart, &nsf_mapper_info, &mapper_data) != 0)
+		return -1;
+	memcpy(cart->prg_rom.data + ofs, data, data_size);
+
+	if (mapper_init(&cart->mapper, (struct Cartridge*)cart, &nsf_mapper_info, mapper_data) != 0)
+	{
+		fprintf(stderr, "Error: unable to initialize NSF mapper\n");
+		cartridge_unload(cart);
+		return -1;
+	}
+	return 0;
+}
+
+int nsf_load(NSF* nsf, NES* nes, char* path)
+{
+	FILE* file;
+	uint8_t* buf;
+	long file_size;
+	int ret;
+	memset(nsf, 0, sizeof(NSF));
+	nsf->nes = nes;
+
+	if (!(file = fopen(path, "rb")))
+	{
+		fprintf(stderr, "Error: unable to open NSF file (code %d)\n", errno);
+		return -1;
+	}
+	if (fseek(file, 0, SEEK_END) != 0 || (file_size = ftell(file)) <= NSF_HEADER_SIZE)
+	{
+		fprintf(stderr, "Error: input file too small\n");
+		fclose(file);
+		return -1;
+	}
+	if (!(buf = (uint8_t*)malloc(file_size)))
+	{
+		fprintf(stderr, "Error: unable to allocate memory for NSF file (code %d)\n", errno);
+		fclose(file);
+		return -1;
+	}
+	if (fseek(file, 0, SEEK_SET) != 0 || fread(buf, 1, file_size, file) != (size_t)file_size)
+	{
+		fprintf(stderr, "Error: unable to read NSF file (code %d)\n", errno);
+		free(buf);
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+
+	ret = parse_header(nsf, buf);
+	if (ret == 0)
+		ret = load_cartridge(nsf, buf + NSF_HEADER_SIZE, file_size - NSF_HEADER_SIZE);
+	free(buf);
+	if (ret != 0)
+		return -1;
+	cartridge_attach_ciram(&nes->cartridge, nes->ppu.vram);
+
+	/* PAL tunes run on the slower PAL clock (see render_nsf) */
+	nes->audio_only = 1;
+	apu_set_clock_rate(&nes->apu, nsf->video_mode == VIDEO_PAL ? CPU_CLOCK_PAL : CPU_CLOCK_NTSC);
+	return nsf_init_track(nsf, nsf->starting_song);
+}
+
+void nsf_unload(NSF* nsf)
+{
+	cartridge_unload(&nsf->nes->cartridge);
+	nsf->nes->cpu.is_running = 0;
+	nsf->nes->audio_only = 0;
+	apu_set_clock_rate(&nsf->nes->apu, CPU_CLOCK_NTSC);
+}
+
+static void call_routine(NSF* nsf, uint16_t addr)
+{
+	/* Emulate a JSR from the idle address. The routine's RTS pops
+	   NSF_RETURN_ADDR - 1 and adds 1, landing back on NSF_RETURN_ADDR */
+	NES* nes = nsf->nes;
+	uint16_t ret = NSF_RETURN_ADDR - 1;
+	nes->ram[0x100 | nes->cpu.sp--] = ret >> 8;
+	nes->ram[0x100 | nes->cpu.sp--] = ret & 0xFF;
+	nes->cpu.pc = addr;
+}
+
+int nsf_init_track(NSF* nsf, uint8_t track)
+{
+	NES* nes = nsf->nes;
+	Mapper* mapper = &nes->cartridge.mapper;
+	uint16_t addr;
+	uint8_t i;
+
+	if (track >= nsf->total_songs)
+	{
+		fprintf(stderr, "Error: invalid NSF track (%d)\n", track + 1);
+		return -1;
+	}
+
+	memset(nes->ram, 0, RAMSIZE);
+	memset(nes->cartridge.prg_ram.data, 0, nes->cartridge.prg_ram.size);
+	mapper->reset(mapper);
+	if (nsf->bankswitched)
+	{
+		for (i = 0; i < 8; ++i)
+			memory_set(nes, 0x5FF8 + i, nsf->bank_init[i]);
+	}
+
+	/* Silence the APU and disable frame counter IRQs */
+	for (addr = 0x4000; addr <= 0x4013; ++addr)
+		memory_set(nes, addr, 0);
+	memory_set(nes, 0x4015, 0);
+	memory_set(nes, 0x4015, 0x0F);
+	memory_set(nes, 0x4017, 0x40);
+
+	/* INIT is called with the track number in A and the region in X */
+	cpu_power(&nes->cpu);
+	nes->cpu.a = track;
+	nes->cpu.x = (nsf->video_mode == VIDEO_PAL);
+	nes->cpu.idle_cycles = 0;
+	call_routine(nsf, nsf->init_addr);
+	nsf->play_timer = nsf->play_period;
+	return 0;
+}
+
+void nsf_run(NSF* nsf, uint32_t cycles)
+{
+	NES* nes = nsf->nes;
+	int64_t remaining = cycles;
+	int32_t elapsed;
+
+	while (remaining > 0)
+	{
+		if (nes->cpu.pc != NSF_RETURN_ADDR)
+		{
+			/* INIT or PLAY is running. PLAY is never re-entered, so slow
+			   routines delay the next call like they would on hardware */
+			elapsed = cpu_step(&nes->cpu);
+		}
+		else if (nsf->play_timer <= 0)
+		{
+			nsf->play_timer += nsf->play_period;
+			call_routine(nsf, nsf->play_addr);
+			continue;
+		}
+		else
+		{
+			/* Idle until the next PLAY call. Only the APU needs clocking */
+			elapsed = (nsf->play_timer + 0xFF) >> 8;
+			if (elapsed > remaining)
+				elapsed = (int32_t)remaining;
+			nes->sched.now += elapsed;
+			apu_sync(&nes->apu);
+
+			/* DMC fetches stall the CPU, but it has nothing to do anyway */
+			nes->cpu.idle_cycles = 0;
+		}
+		nsf->play_timer -= elapsed << 8;
+		remaining -= elapsed;
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef NSF_H
+#define NSF_H
+
+#include <stdint.h>
+
+#include "nes.h"
+
+typedef struct {
+	NES* nes;
+
+	/* Header info */
+	uint8_t version;
+	uint8_t total_songs;
+	uint8_t starting_song;  /* 0-based */
+	uint16_t load_addr, init_addr, play_addr;
+	char name[33], artist[33], copyright[33];
+	uint8_t bankswitched;
+	uint8_t bank_init[8];
+	uint8_t extra_chips;
+	VideoMode video_mode;
+
+	/* Playback state. Timer values are CPU cycles in 24.8 fixed point */
+	int32_t play_period;
+	int32_t play_timer;
+} NSF;
+
+int nsf_load(NSF* nsf, NES* nes, char* path);
+void nsf_unload(NSF* nsf);
+int nsf_init_track(NSF* nsf, uint8_t track);
+void nsf_run(NSF* nsf, uint32_t cycles);
+
+#endif
@@ -0,0 +1,243 @@
+/* Multi-instance emulation pool. Each frame, the instances are split evenly
+   between the threads (the caller included). A thread that runs out of work
+   steals from the others' queues, so instances with slower frames (e.g.,
+   busier games) don't leave threads idle */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+#include "statecache.h"
+
+static void forward_render(uint32_t* frame, void* userdata)
+{
+	PoolSlot* slot = (PoolSlot*)userdata;
+	slot->pool->render_cb(slot->index, frame, slot->pool->userdata);
+}
+
+static void forward_sound(void* read_buf, uint32_t buf_size, void* userdata)
+{
+	PoolSlot* slot = (PoolSlot*)userdata;
+	slot->pool->snd_cb(slot->index, read_buf, buf_size, slot->pool->userdata);
+}
+
+static void apply_input(Controller* c, uint8_t buttons)
+{
+	uint8_t i;
+	for (i = 0; i < 8; ++i)
+		controller_set_button(c, (ControllerButton)(1 << i), (buttons >> i) & 1);
+}
+
+static void run_instance(NESPool* pool, uint32_t index)
+{
+	PoolSlot* slot = &pool->slots[index];
+	NES* nes = &pool->nes[index];
+	if (!slot->loaded)
+		return;
+	apply_input(&nes->c1, slot->buttons[0]);
+	apply_input(&nes->c2, slot->buttons[1]);
+	nes_run_frame(nes);
+}
+
+static void run_queues(NESPool* pool, uint32_t self)
+{
+	/* Drain our own queue, then steal from the others in turn. Claims past
+	   the end of a queue are harmless */
+	uint32_t t, i;
+	for (t = 0; t < pool->threads; ++t)
+	{
+		PoolQueue* queue = &pool->queues[(self + t) % pool->threads];
+		while ((i = atomic_fetch_add_explicit(&queue->next, 1, memory_order_relaxed)) < queue->end)
+			run_instance(pool, i);
+	}
+}
+
+static void* worker_thread(void* userdata)
+{
+	PoolWorker* worker = (PoolWorker*)userdata;
+	NESPool* pool = worker->pool;
+	uint32_t generation = 0;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&pool->lock);
+		while (pool->generation == generation && !pool->quit)
+			pthread_cond_wait(&pool->start_cond, &pool->lock);
+		if (pool->quit)
+		{
+			pthread_mutex_unlock(&pool->lock);
+			return NULL;
+		}
+		generation = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		run_queues(pool, worker->index);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->busy == 0)
+			pthread_cond_signal(&pool->done_cond);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+static void cleanup_instances(NESPool* pool, uint32_t count)
+{
+	uint32_t i;
+	for (i = 0; i < count; ++i)
+	{
+		nes_pool_unload_rom(pool, i);
+		nes_cleanup(&pool->nes[i]);
+	}
+	free(pool->nes);
+	free(pool->slots);
+}
+
+int nes_pool_init(NESPool* pool, NESPoolInfo* info)
+{
+	NESInitInfo init_info;
+	uint32_t i, threads = info->threads;
+
+	memset(pool, 0, sizeof(NESPool));
+	pool->count = info->instances;
+	pool->render_cb = info->render_cb;
+	pool->snd_cb = info->snd_cb;
+	pool->userdata = info->userdata;
+
+	/* NES instances are large. Keep them in one block */
+	pool->nes = (NES*)calloc(pool->count, sizeof(NES));
+	pool->slots = (PoolSlot*)calloc(pool->count, sizeof(PoolSlot));
+	if (!pool->nes || !pool->slots)
+	{
+		fprintf(stderr, "Error: unable to allocate emulation pool (code %d)\n", errno);
+		free(pool->nes);
+		free(pool->slots);
+		return -1;
+	}
+
+	memset(&init_info, 0, sizeof(init_info));
+	init_info.render_cb = info->render_cb ? forward_render : NULL;
+	init_info.snd_cb = info->snd_cb ? forward_sound : NULL;
+	init_info.audio_spec = info->audio_spec;
+	init_info.nvram_sync_frames = info->nvram_sync_frames;
+	init_info.cart_db = info->cart_db;
+	init_info.volatile_nvram = 1;  /* Instances would all share one save file */
+	init_info.no_framebuffer = info->no_framebuffer;
+	init_info.no_audio = info->no_audio;
+	for (i = 0; i < pool->count; ++i)
+	{
+		pool->slots[i].pool = pool;
+		pool->slots[i].index = i;
+		init_info.render_userdata = init_info.snd_userdata = &pool->slots[i];
+		init_info.ram = info->ram ? info->ram + (size_t)i * RAMSIZE : NULL;
+		if (nes_init(&pool->nes[i], &init_info) != 0)
+		{
+			cleanup_instances(pool, i);
+			return -1;
+		}
+	}
+
+	if (threads == 0)
+	{
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? (uint32_t)cores : 1;
+	}
+	if (threads > POOL_MAX_THREADS)
+		threads = POOL_MAX_THREADS;
+	if (threads > pool->count)
+		threads = pool->count ? pool->count : 1;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->start_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	/* The caller runs its share too (and everything, if no workers could be
+	   started) */
+	pool->threads = 1;
+	for (i = 1; i < threads; ++i)
+	{
+		PoolWorker* worker = &pool->workers[pool->threads - 1];
+		worker->pool = pool;
+		worker->index = pool->threads;
+		if (pthread_create(&worker->thread, NULL, worker_thread, worker) == 0)
+			++pool->threads;
+	}
+	return 0;
+}
+
+void nes_pool_cleanup(NESPool* pool)
+{
+	uint32_t i;
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (i = 0; i < pool->threads - 1; ++i)
+		pthread_join(pool->workers[i].thread, NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->start_cond);
+	pthread_mutex_destroy(&pool->lock);
+	cleanup_instances(pool, pool->count);
+}
+
+int nes_pool_load_rom(NESPool* pool, uint32_t index, char* path)
+{
+	nes_pool_unload_rom(pool, index);
+	if (nes_load_rom(&pool->nes[index], path) != 0)
+		return -1;
+	pool->slots[index].loaded = 1;
+	return 0;
+}
+
+void nes_pool_unload_rom(NESPool* pool, uint32_t index)
+{
+	if (!pool->slots[index].loaded)
+		return;
+	nes_unload_rom(&pool->nes[index]);
+	pool->slots[index].loaded = 0;
+}
+
+int nes_pool_boot(NESPool* pool, uint32_t index, const char* cache_dir, uint32_t frames)
+{
+	/* Only the first instance of a ROM has to run the frames. The others
+	   restore the state it cached */
+	if (!pool->slots[index].loaded)
+		return -1;
+	return state_cache_boot(cache_dir, &pool->nes[index], frames);
+}
+
+void nes_pool_set_input(NESPool* pool, uint32_t index, uint8_t port, uint8_t buttons)
+{
+	pool->slots[index].buttons[port & 1] = buttons;
+}
+
+void nes_pool_run_frame(NESPool* pool)
+{
+	/* Runs every loaded instance for one frame, and returns once all of
+	   them are done */
+	uint32_t t;
+	for (t = 0; t < pool->threads; ++t)
+	{
+		atomic_store_explicit(&pool->queues[t].next,
+							  (uint32_t)((uint64_t)pool->count * t / pool->threads),
+							  memory_order_relaxed);
+		pool->queues[t].end = (uint32_t)((uint64_t)pool->count * (t + 1) / pool->threads);
+	}
+
+	/* The lock publishes the queues to the workers */
+	pthread_mutex_lock(&pool->lock);
+	++pool->generation;
+	pool->busy = pool->threads - 1;
+	pthread_cond_broadcast(&pool->start_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	run_queues(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->busy)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,83 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "nes.h"
+
+#define POOL_MAX_THREADS 64
+
+/* Called on a worker thread with the index of the instance producing the
+   output. Different instances can call back concurrently */
+typedef void (*PoolRenderCallback)(uint32_t index, uint32_t* frame, void* userdata);
+typedef void (*PoolSoundCallback)(uint32_t index, void* read_buf, uint32_t buf_size, void* userdata);
+
+typedef struct {
+	uint32_t instances;
+	uint32_t threads;  /* Including the caller's (0 for one per core) */
+	PoolRenderCallback render_cb;
+	PoolSoundCallback snd_cb;
+	void* userdata;
+	AudioSpec audio_spec;
+	uint32_t nvram_sync_frames;
+	const CartridgeDB* cart_db;
+	uint8_t no_framebuffer;  /* See NESInitInfo */
+	uint8_t no_audio;
+	uint8_t* ram;  /* instances x 2KB block to keep their system RAM in (optional) */
+} NESPoolInfo;
+
+typedef struct {
+	struct NESPool* pool;
+	uint32_t index;
+	uint8_t loaded;
+	uint8_t buttons[2];  /* ControllerButton flags applied at the next frame */
+} PoolSlot;
+
+/* Instances handed out to one thread. Others steal from it once their own
+   queue is empty. Padded so that claims don't contend on a cache line */
+typedef struct {
+	atomic_uint next;
+	uint32_t end;
+	uint8_t pad[64 - sizeof(atomic_uint) - sizeof(uint32_t)];
+} PoolQueue;
+
+typedef struct {
+	struct NESPool* pool;
+	uint32_t index;  /* Thread index (the caller is 0) */
+	pthread_t thread;
+} PoolWorker;
+
+/* Independent NES instances stepped a frame at a time in parallel */
+typedef struct NESPool {
+	NES* nes;
+	PoolSlot* slots;
+	uint32_t count;
+
+	PoolRenderCallback render_cb;
+	PoolSoundCallback snd_cb;
+	void* userdata;
+
+	PoolQueue queues[POOL_MAX_THREADS];
+	PoolWorker workers[POOL_MAX_THREADS];
+	uint32_t threads;  /* Workers started, plus the caller */
+	pthread_mutex_t lock;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	uint32_t generation;  /* Bumped to start each frame */
+	uint32_t busy;  /* Workers still running the current frame */
+	uint8_t quit;
+} NESPool;
+
+int nes_pool_init(NESPool* pool, NESPoolInfo* info);
+void nes_pool_cleanup(NESPool* pool);
+
+/* Instances may only be loaded or given input between frames */
+int nes_pool_load_rom(NESPool* pool, uint32_t index, char* path);
+void nes_pool_unload_rom(NESPool* pool, uint32_t index);
+int nes_pool_boot(NESPool* pool, uint32_t index, const char* cache_dir, uint32_t frames);  /* See state_cache_boot */
+void nes_pool_set_input(NESPool* pool, uint32_t index, uint8_t port, uint8_t buttons);
+void nes_pool_run_frame(NESPool* pool);
+
+#endif
@@ -1,7 +1,9 @@
 /* Ricoh 2C02 PPU (picture processing unit) emulator.
    Provides NES graphics data manipulation, processing, and output */
 
+#include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "cartridge.h"
@@ -39,7 +41,7 @@
 #define VBLANK_START (ppu->scanline == 241 && ppu->cycle == 1)
 
 /* NES RGB palette */
-static uint32_t palette[64] =
+static const uint32_t palette[64] =
 {
 	0x7C7C7CFF, 0x0000FCFF, 0x0000BCFF, 0x4428BCFF, 0x940084FF, 0xA80020FF, 0xA81000FF, 0x881400FF,
 	0x503000FF, 0x007800FF, 0x006800FF, 0x005800FF, 0x004058FF, 0x000000FF, 0x000000FF, 0x000000FF,
@@ -53,33 +55,24 @@ static uint32_t palette[64] =
 
 static uint8_t* dispatch_address(PPU* ppu, uint16_t addr)
 {
+	addr &= 0x3FFF;  /* 14-bit address bus */
 	if (addr < 0x2000)
 		return mapper_get_banked_mem(&ppu->nes->cartridge.mapper.chr_banks, addr);
 	else if (addr < 0x3F00)
 	{
-		/* Nametable mirroring */
-		if (ppu->nes->cartridge.mirror_mode == MIRRORING_VERTICAL)
-			return &ppu->vram[addr & 0x7FF];
-		else if (ppu->nes->cartridge.mirror_mode == MIRRORING_HORIZONTAL)
-			return &ppu->vram[(addr & 0x3FF) | ((addr & 0x800) >> 1)];
-		else
-		{
-			/* TODO: 4-screen mirroring and single-screen mirroring */
-		}
-	}
-	else if (addr < 0x4000)
-	{
-		/* TODO: look into background palette hack */
-
-		/* Palette background mirroring:
-		   $3F04/$3F08/$3F0C can contain unique data, but
-		   $3F10/$3F14/$3F18/$3F1C mirror $3F00/$3F04/$3F08/$3F0C */
-		if ((addr & 0x13) == 0x10)
-			return &ppu->pram[addr & 0x0F];
-		return &ppu->pram[addr & 0x1F];
+		/* Nametables, via the cartridge's mirroring. $3000-$3EFF mirrors
+		   $2000-$2EFF */
+		return &ppu->nes->cartridge.nametables[(addr >> 10) & 3][addr & 0x3FF];
 	}
-	fprintf(stderr, "Warning: invalid PPU memory access ($%04X)\n", addr);
-	return &ppu->io_latch;
+
+	/* TODO: look into background palette hack */
+
+	/* Palette background mirroring:
+	   $3F04/$3F08/$3F0C can contain unique data, but
+	   $3F10/$3F14/$3F18/$3F1C mirror $3F00/$3F04/$3F08/$3F0C */
+	if ((addr & 0x13) == 0x10)
+		return &ppu->pram[addr & 0x0F];
+	return &ppu->pram[addr & 0x1F];
 }
 
 static uint8_t ppu_mem_read(PPU* ppu, uint16_t addr)
@@ -89,7 +82,9 @@ static uint8_t ppu_mem_read(PPU* ppu, uint16_t addr)
 
 static void ppu_mem_write(PPU* ppu, uint16_t addr, uint8_t val)
 {
-	/* TODO: disallow writes to CHR-ROM */
+	/* CHR ROM may be mapped read-only */
+	if ((addr & 0x3FFF) < 0x2000 && !ppu->nes->cartridge.chr_is_ram)
+		return;
 	*dispatch_address(ppu, addr) = val;
 }
 
@@ -109,12 +104,41 @@ static void ppu_mem_write(PPU* ppu, uint16_t addr, uint8_t val)
    |+-------- PPU master/slave select
    |          (0: read backdrop from EXT pins; 1: output color on EXT pins)
    +--------- If set, generate an NMI at the start of vblank */
+static void update_a12_rise_cycle(PPU* ppu)
+{
+	/* Rather than watching every pattern fetch, predict where PPU A12 rises
+	   on each rendered line (filtering out the short nametable fetches, like
+	   the MMC3 does):
+		-Background at $0000, sprites at $1000 (or 8x16): at sprite fetches
+		-Background at $1000, 8x8 sprites at $0000: at next line prefetch
+		-Same table for both: never */
+	uint8_t bg_hi = (ppu->ppuctrl >> 4) & 1;
+	uint8_t spr_hi = (ppu->ppuctrl >> 3) & 1;
+	if (TALL_SPRITES || (!bg_hi && spr_hi))
+		ppu->a12_rise_cycle = 260;
+	else if (bg_hi && !spr_hi)
+		ppu->a12_rise_cycle = 324;
+	else
+		ppu->a12_rise_cycle = 0xFFFF;
+}
+
 static void ppuctrl_write(PPU* ppu, uint8_t val)
 {
 	/* Copy base nametable address
 	   t: ...BA.. ........ = d: ......BA */
 	ppu->t = (ppu->t & 0x73FF) | ((val & 3) << 10);
 	ppu->ppuctrl = val;
+	update_a12_rise_cycle(ppu);
+}
+
+static void clock_mapper_scanline(PPU* ppu)
+{
+	Mapper* mapper = &ppu->nes->cartridge.mapper;
+	if (mapper->scanline)
+	{
+		mapper->scanline(mapper);
+		cpu_set_irq_line(&ppu->nes->cpu, IRQ_SOURCE_MAPPER, mapper->irq);
+	}
 }
 
 /* Mask register ($2001)
@@ -505,9 +529,11 @@ void fetch_sprite_data(PPU* ppu)
 
 void draw(PPU* ppu)
 {
+	/* Without a framebuffer, only sprite zero hits are worked out */
 	uint8_t x = ppu->cycle - 1;
 	uint8_t bg_pal_idx = 0;
 	uint8_t color = 0;
+	uint8_t drawing = (ppu->framebuffer || ppu->indexed_framebuffer);
 
 	if (BG_ENABLED && ((x > 7 || LEFT_BG_ENABLED)))
 	{
@@ -522,9 +548,12 @@ void draw(PPU* ppu)
 		/* Palette background mirroring. Although $3F04/$3F08/$3F0C can
 		   contain unique background data, only the universal background
 		   color is used during rendering. */
-		color = (bg_pal_idx == 0) ?
-				ppu_mem_read(ppu, 0x3F00) :
-				ppu_mem_read(ppu, 0x3F00 | (bg_palette*4 + bg_pal_idx));
+		if (drawing)
+		{
+			color = (bg_pal_idx == 0) ?
+					ppu_mem_read(ppu, 0x3F00) :
+					ppu_mem_read(ppu, 0x3F00 | (bg_palette*4 + bg_pal_idx));
+		}
 	}
 	if (SPR_ENABLED && (x > 7 || LEFT_SPR_ENABLED))
 	{
@@ -545,16 +574,22 @@ void draw(PPU* ppu)
 					/* Sprite zero hit: opaque background and opaque sprite on
 					   the same pixel */
 					ppu->spr0_hit = ppu->spr0_hit || (bg_pal_idx != 0 && spr->idx == 0 && x != 255);
-					if (bg_pal_idx == 0 || !spr->back_priority)
+					if (drawing && (bg_pal_idx == 0 || !spr->back_priority))
 						color = ppu_mem_read(ppu, 0x3F10 | ((spr->palette * 4) + pidx));
 					break;
 				}
 			}
 		}
 	}
-	if (GRAYSCALE)
-		color &= 0x30;
-	ppu->framebuffer[ppu->scanline * 256 + x] = palette[color];
+	if (drawing)
+	{
+		if (GRAYSCALE)
+			color &= 0x30;
+		if (ppu->framebuffer)
+			ppu->framebuffer[ppu->scanline * 256 + x] = palette[color];
+		if (ppu->indexed_framebuffer)
+			ppu->indexed_framebuffer[ppu->scanline * 256 + x] = color;
+	}
 }
 
 void ppu_tick(PPU* ppu)
@@ -590,6 +625,8 @@ void ppu_tick(PPU* ppu)
 					v: ....F.. ...EDCBA = t: ....F.. ...EDCBA */
 				ppu->v = (ppu->v & 0x7BE0) | (ppu->t & 0x41F);
 			}
+			else if (ppu->cycle == ppu->a12_rise_cycle)
+				clock_mapper_scanline(ppu);
 		}
 		if (PRERENDER_LINE && ppu->cycle >= 280 && ppu->cycle <= 304)
 		{
@@ -600,7 +637,10 @@ void ppu_tick(PPU* ppu)
 	}
 	if (VBLANK_START)
 	{
-		ppu->render_cb(ppu->framebuffer, ppu->render_userdata);
+		++ppu->frames;
+		if (ppu->render_cb)
+			ppu->render_cb(ppu->framebuffer, ppu->render_userdata);
+		cartridge_end_frame(&ppu->nes->cartridge);
 		ppu->vblank_started = 1;
 
 		/* TODO: NMI delay */
@@ -640,12 +680,39 @@ void ppu_tick(PPU* ppu)
 	}
 }
 
-void ppu_init(PPU* ppu, NES* nes, NESInitInfo* init_info)
+int ppu_init(PPU* ppu, NES* nes, NESInitInfo* init_info)
 {
 	memset(ppu, 0, sizeof(*ppu));
 	ppu->nes = nes;
 	ppu->render_cb = init_info->render_cb;
 	ppu->render_userdata = init_info->render_userdata;
+	update_a12_rise_cycle(ppu);
+	ppu->indexed_framebuffer = init_info->indexed_framebuffer;
+
+	if (init_info->no_framebuffer || init_info->framebuffer)
+	{
+		ppu->framebuffer = init_info->no_framebuffer ? NULL : init_info->framebuffer;
+		return 0;
+	}
+	if (!(ppu->framebuffer = (uint32_t*)calloc(256 * 240, sizeof(uint32_t))))
+	{
+		fprintf(stderr, "Error: could not allocate framebuffer (%d)\n", errno);
+		return -1;
+	}
+	ppu->owns_framebuffer = 1;
+	return 0;
+}
+
+const uint32_t* ppu_palette(void)
+{
+	return palette;
+}
+
+void ppu_cleanup(PPU* ppu)
+{
+	if (ppu->owns_framebuffer)
+		free(ppu->framebuffer);
+	memset(ppu, 0, sizeof(PPU));
 }
 
 /* PPU access via memory-mapped registers */
@@ -22,7 +22,9 @@ typedef struct {
 	struct NES* nes;
 	RenderCallback render_cb;
 	void* render_userdata;
-	uint32_t framebuffer[256*240];
+	uint32_t* framebuffer;  /* 256x240, kept apart so the rest stays small */
+	uint8_t owns_framebuffer;
+	uint8_t* indexed_framebuffer;  /* 256x240 NES color indices (caller-owned) */
 	
 	/* Current and temp VRAM address (15 bits each)
 	   yyy NN YYYYY XXXXX
@@ -66,7 +68,7 @@ typedef struct {
 	uint8_t oam[256];
 	uint8_t soam[32];    /* Secondary OAM */
 	uint8_t spr_indices[8];
-	uint8_t vram[2048];  /* i.e., nametables */
+	uint8_t vram[2048];  /* CIRAM (nametables), mapped by the cartridge */
 	uint8_t pram[32];    /* Palette memory */
 
 	/* Used during sprite evaluation */
@@ -85,10 +87,14 @@ typedef struct {
 	Sprite scanline_sprites[8];
 
 	uint16_t scanline, cycle;
+	uint16_t a12_rise_cycle;  /* Dot of the mapper scanline clock (see ppuctrl_write) */
+	uint32_t frames;  /* Frames output so far */
 } PPU;
 
 /*void ppu_oamdata_write(PPU* ppu, uint8_t val);*/
-void ppu_init(PPU* ppu, struct NES* nes, struct NESInitInfo* init_info);
+int ppu_init(PPU* ppu, struct NES* nes, struct NESInitInfo* init_info);
+void ppu_cleanup(PPU* ppu);
+const uint32_t* ppu_palette(void);  /* RGBA for each of the 64 color indices */
 void ppu_write(PPU* ppu, uint16_t addr, uint8_t val);
 uint8_t ppu_read(PPU* ppu, uint16_t addr);
 void ppu_tick(PPU* ppu);
@@ -0,0 +1,234 @@
+/* Streaming audio recorder. The emulation thread copies sample blocks into a
+   single-producer/single-consumer ring buffer; a writer thread drains it to
+   disk using large buffered writes */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "recorder.h"
+
+#define RING_SIZE (1 << 20)  /* Samples (~23 seconds). Must be a power of two */
+#define FILE_BUFFER_SIZE (1 << 20)
+#define WRITE_CHUNK_SIZE 16384  /* Samples converted per fwrite() */
+#define WRITER_POLL_NS 2000000
+
+struct Recorder {
+	FILE* file;
+	char* file_buf;
+	RecorderFormat format;
+	uint32_t sample_rate;
+	uint8_t channels;
+	uint8_t lossless;
+	uint8_t io_error;
+	uint32_t samples_written;
+
+	uint16_t* ring;
+	atomic_uint head;  /* Next slot written by the producer */
+	atomic_uint tail;  /* Next slot read by the writer thread */
+	atomic_uint dropped;
+	atomic_int stopping;
+	pthread_t thread;
+};
+
+static void sleep_ns(long ns)
+{
+	struct timespec ts;
+	ts.tv_sec = 0;
+	ts.tv_nsec = ns;
+	nanosleep(&ts, NULL);
+}
+
+static void write_le16(uint8_t* buf, uint16_t val)
+{
+	buf[0] = val & 0xFF;
+	buf[1] = val >> 8;
+}
+
+static void write_le32(uint8_t* buf, uint32_t val)
+{
+	write_le16(buf, val & 0xFFFF);
+	write_le16(buf + 2, val >> 16);
+}
+
+static int write_wav_header(Recorder* rec)
+{
+	/* 16-bit PCM. Sizes are patched in when the recording is closed */
+	uint8_t header[44];
+	uint32_t data_size = rec->samples_written * 2;
+	uint16_t block_align = rec->channels * 2;
+	memcpy(header, "RIFF", 4);
+	write_le32(header + 4, 36 + data_size);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	write_le32(header + 16, 16);
+	write_le16(header + 20, 1);  /* PCM */
+	write_le16(header + 22, rec->channels);
+	write_le32(header + 24, rec->sample_rate);
+	write_le32(header + 28, rec->sample_rate * block_align);
+	write_le16(header + 32, block_align);
+	write_le16(header + 34, 16);  /* Bits per sample */
+	memcpy(header + 36, "data", 4);
+	write_le32(header + 40, data_size);
+	return fwrite(header, 1, sizeof(header), rec->file) == sizeof(header) ? 0 : -1;
+}
+
+static void write_samples(Recorder* rec, const uint16_t* samples, uint32_t count)
+{
+	/* APU samples are unsigned. Output is signed little-endian */
+	uint8_t out[WRITE_CHUNK_SIZE * 2];
+	uint32_t i = 0;
+	for (; i < count; ++i)
+		write_le16(out + i*2, samples[i] ^ 0x8000);
+	if (fwrite(out, 2, count, rec->file) != count)
+		rec->io_error = 1;
+	rec->samples_written += count;
+}
+
+static uint32_t drain(Recorder* rec)
+{
+	uint32_t head = atomic_load_explicit(&rec->head, memory_order_acquire);
+	uint32_t tail = atomic_load_explicit(&rec->tail, memory_order_relaxed);
+	uint32_t drained = 0;
+
+	while (tail != head)
+	{
+		/* Write up to the end of the ring (or one chunk) at a time */
+		uint32_t start = tail & (RING_SIZE - 1);
+		uint32_t count = head - tail;
+		if (count > RING_SIZE - start)
+			count = RING_SIZE - start;
+		if (count > WRITE_CHUNK_SIZE)
+			count = WRITE_CHUNK_SIZE;
+
+		write_samples(rec, rec->ring + start, count);
+		tail += count;
+		drained += count;
+		atomic_store_explicit(&rec->tail, tail, memory_order_release);
+	}
+	return drained;
+}
+
+static void* writer_thread(void* userdata)
+{
+	Recorder* rec = (Recorder*)userdata;
+	while (!atomic_load_explicit(&rec->stopping, memory_order_acquire))
+	{
+		if (drain(rec) == 0)
+			sleep_ns(WRITER_POLL_NS);
+	}
+
+	/* Anything pushed before recorder_close() */
+	drain(rec);
+	return NULL;
+}
+
+Recorder* recorder_open(const char* path, RecorderFormat format, uint32_t sample_rate,
+						uint8_t channels, uint8_t lossless)
+{
+	Recorder* rec = (Recorder*)calloc(1, sizeof(Recorder));
+	if (!rec)
+	{
+		fprintf(stderr, "Error: unable to allocate audio recorder (code %d)\n", errno);
+		return NULL;
+	}
+	rec->format = format;
+	rec->sample_rate = sample_rate;
+	rec->channels = channels;
+	rec->lossless = lossless;
+	atomic_init(&rec->head, 0);
+	atomic_init(&rec->tail, 0);
+	atomic_init(&rec->dropped, 0);
+	atomic_init(&rec->stopping, 0);
+
+	if (!(rec->ring = (uint16_t*)malloc(RING_SIZE * sizeof(uint16_t))) ||
+		!(rec->file_buf = (char*)malloc(FILE_BUFFER_SIZE)))
+	{
+		fprintf(stderr, "Error: unable to allocate audio recording buffers (code %d)\n", errno);
+		free(rec->ring);
+		free(rec);
+		return NULL;
+	}
+	if (!(rec->file = fopen(path, "wb")))
+	{
+		fprintf(stderr, "Error: unable to open audio recording file (code %d)\n", errno);
+		free(rec->file_buf);
+		free(rec->ring);
+		free(rec);
+		return NULL;
+	}
+	setvbuf(rec->file, rec->file_buf, _IOFBF, FILE_BUFFER_SIZE);
+
+	if ((format == RECORDER_WAV && write_wav_header(rec) != 0) ||
+		pthread_create(&rec->thread, NULL, writer_thread, rec) != 0)
+	{
+		fprintf(stderr, "Error: unable to start audio recording (code %d)\n", errno);
+		fclose(rec->file);
+		free(rec->file_buf);
+		free(rec->ring);
+		free(rec);
+		return NULL;
+	}
+	return rec;
+}
+
+void recorder_push(Recorder* rec, const uint16_t* samples, uint32_t count)
+{
+	/* Called from the emulation thread only */
+	uint32_t head = atomic_load_explicit(&rec->head, memory_order_relaxed);
+	while (count > 0)
+	{
+		uint32_t tail = atomic_load_explicit(&rec->tail, memory_order_acquire);
+		uint32_t space = RING_SIZE - (head - tail);
+		uint32_t start = head & (RING_SIZE - 1);
+		uint32_t n = count;
+
+		if (!rec->lossless && space < count)
+		{
+			/* Drop the whole block so multichannel frames stay aligned */
+			atomic_fetch_add_explicit(&rec->dropped, count, memory_order_relaxed);
+			return;
+		}
+		if (space == 0)
+		{
+			sleep_ns(WRITER_POLL_NS / 4);
+			continue;
+		}
+		if (n > space)
+			n = space;
+		if (n > RING_SIZE - start)
+			n = RING_SIZE - start;
+
+		memcpy(rec->ring + start, samples, n * sizeof(uint16_t));
+		head += n;
+		samples += n;
+		count -= n;
+		atomic_store_explicit(&rec->head, head, memory_order_release);
+	}
+}
+
+uint32_t recorder_dropped_samples(Recorder* rec)
+{
+	return atomic_load_explicit(&rec->dropped, memory_order_relaxed);
+}
+
+int recorder_close(Recorder* rec)
+{
+	int ret;
+	atomic_store_explicit(&rec->stopping, 1, memory_order_release);
+	pthread_join(rec->thread, NULL);
+
+	if (rec->format == RECORDER_WAV && fseek(rec->file, 0, SEEK_SET) == 0)
+		write_wav_header(rec);
+	ret = (fclose(rec->file) == 0 && !rec->io_error) ? 0 : -1;
+	if (ret != 0)
+		fprintf(stderr, "Error: unable to write audio recording (code %d)\n", errno);
+
+	free(rec->file_buf);
+	free(rec->ring);
+	free(rec);
+	return ret;
+}
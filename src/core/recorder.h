@@ -0,0 +1,22 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdint.h>
+
+typedef enum {
+	RECORDER_WAV,
+	RECORDER_RAW  /* Headerless signed 16-bit little-endian PCM (interleaved) */
+} RecorderFormat;
+
+/* Streams audio to disk from a dedicated writer thread. Samples are handed
+   over through a lock-free single-producer/single-consumer queue, so the
+   emulation thread never waits on file I/O (unless lossless mode is used and
+   the writer falls behind by more than the queue size) */
+typedef struct Recorder Recorder;
+
+Recorder* recorder_open(const char* path, RecorderFormat format, uint32_t sample_rate, uint8_t channels, uint8_t lossless);
+void recorder_push(Recorder* rec, const uint16_t* samples, uint32_t count);  /* Whole frames only */
+uint32_t recorder_dropped_samples(Recorder* rec);
+int recorder_close(Recorder* rec);
+
+#endif
@@ -0,0 +1,34 @@
+/* Event scheduler. Devices are run lazily, catching up to the CPU only when
+   it touches their registers or when one of their events comes due.
+
+   Posted times only need to be no later than the real event: an early one
+   just brings the device up to date and has it post again */
+
+#include <string.h>
+
+#include "scheduler.h"
+
+void scheduler_init(Scheduler* sched)
+{
+	/* Everything starts due so that each device posts its real events the
+	   first time the CPU checks */
+	memset(sched, 0, sizeof(Scheduler));
+}
+
+void scheduler_post(Scheduler* sched, EventSlot slot, uint64_t time)
+{
+	/* Few enough slots that a scan beats maintaining a heap */
+	uint8_t i;
+	sched->events[slot] = time;
+	sched->next = EVENT_NONE;
+	for (i = 0; i < EVENT_COUNT; ++i)
+	{
+		if (sched->events[i] < sched->next)
+			sched->next = sched->events[i];
+	}
+}
+
+uint8_t scheduler_due(Scheduler* sched, EventSlot slot)
+{
+	return sched->events[slot] <= sched->now;
+}
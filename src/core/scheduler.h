@@ -0,0 +1,30 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+#define EVENT_NONE UINT64_MAX
+
+/* Upcoming times at which a lazily run device may do something the CPU can
+   observe (raise an interrupt, stall it, or hand off output). Each source
+   owns one slot and reposts it whenever it is brought up to date. The PPU
+   (and the mapper scanline counter it clocks) runs in lockstep with the
+   CPU, so it raises its interrupts directly */
+typedef enum {
+	EVENT_APU_FRAME,   /* Frame counter IRQ */
+	EVENT_APU_DMC,     /* DMC sample fetch (CPU stall) and IRQ */
+	EVENT_APU_BUFFER,  /* Audio buffer hand-off */
+	EVENT_COUNT
+} EventSlot;
+
+typedef struct {
+	uint64_t now;   /* Master clock, in CPU cycles */
+	uint64_t next;  /* Earliest posted event. The CPU runs freely until then */
+	uint64_t events[EVENT_COUNT];
+} Scheduler;
+
+void scheduler_init(Scheduler* sched);
+void scheduler_post(Scheduler* sched, EventSlot slot, uint64_t time);
+uint8_t scheduler_due(Scheduler* sched, EventSlot slot);
+
+#endif
@@ -0,0 +1,206 @@
+/* Save state cache. Files are named "<ROM CRC>-<board CRC>-<key>.state" and
+   hold a header identifying the emulation code, then a plain nes_save_state
+   snapshot */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cartridge.h"
+#include "statecache.h"
+
+/* Set by the build from the emulation sources, so that a fix which leaves
+   the state layout alone still invalidates the cache. Builds without it at
+   least tell themselves apart */
+#ifndef PNES_CORE_ID
+#define PNES_CORE_ID __DATE__ " " __TIME__
+#endif
+
+#define CACHE_MAGIC "PNSC"
+#define CORE_ID_SIZE 44
+
+typedef struct {
+	char magic[4];
+	char core_id[CORE_ID_SIZE];  /* PNES_CORE_ID, zero-padded */
+} CacheHeader;
+
+static void fill_header(CacheHeader* header)
+{
+	memset(header, 0, sizeof(CacheHeader));
+	memcpy(header->magic, CACHE_MAGIC, 4);
+	strncpy(header->core_id, PNES_CORE_ID, CORE_ID_SIZE - 1);
+}
+
+static char* cache_path(const char* dir, const NES* nes, const char* key)
+{
+	const char* c;
+	char* path;
+
+	for (c = key; *c; ++c)
+	{
+		if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') ||
+			  *c == '-' || *c == '_' || (*c == '.' && c != key)))
+		{
+			break;
+		}
+	}
+	if (*c || c == key)
+	{
+		fprintf(stderr, "Error: invalid state cache key \"%s\"\n", key);
+		return NULL;
+	}
+
+	/* Room for the separators, CRCs, and suffix. The board CRC tells apart
+	   ROMs loaded with and without database corrections */
+	if (!(path = (char*)malloc(strlen(dir) + strlen(key) + 26)))
+	{
+		fprintf(stderr, "Error: unable to allocate path (code %d)\n", errno);
+		return NULL;
+	}
+	sprintf(path, "%s/%08X-%08X-%s.state", dir, cartridge_crc(&nes->cartridge),
+			nes->cartridge.board_crc, key);
+	return path;
+}
+
+static int read_state(FILE* file, uint8_t** state, size_t* size)
+{
+	long len;
+	if (fseek(file, 0, SEEK_END) != 0 || (len = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET) != 0)
+		return -1;
+	if (!(*state = (uint8_t*)malloc(len)))
+		return -1;
+	if (fread(*state, 1, len, file) != (size_t)len)
+	{
+		free(*state);
+		return -1;
+	}
+	*size = (size_t)len;
+	return 0;
+}
+
+int state_cache_load(const char* dir, NES* nes, const char* key)
+{
+	char* path = cache_path(dir, nes, key);
+	CacheHeader header;
+	uint8_t* state;
+	size_t size;
+	FILE* file;
+	int ret;
+
+	if (!path)
+		return -1;
+	file = fopen(path, "rb");
+	free(path);
+	if (!file)
+	{
+		if (errno == ENOENT)
+			return 1;
+		fprintf(stderr, "Error: unable to open cached state (code %d)\n", errno);
+		return -1;
+	}
+	ret = read_state(file, &state, &size);
+	fclose(file);
+
+	/* Unreadable or stale states are as good as missing */
+	if (ret != 0)
+	{
+		fprintf(stderr, "Warning: ignoring unreadable cached state\n");
+		return 1;
+	}
+	fill_header(&header);
+	if (size < sizeof(CacheHeader) || memcmp(state, &header, sizeof(CacheHeader)) != 0)
+		ret = 1;  /* From another version of the emulator */
+	else
+		ret = nes_load_state(nes, state + sizeof(CacheHeader), size - sizeof(CacheHeader)) == 0 ? 0 : 1;
+	free(state);
+	return ret;
+}
+
+int state_cache_save(const char* dir, NES* nes, const char* key)
+{
+	char* path = cache_path(dir, nes, key);
+	char* tmp_path;
+	CacheHeader header;
+	uint8_t* state;
+	size_t size = nes_state_size(nes);
+	FILE* file;
+	int ret = 0;
+
+	if (!path)
+		return -1;
+	if (mkdir(dir, 0777) != 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "Error: unable to create state cache directory (code %d)\n", errno);
+		free(path);
+		return -1;
+	}
+
+	/* Written to a temporary file first, so that runs sharing the cache
+	   never see a partial state */
+	state = (uint8_t*)malloc(size);
+	tmp_path = (char*)malloc(strlen(path) + 16);
+	if (!state || !tmp_path)
+	{
+		fprintf(stderr, "Error: unable to allocate state (code %d)\n", errno);
+		free(state);
+		free(tmp_path);
+		free(path);
+		return -1;
+	}
+	nes_save_state(nes, state, size);
+	sprintf(tmp_path, "%s.%d.tmp", path, (int)getpid());
+	if (!(file = fopen(tmp_path, "wb")))
+	{
+		fprintf(stderr, "Error: unable to write cached state (code %d)\n", errno);
+		free(state);
+		free(tmp_path);
+		free(path);
+		return -1;
+	}
+
+	fill_header(&header);
+	if (fwrite(&header, sizeof(CacheHeader), 1, file) != 1 || fwrite(state, 1, size, file) != size)
+		ret = -1;
+	if (fclose(file) != 0 || ret != 0 || rename(tmp_path, path) != 0)
+	{
+		fprintf(stderr, "Error: unable to write cached state (code %d)\n", errno);
+		remove(tmp_path);
+		ret = -1;
+	}
+	free(state);
+	free(tmp_path);
+	free(path);
+	return ret;
+}
+
+int state_cache_boot(const char* dir, NES* nes, uint32_t frames)
+{
+	APU* apu = &nes->apu;
+	Recorder* rec = apu->recorder;
+	Recorder* stem_rec = apu->stem_recorder;
+	SoundCallback snd_cb = apu->snd_cb;
+	char key[16];
+	uint32_t i;
+	int ret;
+
+	sprintf(key, "frame%u", frames);
+	if ((ret = state_cache_load(dir, nes, key)) == 1)
+	{
+		/* Boot frames make no sound either way, so that output is the same
+		   whether or not the state was cached */
+		apu->recorder = apu->stem_recorder = NULL;
+		apu->snd_cb = NULL;
+		for (i = 0; i < frames && nes->cpu.is_running; ++i)
+			nes_run_frame(nes);
+		apu->recorder = rec;
+		apu->stem_recorder = stem_rec;
+		apu->snd_cb = snd_cb;
+		ret = state_cache_save(dir, nes, key);
+	}
+	if (ret == 0)
+		apu_restart_output(apu);
+	return ret;
+}
@@ -0,0 +1,24 @@
+#ifndef STATECACHE_H
+#define STATECACHE_H
+
+#include <stdint.h>
+
+#include "nes.h"
+
+/* On-disk cache of save states, one file per ROM (by cartridge_crc and
+   board description, which database corrections change) and key, in a
+   directory shared by runs. States saved by other versions of the emulation
+   code don't load, and are replaced. The NES must use volatile battery RAM,
+   since a restored state overwrites it */
+
+/* Keys are labels made of letters, digits, '-', '_', and '.'.
+   Loading returns 1 if the state isn't cached */
+int state_cache_load(const char* dir, NES* nes, const char* key);
+int state_cache_save(const char* dir, NES* nes, const char* key);
+
+/* Brings an NES that just loaded its ROM to the given number of frames
+   after power-on (run without input), from the cache if possible. The
+   state is cached otherwise. Audio output starts after the boot frames */
+int state_cache_boot(const char* dir, NES* nes, uint32_t frames);
+
+#endif
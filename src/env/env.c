@@ -0,0 +1,204 @@
+/* Vectorized environment. Instances are stepped in parallel on an emulation
+   pool. They draw NES color indices straight into the observation block,
+   and keep their RAM in the other one. With max pooling, the second-last
+   frame of a step is drawn into a scratch block that the last one is then
+   pooled with. Color indices aren't ordered by brightness, so pooling
+   compares their luma */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../core/pool.h"
+#include "env.h"
+
+struct NESEnv {
+	NESPool pool;
+	NES boot;  /* Power-on state that instances are reset to */
+	uint8_t boot_loaded;
+	uint8_t pool_ready;
+	uint32_t frame_skip;
+	uint8_t max_pool;
+	uint8_t players;
+
+	uint8_t* frames;
+	uint8_t* scratch_frames;  /* Only with max pooling */
+	uint8_t* ram;
+	uint8_t luma[64];  /* Of each color index */
+};
+
+static void init_luma(NESEnv* env)
+{
+	/* Rec. 601 weights, from the RGBA palette */
+	const uint32_t* palette = ppu_palette();
+	uint8_t i;
+	for (i = 0; i < 64; ++i)
+	{
+		uint32_t r = palette[i] >> 24, g = (palette[i] >> 16) & 0xFF, b = (palette[i] >> 8) & 0xFF;
+		env->luma[i] = (uint8_t)((77 * r + 150 * g + 29 * b) >> 8);
+	}
+}
+
+static void draw_into(NESEnv* env, uint8_t* frames)
+{
+	/* Frames that are never observed aren't drawn (NULL) */
+	uint32_t i;
+	for (i = 0; i < env->pool.count; ++i)
+		env->pool.nes[i].ppu.indexed_framebuffer = frames ? frames + (size_t)i * NES_ENV_FRAME_SIZE : NULL;
+}
+
+NESEnv* nes_env_create(const NESEnvConfig* config)
+{
+	NESEnv* env;
+	NESPoolInfo pool_info;
+	NESInitInfo init_info;
+	size_t frames_size = (size_t)config->instances * NES_ENV_FRAME_SIZE;
+	uint32_t i;
+
+	if (config->instances == 0 || config->players > 2)
+	{
+		fprintf(stderr, "Error: invalid environment configuration\n");
+		return NULL;
+	}
+	if (!(env = (NESEnv*)calloc(1, sizeof(NESEnv))))
+	{
+		fprintf(stderr, "Error: unable to allocate environment (code %d)\n", errno);
+		return NULL;
+	}
+	env->frame_skip = config->frame_skip ? config->frame_skip : 1;
+	env->max_pool = config->max_pool && env->frame_skip > 1;
+	env->players = config->players ? config->players : 1;
+	init_luma(env);
+
+	env->frames = (uint8_t*)calloc(frames_size, 1);
+	env->ram = (uint8_t*)calloc(config->instances, NES_ENV_RAM_SIZE);
+	if (env->max_pool)
+		env->scratch_frames = (uint8_t*)calloc(frames_size, 1);
+	if (!env->frames || !env->ram || (env->max_pool && !env->scratch_frames))
+	{
+		fprintf(stderr, "Error: unable to allocate observations (code %d)\n", errno);
+		nes_env_destroy(env);
+		return NULL;
+	}
+
+	/* Only indexed frames are drawn, and nothing is heard */
+	memset(&init_info, 0, sizeof(init_info));
+	init_info.volatile_nvram = 1;
+	init_info.no_framebuffer = 1;
+	init_info.no_audio = 1;
+	if (nes_init(&env->boot, &init_info) != 0)
+	{
+		nes_env_destroy(env);
+		return NULL;
+	}
+	if (nes_load_rom(&env->boot, (char*)config->rom_path) != 0)
+	{
+		nes_cleanup(&env->boot);
+		nes_env_destroy(env);
+		return NULL;
+	}
+	env->boot_loaded = 1;
+
+	memset(&pool_info, 0, sizeof(pool_info));
+	pool_info.instances = config->instances;
+	pool_info.threads = config->threads;
+	pool_info.no_framebuffer = 1;
+	pool_info.no_audio = 1;
+	pool_info.ram = env->ram;
+	if (nes_pool_init(&env->pool, &pool_info) != 0)
+	{
+		nes_env_destroy(env);
+		return NULL;
+	}
+	env->pool_ready = 1;
+	for (i = 0; i < config->instances; ++i)
+	{
+		if (nes_pool_load_rom(&env->pool, i, (char*)config->rom_path) != 0)
+		{
+			nes_env_destroy(env);
+			return NULL;
+		}
+	}
+	return env;
+}
+
+void nes_env_destroy(NESEnv* env)
+{
+	/* Also releases partially created environments */
+	if (!env)
+		return;
+	if (env->pool_ready)
+		nes_pool_cleanup(&env->pool);
+	if (env->boot_loaded)
+	{
+		nes_unload_rom(&env->boot);
+		nes_cleanup(&env->boot);
+	}
+	free(env->scratch_frames);
+	free(env->ram);
+	free(env->frames);
+	free(env);
+}
+
+void nes_env_reset_instance(NESEnv* env, uint32_t index)
+{
+	nes_copy_state(&env->pool.nes[index], &env->boot);
+	memset(env->frames + (size_t)index * NES_ENV_FRAME_SIZE, 0, NES_ENV_FRAME_SIZE);
+	if (env->scratch_frames)
+		memset(env->scratch_frames + (size_t)index * NES_ENV_FRAME_SIZE, 0, NES_ENV_FRAME_SIZE);
+}
+
+void nes_env_reset(NESEnv* env)
+{
+	uint32_t i;
+	for (i = 0; i < env->pool.count; ++i)
+		nes_env_reset_instance(env, i);
+}
+
+void nes_env_step(NESEnv* env, const uint8_t* actions)
+{
+	uint32_t i, frame;
+	uint8_t port;
+	size_t j, frames_size = (size_t)env->pool.count * NES_ENV_FRAME_SIZE;
+
+	for (i = 0; i < env->pool.count; ++i)
+	{
+		for (port = 0; port < env->players; ++port)
+			nes_pool_set_input(&env->pool, i, port, actions[i * env->players + port]);
+	}
+
+	/* Only the last frame (and the one before it, with max pooling) is
+	   observed */
+	for (frame = 0; frame < env->frame_skip; ++frame)
+	{
+		uint8_t* target = NULL;
+		if (frame == env->frame_skip - 1)
+			target = env->frames;
+		else if (frame == env->frame_skip - 2 && env->max_pool)
+			target = env->scratch_frames;
+		draw_into(env, target);
+		nes_pool_run_frame(&env->pool);
+	}
+
+	if (env->max_pool)
+	{
+		for (j = 0; j < frames_size; ++j)
+		{
+			if (env->luma[env->scratch_frames[j] & 0x3F] > env->luma[env->frames[j] & 0x3F])
+				env->frames[j] = env->scratch_frames[j];
+		}
+	}
+}
+
+void nes_env_get_observations(NESEnv* env, NESEnvObservations* obs)
+{
+	obs->frames = env->frames;
+	obs->ram = env->ram;
+	obs->instances = env->pool.count;
+}
+
+const uint32_t* nes_env_palette(void)
+{
+	return ppu_palette();
+}
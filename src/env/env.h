@@ -0,0 +1,60 @@
+#ifndef ENV_H
+#define ENV_H
+
+#include <stdint.h>
+
+#if defined(NES_ENV_BUILD) && defined(__GNUC__)
+#define NES_ENV_API __attribute__((visibility("default")))
+#else
+#define NES_ENV_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NES_ENV_FRAME_SIZE (256 * 240)
+#define NES_ENV_RAM_SIZE 0x800
+
+/* Vectorized environment over many instances of one ROM, for reinforcement
+   learning. Each step applies one action per instance (and player) for a
+   number of frames, then publishes observations */
+typedef struct NESEnv NESEnv;
+
+typedef struct {
+	const char* rom_path;
+	uint32_t instances;
+	uint32_t threads;     /* 0 for one per core */
+	uint32_t frame_skip;  /* Frames each action is repeated for (0 for 1) */
+	uint8_t max_pool;     /* Observe the brighter color of the last two frames at each pixel */
+	uint8_t players;      /* Controllers driven by actions (1 or 2; 0 for 1) */
+} NESEnvConfig;
+
+/* Zero-copy views into the environment, laid out contiguously by instance.
+   Valid until the environment is destroyed, and updated in place by each
+   step or reset */
+typedef struct {
+	const uint8_t* frames;  /* instances x 240 x 256 NES color indices */
+	const uint8_t* ram;     /* instances x 2KB of system RAM */
+	uint32_t instances;
+} NESEnvObservations;
+
+NES_ENV_API NESEnv* nes_env_create(const NESEnvConfig* config);  /* NULL on failure */
+NES_ENV_API void nes_env_destroy(NESEnv* env);  /* Does nothing for NULL */
+
+/* Return instances to their power-on state. Their frames are cleared */
+NES_ENV_API void nes_env_reset(NESEnv* env);
+NES_ENV_API void nes_env_reset_instance(NESEnv* env, uint32_t index);
+
+/* actions holds instances x players ControllerButton flags */
+NES_ENV_API void nes_env_step(NESEnv* env, const uint8_t* actions);
+NES_ENV_API void nes_env_get_observations(NESEnv* env, NESEnvObservations* obs);
+
+/* RGBA for each of the 64 color indices */
+NES_ENV_API const uint32_t* nes_env_palette(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,668 @@
+/* Headless front end for batch jobs. Runs ROMs, renders NSF tracks, or
+   indexes ROM libraries without any video or audio device */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../core/crc32.h"
+#include "../core/library.h"
+#include "../core/movie.h"
+#include "../core/nes.h"
+#include "../core/netplay.h"
+#include "../core/nsf.h"
+#include "../core/pool.h"
+#include "../core/recorder.h"
+#include "../core/statecache.h"
+
+typedef struct {
+	char* in_path;
+	char* out_path;
+	char* stem_path;
+	char* index_path;
+	char* db_path;
+	char* movie_path;
+	char* cache_dir;
+	int track;
+	int seconds;
+	int frames;
+	int instances;
+	int verify;
+	int boot_frames;
+	int netplay;
+	int net_latency;
+	int net_loss;
+	AudioSpec audio_spec;
+} Options;
+
+static void usage(char* name)
+{
+	fprintf(stderr,
+			"Usage: %s [options] <file.nes|file.nsf>\n"
+			"       %s -l <index> <directory>\n"
+			"  -o <path>     record audio to a WAV file (or raw PCM if the path ends in .raw)\n"
+			"  -m <path>     record each APU channel and the mono mix to a 6-channel file\n"
+			"  -f <frames>   number of frames to run a ROM for (default: 600)\n"
+			"  -i <count>    run the ROM on a pool of this many instances in parallel\n"
+			"  -b <frames>   start from this many frames after power-on, restoring the state\n"
+			"                from the boot-state cache (and caching it if it isn't yet)\n"
+			"  -k <dir>      boot-state cache directory (default: pnes-cache)\n"
+			"  -v <movie>    play back an input movie as fast as possible, then print the\n"
+			"                CRC-32 of the final state\n"
+			"  -c            with -v, verify the movie instead, replaying the segments\n"
+			"                between its keyframes in parallel\n"
+			"  -u <lat,loss> run a two-player rollback session for -f frames between two\n"
+			"                instances over UDP loopback, simulating one-way latency (in\n"
+			"                frames) and packet loss (percent)\n"
+			"  -t <track>    NSF track to render (1-based, default: NSF starting song)\n"
+			"  -s <seconds>  length of NSF audio to render (default: 60)\n"
+			"  -r <rate>     audio sample rate (default: %d)\n"
+			"  -n            disable the NES output filters (record the raw mix)\n"
+			"  -p <pans>     record in stereo, panning pulse 1, pulse 2, triangle, noise, and DMC\n"
+			"                by the given comma-separated values (-1 is left, 1 is right)\n"
+			"  -d <path>     load ROM header corrections from a cartridge database\n"
+			"  -l <index>    list the ROMs under a directory, updating the given index file\n",
+			name, name, APU_SAMPLE_RATE);
+}
+
+static int parse_pans(AudioSpec* spec, char* str)
+{
+	uint8_t i;
+	for (i = 0; i < AUDIO_PAN_CHANNELS; ++i)
+	{
+		char* end;
+		spec->pan[i] = (float)strtod(str, &end);
+		if (end == str || (*end != ',' && *end != '\0'))
+			return -1;
+		if (*end == '\0')
+			break;
+		str = end + 1;
+	}
+	spec->channels = 2;
+	return 0;
+}
+
+static int parse_options(Options* opts, int argc, char** argv)
+{
+	int i;
+	memset(opts, 0, sizeof(Options));
+	opts->seconds = 60;
+	opts->frames = 600;
+	opts->cache_dir = "pnes-cache";
+
+	for (i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+			opts->out_path = argv[++i];
+		else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc)
+			opts->stem_path = argv[++i];
+		else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+			opts->frames = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+			opts->track = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			opts->seconds = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+			opts->audio_spec.sample_rate = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-n") == 0)
+			opts->audio_spec.filter = AUDIO_FILTER_NONE;
+		else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+			opts->db_path = argv[++i];
+		else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+			opts->instances = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-v") == 0 && i + 1 < argc)
+			opts->movie_path = argv[++i];
+		else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc)
+			opts->boot_frames = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+			opts->cache_dir = argv[++i];
+		else if (strcmp(argv[i], "-c") == 0)
+			opts->verify = 1;
+		else if (strcmp(argv[i], "-u") == 0 && i + 1 < argc)
+		{
+			opts->netplay = 1;
+			if (sscanf(argv[++i], "%d,%d", &opts->net_latency, &opts->net_loss) != 2)
+				return -1;
+		}
+		else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+			opts->index_path = argv[++i];
+		else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+		{
+			if (parse_pans(&opts->audio_spec, argv[++i]) != 0)
+				return -1;
+		}
+		else if (argv[i][0] != '-' && !opts->in_path)
+			opts->in_path = argv[i];
+		else
+			return -1;
+	}
+	if (opts->verify && !opts->movie_path)
+		return -1;
+	return (opts->in_path && opts->seconds > 0 && opts->frames > 0 && opts->instances >= 0 &&
+			opts->boot_frames >= 0 && opts->net_latency >= 0 && opts->net_loss >= 0 &&
+			opts->net_loss < 100) ? 0 : -1;
+}
+
+static int is_nsf(char* path)
+{
+	char magic[5];
+	FILE* file = fopen(path, "rb");
+	int ret = 0;
+	if (file)
+	{
+		ret = fread(magic, 1, 5, file) == 5 && memcmp(magic, "NESM\x1A", 5) == 0;
+		fclose(file);
+	}
+	return ret;
+}
+
+static Recorder* open_recorder(char* path, uint32_t sample_rate, uint8_t channels)
+{
+	/* Recordings used for regression comparison must not drop samples */
+	size_t len = strlen(path);
+	RecorderFormat format = (len > 4 && strcmp(path + len - 4, ".raw") == 0) ?
+							RECORDER_RAW : RECORDER_WAV;
+	return recorder_open(path, format, sample_rate, channels, 1);
+}
+
+static int list_library(Options* opts)
+{
+	static const char* mirroring[] = { "vertical", "horizontal", "4-screen", "1-screen", "1-screen" };
+	Library lib;
+	clock_t start = clock();
+	uint32_t i;
+
+	if (library_scan(&lib, opts->in_path, opts->index_path, 0) != 0)
+		return -1;
+	for (i = 0; i < lib.count; ++i)
+	{
+		LibraryEntry* entry = &lib.entries[i];
+		if (!entry->valid)
+		{
+			printf("--------  invalid ROM image                                  %s\n", entry->path);
+			continue;
+		}
+		printf("%08X  mapper %3d  PRG %4uKB  CHR %4uKB  %-10s  %s  %s\n",
+			   entry->crc, entry->header.mapper_num,
+			   entry->header.prg_rom_size / 1024, entry->header.chr_rom_size / 1024,
+			   mirroring[entry->header.mirror_mode],
+			   entry->header.prg_nvram_size ? "battery" : "       ", entry->path);
+	}
+	fprintf(stderr, "Indexed %u ROMs (%u read) in %.2fs\n", lib.count, lib.rehashed,
+			(double)(clock() - start) / CLOCKS_PER_SEC);
+	library_free(&lib);
+	return 0;
+}
+
+static void report_speed(char* what, double emulated, clock_t start)
+{
+	double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+	fprintf(stderr, "Ran %.1fs of %s in %.2fs (%.0fx realtime)\n",
+			emulated, what, elapsed, elapsed > 0 ? emulated / elapsed : 0.0);
+}
+
+static int render_nsf(NES* nes, Options* opts)
+{
+	NSF nsf;
+	uint64_t cycles;
+	clock_t start;
+
+	if (nsf_load(&nsf, nes, opts->in_path) != 0)
+		return -1;
+	if (opts->track > 0 && nsf_init_track(&nsf, opts->track - 1) != 0)
+	{
+		nsf_unload(&nsf);
+		return -1;
+	}
+	fprintf(stderr, "%s - %s (%s)\n", nsf.name, nsf.artist, nsf.copyright);
+
+	/* Render a frame's worth of cycles at a time */
+	start = clock();
+	cycles = (uint64_t)opts->seconds * (nsf.video_mode == VIDEO_PAL ? CPU_CLOCK_PAL : CPU_CLOCK_NTSC);
+	while (cycles > 0)
+	{
+		uint32_t n = cycles < 29781 ? (uint32_t)cycles : 29781;
+		nsf_run(&nsf, n);
+		cycles -= n;
+	}
+	apu_flush(&nes->apu);
+	report_speed("audio", opts->seconds, start);
+	nsf_unload(&nsf);
+	return 0;
+}
+
+static double wall_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void count_frame(uint32_t* frame, void* userdata)
+{
+	(void)frame;  /* NULL, since no frame is drawn */
+	++*(int*)userdata;
+}
+
+static int boot(NES* nes, Options* opts)
+{
+	double start = wall_time();
+	if (state_cache_boot(opts->cache_dir, nes, opts->boot_frames) != 0)
+		return -1;
+	fprintf(stderr, "Booted to frame %d in %.1fms\n", opts->boot_frames, (wall_time() - start) * 1000);
+	return 0;
+}
+
+static int run_rom(NES* nes, Options* opts, int* frame_count)
+{
+	clock_t start;
+	if (nes_load_rom(nes, opts->in_path) != 0)
+		return -1;
+	if (opts->boot_frames && boot(nes, opts) != 0)
+	{
+		nes_unload_rom(nes);
+		return -1;
+	}
+
+	/* Frames run while booting don't count */
+	*frame_count = 0;
+	start = clock();
+	while (*frame_count < opts->frames)
+		nes_update(nes);
+	apu_flush(&nes->apu);
+	report_speed("emulation", *frame_count / 60.0, start);
+	nes_unload_rom(nes);
+	return 0;
+}
+
+static int print_state_crc(NES* nes)
+{
+	/* Identical replays end in identical states */
+	size_t size = nes_state_size(nes);
+	uint8_t* state = (uint8_t*)malloc(size);
+	if (!state)
+	{
+		fprintf(stderr, "Error: unable to allocate state\n");
+		return -1;
+	}
+	nes_save_state(nes, state, size);
+	printf("%08X\n", crc32_update(0, state, size));
+	free(state);
+	return 0;
+}
+
+static int play_movie(NES* nes, Options* opts)
+{
+	Movie movie;
+	clock_t start;
+	int ret;
+
+	if (movie_load(&movie, opts->movie_path) != 0)
+		return -1;
+	if (nes_load_rom(nes, opts->in_path) != 0)
+	{
+		movie_free(&movie);
+		return -1;
+	}
+	if (movie_play(&movie, nes) != 0)
+	{
+		nes_unload_rom(nes);
+		movie_free(&movie);
+		return -1;
+	}
+
+	start = clock();
+	while (!movie_finished(&movie, nes))
+		nes_run_frame(nes);
+	apu_flush(&nes->apu);
+	report_speed("input", movie.frame_count / 60.0, start);
+
+	ret = print_state_crc(nes);
+	movie_stop(&movie, nes);
+	movie_free(&movie);
+	nes_unload_rom(nes);
+	return ret;
+}
+
+static int verify_movie(NES* nes, Options* opts)
+{
+	/* Timed by the wall clock, like pools */
+	Movie movie;
+	MovieVerification result;
+	double start, elapsed;
+	int ret;
+
+	if (movie_load(&movie, opts->movie_path) != 0)
+		return -1;
+	if (nes_load_rom(nes, opts->in_path) != 0)
+	{
+		movie_free(&movie);
+		return -1;
+	}
+
+	/* Only attached to check the ROM. The segments run on forks */
+	ret = movie_play(&movie, nes);
+	if (ret == 0)
+	{
+		start = wall_time();
+		ret = movie_verify(&movie, nes, 0, &result);
+		elapsed = wall_time() - start;
+	}
+	if (ret == 0)
+	{
+		fprintf(stderr, "Verified %u segments (%.1fs of input) in %.2fs: %u mismatched\n",
+				result.segments, movie.keyframes[movie.keyframe_count - 1].frame / 60.0,
+				elapsed, result.mismatches);
+		if (result.mismatches)
+		{
+			fprintf(stderr, "First mismatch at frame %u\n", result.first_mismatch);
+			ret = -1;
+		}
+	}
+	movie_stop(&movie, nes);
+	movie_free(&movie);
+	nes_unload_rom(nes);
+	return ret;
+}
+
+static int run_pool(Options* opts, CartridgeDB* db)
+{
+	/* clock() counts every thread's time, so parallel runs are timed by
+	   the wall clock */
+	NESPool pool;
+	NESPoolInfo info;
+	double start, elapsed;
+	uint32_t i;
+	int frame;
+
+	memset(&info, 0, sizeof(info));
+	info.instances = opts->instances;
+	info.audio_spec = opts->audio_spec;
+	info.cart_db = db;
+	info.no_framebuffer = 1;
+	info.no_audio = 1;
+	if (nes_pool_init(&pool, &info) != 0)
+		return -1;
+	for (i = 0; i < pool.count; ++i)
+	{
+		if (nes_pool_load_rom(&pool, i, opts->in_path) != 0 ||
+			(opts->boot_frames && nes_pool_boot(&pool, i, opts->cache_dir, opts->boot_frames) != 0))
+		{
+			nes_pool_cleanup(&pool);
+			return -1;
+		}
+	}
+
+	start = wall_time();
+	for (frame = 0; frame < opts->frames; ++frame)
+		nes_pool_run_frame(&pool);
+	elapsed = wall_time() - start;
+	fprintf(stderr, "Ran %u instances for %.1fs each on %u threads in %.2fs (%.0fx realtime in total)\n",
+			pool.count, opts->frames / 60.0, pool.threads, elapsed,
+			elapsed > 0 ? pool.count * opts->frames / 60.0 / elapsed : 0.0);
+	nes_pool_cleanup(&pool);
+	return 0;
+}
+
+static uint8_t next_buttons(uint32_t* seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return (*seed >> 16) & 0xFF;
+}
+
+static int run_netplay(Options* opts, CartridgeDB* db)
+{
+	/* Both peers tick in turn, like two machines in lockstep. Each player
+	   holds random buttons for 8 frames at a time, which keeps predictions
+	   failing regularly */
+	NES* nes[2];
+	Netplay* np[2];
+	NESInitInfo init_info;
+	NetplayInfo info;
+	uint32_t seeds[2] = {1, 2};
+	uint8_t buttons[2] = {0, 0};
+	double start, elapsed, worst = 0;
+	uint32_t slow = 0, ticks = 0, limit, i;
+	int ret = 0;
+
+	memset(&init_info, 0, sizeof(init_info));
+	init_info.cart_db = db;
+	init_info.no_framebuffer = 1;
+	init_info.no_audio = 1;
+	init_info.volatile_nvram = 1;
+	nes[0] = nes[1] = NULL;
+	np[0] = np[1] = NULL;
+	for (i = 0; i < 2 && ret == 0; ++i)
+	{
+		memset(&info, 0, sizeof(info));
+		info.player = (uint8_t)i;
+		info.sim_latency = opts->net_latency;
+		info.sim_loss = (uint8_t)opts->net_loss;
+		info.sim_seed = i + 1;
+		if (!(nes[i] = (NES*)malloc(sizeof(NES))))
+		{
+			fprintf(stderr, "Error: unable to allocate NES\n");
+			ret = -1;
+		}
+		else if (nes_init(nes[i], &init_info) != 0)
+		{
+			free(nes[i]);
+			nes[i] = NULL;
+			ret = -1;
+		}
+		else if (nes_load_rom(nes[i], opts->in_path) != 0)
+		{
+			nes_cleanup(nes[i]);
+			free(nes[i]);
+			nes[i] = NULL;
+			ret = -1;
+		}
+		else if (!(np[i] = (Netplay*)malloc(sizeof(Netplay))))
+		{
+			fprintf(stderr, "Error: unable to allocate netplay session\n");
+			ret = -1;
+		}
+		else if (netplay_init(np[i], nes[i], &info) != 0)
+		{
+			free(np[i]);
+			np[i] = NULL;
+			ret = -1;
+		}
+	}
+	if (ret == 0 && (netplay_connect(np[0], "127.0.0.1", netplay_local_port(np[1])) != 0 ||
+					 netplay_connect(np[1], "127.0.0.1", netplay_local_port(np[0])) != 0))
+	{
+		ret = -1;
+	}
+
+	/* Keep going with no input after the last frame, until both sides have
+	   compared its checkpoints (or given up waiting) */
+	start = wall_time();
+	limit = opts->frames * 4 + 600;
+	while (ret == 0 && ticks < limit &&
+		   (np[0]->frame < (uint32_t)opts->frames || np[1]->frame < (uint32_t)opts->frames ||
+			np[0]->stats.checks < (uint32_t)opts->frames / NETPLAY_CHECK_INTERVAL ||
+			np[1]->stats.checks < (uint32_t)opts->frames / NETPLAY_CHECK_INTERVAL))
+	{
+		for (i = 0; i < 2 && ret == 0; ++i)
+		{
+			double tick_start = wall_time(), tick_time;
+			if (np[i]->frame >= (uint32_t)opts->frames)
+				buttons[i] = 0;
+			else if (np[i]->local_end % 8 == 0)
+				buttons[i] = next_buttons(&seeds[i]);
+			if (netplay_tick(np[i], buttons[i]) < 0)
+				ret = -1;
+			tick_time = wall_time() - tick_start;
+			if (tick_time > worst)
+				worst = tick_time;
+			if (tick_time > 1.0 / 60)
+				++slow;
+		}
+		++ticks;
+	}
+	elapsed = wall_time() - start;
+
+	if (ret == 0)
+	{
+		for (i = 0; i < 2; ++i)
+		{
+			NetplayStats* stats = &np[i]->stats;
+			fprintf(stderr, "Player %u: %u rollbacks (at most %u frames, %llu in total), %u stalls, "
+					"%u/%u checkpoints matched, %u/%u packets dropped\n",
+					i + 1, stats->rollbacks, stats->max_rollback, (unsigned long long)stats->resimulated,
+					stats->stalls, stats->checks - stats->desyncs, stats->checks, stats->dropped, stats->sent);
+			if (stats->desyncs || !stats->checks)
+				ret = -1;
+		}
+		fprintf(stderr, "Ran %u ticks in %.2fs: slowest %.2fms, %u over the 16.7ms frame budget\n",
+				ticks, elapsed, worst * 1000, slow);
+		if (ticks == limit)
+		{
+			fprintf(stderr, "Error: netplay session stopped making progress\n");
+			ret = -1;
+		}
+	}
+
+	for (i = 0; i < 2; ++i)
+	{
+		if (np[i])
+		{
+			netplay_cleanup(np[i]);
+			free(np[i]);
+		}
+		if (nes[i])
+		{
+			nes_unload_rom(nes[i]);
+			nes_cleanup(nes[i]);
+			free(nes[i]);
+		}
+	}
+	return ret;
+}
+
+int main(int argc, char** argv)
+{
+	NES* nes;
+	NESInitInfo init_info;
+	CartridgeDB db;
+	Options opts;
+	Recorder* rec = NULL;
+	Recorder* stem_rec = NULL;
+	int frame_count = 0;
+	int nsf, ret;
+
+	if (parse_options(&opts, argc, argv) != 0)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+	if (opts.index_path)
+		return list_library(&opts) == 0 ? 0 : 1;
+
+	nsf = is_nsf(opts.in_path);
+	if (nsf && !opts.out_path && !opts.stem_path)
+		opts.out_path = "out.wav";
+
+	memset(&db, 0, sizeof(db));
+	if (opts.db_path && cartdb_load(&db, opts.db_path) != 0)
+		return 1;
+	if (nsf && opts.boot_frames)
+	{
+		fprintf(stderr, "Error: NSF files can't be booted from the cache\n");
+		cartdb_free(&db);
+		return 1;
+	}
+	if (opts.movie_path && (nsf || opts.instances > 0 || opts.boot_frames))
+	{
+		fprintf(stderr, "Error: movies can only be played back on a single NES, from power-on\n");
+		cartdb_free(&db);
+		return 1;
+	}
+	if (opts.netplay && (nsf || opts.instances > 0 || opts.boot_frames || opts.movie_path))
+	{
+		fprintf(stderr, "Error: netplay sessions can only run ROMs from power-on\n");
+		cartdb_free(&db);
+		return 1;
+	}
+	if (opts.netplay)
+	{
+		ret = run_netplay(&opts, &db);
+		cartdb_free(&db);
+		return ret == 0 ? 0 : 1;
+	}
+	if (opts.instances > 0)
+	{
+		ret = nsf ? -1 : run_pool(&opts, &db);
+		if (nsf)
+			fprintf(stderr, "Error: NSF files can't be run in parallel\n");
+		cartdb_free(&db);
+		return ret == 0 ? 0 : 1;
+	}
+
+	/* NES instances are large. Keep this one off the stack */
+	if (!(nes = (NES*)malloc(sizeof(NES))))
+	{
+		fprintf(stderr, "Error: unable to allocate NES\n");
+		cartdb_free(&db);
+		return 1;
+	}
+	memset(&init_info, 0, sizeof(init_info));
+	init_info.render_cb = count_frame;
+	init_info.render_userdata = &frame_count;
+	init_info.audio_spec = opts.audio_spec;
+	init_info.cart_db = &db;
+	init_info.no_framebuffer = 1;  /* Frames are only counted */
+	init_info.no_audio = !opts.out_path && !opts.stem_path;
+	init_info.volatile_nvram = opts.movie_path || opts.boot_frames;  /* Movies and cached states start from blank saves */
+	if (nes_init(nes, &init_info) != 0)
+	{
+		free(nes);
+		cartdb_free(&db);
+		return 1;
+	}
+
+	if (opts.out_path)
+	{
+		if (!(rec = open_recorder(opts.out_path, nes->apu.spec.sample_rate, nes->apu.spec.channels)))
+		{
+			nes_cleanup(nes);
+			free(nes);
+			cartdb_free(&db);
+			return 1;
+		}
+		apu_set_recorder(&nes->apu, rec);
+	}
+	if (opts.stem_path)
+	{
+		if (!(stem_rec = open_recorder(opts.stem_path, nes->apu.spec.sample_rate, APU_STEM_CHANNELS)) ||
+			apu_set_stem_recorder(&nes->apu, stem_rec) != 0)
+		{
+			if (stem_rec)
+				recorder_close(stem_rec);
+			if (rec)
+				recorder_close(rec);
+			nes_cleanup(nes);
+			free(nes);
+			cartdb_free(&db);
+			return 1;
+		}
+	}
+
+	if (nsf)
+		ret = render_nsf(nes, &opts);
+	else if (opts.movie_path)
+		ret = opts.verify ? verify_movie(nes, &opts) : play_movie(nes, &opts);
+	else
+		ret = run_rom(nes, &opts, &frame_count);
+	if (rec && recorder_close(rec) != 0)
+		ret = -1;
+	if (stem_rec && recorder_close(stem_rec) != 0)
+		ret = -1;
+
+	nes_cleanup(nes);
+	free(nes);
+	cartdb_free(&db);
+	return ret == 0 ? 0 : 1;
+}
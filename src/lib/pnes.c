@@ -0,0 +1,150 @@
+/* Shared library front end. Wraps an NES in an opaque handle and exposes
+   its output as views, so callers never copy frames or samples per call */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../core/nes.h"
+#include "pnes.h"
+
+/* Buffers are flushed every frame, so they only need to hold one frame's
+   worth of samples. Sized for 50 frames per second, with room to spare */
+#define AUDIO_BUFFER_FRAMES_PER_SECOND 50
+
+struct PNES {
+	NES nes;
+	uint8_t loaded;
+	uint8_t buttons[2];
+	const void* audio;  /* Samples handed off by the last frame */
+	uint32_t audio_frames;
+};
+
+static void on_sound(void* read_buf, uint32_t buf_size, void* userdata)
+{
+	PNES* pnes = (PNES*)userdata;
+	pnes->audio = read_buf;
+	pnes->audio_frames = buf_size;
+}
+
+static void apply_input(Controller* c, uint8_t buttons)
+{
+	uint8_t i;
+	for (i = 0; i < 8; ++i)
+		controller_set_button(c, (ControllerButton)(1 << i), (buttons >> i) & 1);
+}
+
+PNES* pnes_create(const PNESConfig* config)
+{
+	PNESConfig defaults;
+	NESInitInfo init_info;
+	PNES* pnes;
+
+	if (!config)
+	{
+		memset(&defaults, 0, sizeof(defaults));
+		config = &defaults;
+	}
+	if (!(pnes = (PNES*)calloc(1, sizeof(PNES))))
+	{
+		fprintf(stderr, "Error: unable to allocate emulator (code %d)\n", errno);
+		return NULL;
+	}
+
+	memset(&init_info, 0, sizeof(init_info));
+	init_info.snd_cb = on_sound;
+	init_info.snd_userdata = pnes;
+	init_info.audio_spec.format = (config->audio_format == PNES_AUDIO_F32) ? AUDIO_FORMAT_F32 : AUDIO_FORMAT_S16;
+	init_info.audio_spec.sample_rate = config->sample_rate;
+	init_info.audio_spec.channels = config->channels;
+	init_info.audio_spec.buffer_size = (config->sample_rate ? config->sample_rate : APU_SAMPLE_RATE) /
+									   AUDIO_BUFFER_FRAMES_PER_SECOND + 1;
+	init_info.no_audio = (config->audio_format == PNES_AUDIO_NONE);
+	init_info.no_framebuffer = config->no_video;
+	init_info.volatile_nvram = !config->keep_saves;
+	if (nes_init(&pnes->nes, &init_info) != 0)
+	{
+		free(pnes);
+		return NULL;
+	}
+	return pnes;
+}
+
+void pnes_destroy(PNES* pnes)
+{
+	if (!pnes)
+		return;
+	if (pnes->loaded)
+		nes_unload_rom(&pnes->nes);
+	nes_cleanup(&pnes->nes);
+	free(pnes);
+}
+
+int pnes_load_rom(PNES* pnes, const char* path)
+{
+	if (pnes->loaded)
+		nes_unload_rom(&pnes->nes);
+	pnes->loaded = (nes_load_rom(&pnes->nes, (char*)path) == 0);
+	pnes->audio_frames = 0;
+	return pnes->loaded ? 0 : -1;
+}
+
+int pnes_load_rom_memory(PNES* pnes, const void* image, size_t size)
+{
+	if (pnes->loaded)
+		nes_unload_rom(&pnes->nes);
+	pnes->loaded = (nes_load_rom_memory(&pnes->nes, image, size) == 0);
+	pnes->audio_frames = 0;
+	return pnes->loaded ? 0 : -1;
+}
+
+void pnes_set_input(PNES* pnes, int port, uint8_t buttons)
+{
+	pnes->buttons[port & 1] = buttons;
+}
+
+int pnes_run_frame(PNES* pnes)
+{
+	/* The APU is flushed at the end of each frame, so the one buffer handed
+	   off holds exactly the samples produced during it */
+	if (!pnes->loaded)
+		return -1;
+	pnes->audio_frames = 0;
+	apply_input(&pnes->nes.c1, pnes->buttons[0]);
+	apply_input(&pnes->nes.c2, pnes->buttons[1]);
+	nes_run_frame(&pnes->nes);
+	if (pnes->nes.apu.mix_buf)
+		apu_flush(&pnes->nes.apu);
+	return 0;
+}
+
+const uint32_t* pnes_video(PNES* pnes)
+{
+	return pnes->nes.ppu.framebuffer;
+}
+
+const void* pnes_audio(PNES* pnes, uint32_t* frames)
+{
+	*frames = pnes->audio_frames;
+	return pnes->audio_frames ? pnes->audio : NULL;
+}
+
+size_t pnes_state_size(PNES* pnes)
+{
+	return nes_state_size(&pnes->nes);
+}
+
+int pnes_save_state(PNES* pnes, void* buf, size_t size)
+{
+	if (!pnes->loaded)
+		return -1;
+	return nes_save_state(&pnes->nes, buf, size);
+}
+
+int pnes_load_state(PNES* pnes, const void* buf, size_t size)
+{
+	if (!pnes->loaded)
+		return -1;
+	return nes_load_state(&pnes->nes, buf, size);
+}
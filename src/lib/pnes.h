@@ -0,0 +1,79 @@
+#ifndef PNES_H
+#define PNES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Stable C interface to the emulator, for embedding it (e.g., from other
+   languages). Instances are opaque handles, so nothing here depends on the
+   layout of the emulator's internals */
+
+#if defined(PNES_BUILD) && defined(__GNUC__)
+#define PNES_API __attribute__((visibility("default")))
+#else
+#define PNES_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PNES_WIDTH 256
+#define PNES_HEIGHT 240
+
+/* Controller buttons, as flags */
+#define PNES_BUTTON_A 1
+#define PNES_BUTTON_B 2
+#define PNES_BUTTON_SELECT 4
+#define PNES_BUTTON_START 8
+#define PNES_BUTTON_UP 16
+#define PNES_BUTTON_DOWN 32
+#define PNES_BUTTON_LEFT 64
+#define PNES_BUTTON_RIGHT 128
+
+typedef struct PNES PNES;
+
+typedef enum {
+	PNES_AUDIO_S16 = 0,  /* Default */
+	PNES_AUDIO_F32,
+	PNES_AUDIO_NONE      /* Don't produce samples at all */
+} PNESAudioFormat;
+
+/* Zeroed fields select the defaults */
+typedef struct {
+	PNESAudioFormat audio_format;
+	uint32_t sample_rate;  /* Default: the APU's native rate */
+	uint8_t channels;      /* 1 (mono) or 2 (stereo). Default: 1 */
+	uint8_t no_video;      /* Don't draw frames (pnes_video returns NULL) */
+	uint8_t keep_saves;    /* Map battery-backed RAM from a save file next to ROMs loaded by path */
+} PNESConfig;
+
+PNES_API PNES* pnes_create(const PNESConfig* config);  /* NULL config for defaults. NULL on failure */
+PNES_API void pnes_destroy(PNES* nes);  /* Does nothing for NULL */
+
+/* Any previously loaded ROM is unloaded first. 0 on success */
+PNES_API int pnes_load_rom(PNES* nes, const char* path);
+PNES_API int pnes_load_rom_memory(PNES* nes, const void* image, size_t size);  /* Copied */
+
+/* Buttons (PNES_BUTTON_* flags) held from the next frame on, for port 0 or 1 */
+PNES_API void pnes_set_input(PNES* nes, int port, uint8_t buttons);
+PNES_API int pnes_run_frame(PNES* nes);  /* -1 if no ROM is loaded */
+
+/* Views of the last frame's output, owned by the instance. The frame stays
+   valid until the instance is destroyed, but is redrawn by each
+   pnes_run_frame. The samples are replaced by each pnes_run_frame */
+PNES_API const uint32_t* pnes_video(PNES* nes);  /* 256x240 pixels, 0xRRGGBBAA */
+PNES_API const void* pnes_audio(PNES* nes, uint32_t* frames);  /* Interleaved sample frames */
+
+/* Save states. A state can only be loaded by an instance running the same
+   ROM, with the same version of the library. The size can change from
+   frame to frame, so query it right before saving */
+PNES_API size_t pnes_state_size(PNES* nes);
+PNES_API int pnes_save_state(PNES* nes, void* buf, size_t size);
+PNES_API int pnes_load_state(PNES* nes, const void* buf, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
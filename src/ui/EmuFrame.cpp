@@ -4,9 +4,33 @@ extern "C" {
 
 #include "EmuFrame.h"
 
+enum {
+    ID_RECORD_AUDIO = wxID_HIGHEST + 1,
+    ID_RECORD_MOVIE,
+    ID_AUDIO_FILTER
+};
+
 static void sdlAudioCallback(void* userdata, uint8_t* stream, int len)
 {
-    static_cast<EmuFrame*>(userdata)->outputAudio((uint16_t*)stream, len/2);
+    static_cast<EmuFrame*>(userdata)->outputAudio(stream, len);
+}
+
+static bool toAudioFormat(SDL_AudioFormat sdlFormat, AudioFormat* format)
+{
+    switch (sdlFormat)
+    {
+        case AUDIO_U16SYS:
+            *format = AUDIO_FORMAT_U16;
+            return true;
+        case AUDIO_S16SYS:
+            *format = AUDIO_FORMAT_S16;
+            return true;
+        case AUDIO_F32SYS:
+            *format = AUDIO_FORMAT_F32;
+            return true;
+        default:
+            return false;
+    }
 }
 
 EmuFrame::EmuFrame(const wxString& title, const wxPoint& pos, const wxSize& size, std::string romPath="")
@@ -14,6 +38,9 @@ EmuFrame::EmuFrame(const wxString& title, const wxPoint& pos, const wxSize& size
 {
 	wxMenu* menuFile = new wxMenu;
     menuFile->Append(wxID_OPEN, "&Open");
+    menuFile->AppendCheckItem(ID_RECORD_AUDIO, "&Record Audio...");
+    menuFile->AppendCheckItem(ID_RECORD_MOVIE, "Record &Movie...");
+    menuFile->AppendCheckItem(ID_AUDIO_FILTER, "Audio &Filter");
     menuFile->Append(wxID_EXIT, "E&xit");
 
     wxMenu* menuHelp = new wxMenu;
@@ -23,6 +50,7 @@ EmuFrame::EmuFrame(const wxString& title, const wxPoint& pos, const wxSize& size
     menuBar->Append(menuFile, "&File");
     menuBar->Append(menuHelp, "&Help");
     SetMenuBar(menuBar);
+    menuBar->Check(ID_AUDIO_FILTER, true);
 
     DragAcceptFiles(true);
 
@@ -31,17 +59,32 @@ EmuFrame::EmuFrame(const wxString& title, const wxPoint& pos, const wxSize& size
 
     // TODO: adjustable in GUI
     SDL_AudioSpec desired, obtained;
-    desired.freq = 44100;
-    desired.format = AUDIO_U16SYS;
-    desired.channels = 1;  // TODO: stereo experimentation
+    desired.freq = 48000;
+    desired.format = AUDIO_S16SYS;
+    desired.channels = 2;
     desired.samples = 2048;
     desired.callback = sdlAudioCallback;
     desired.userdata = this;
     bufferedAudio = NULL;
 
+    // The emulator outputs whatever the device wants, so SDL doesn't have to convert
     // TODO: error checking
     SDL_Init(SDL_INIT_AUDIO);
     SDL_OpenAudio(&desired, &obtained);
+    if (obtained.channels > 2 || !toAudioFormat(obtained.format, &audioSpec.format))
+    {
+        SDL_CloseAudio();
+        SDL_OpenAudio(&desired, NULL);
+        obtained = desired;
+        toAudioFormat(obtained.format, &audioSpec.format);
+    }
+    audioSpec.filter = AUDIO_FILTER_NES;
+    audioSpec.sample_rate = obtained.freq;
+    audioSpec.channels = obtained.channels;
+    audioSpec.buffer_size = obtained.samples;
+    for (int i = 0; i < AUDIO_PAN_CHANNELS; ++i)
+        audioSpec.pan[i] = 0.0f;
+    audioFrameSize = audioSpec.channels * audio_sample_size(audioSpec.format);
 	if (!romPath.empty())
 		startEmulation(romPath);
 }
@@ -57,7 +100,7 @@ void EmuFrame::startEmulation(std::string romPath)
 {
     // TODO: error checking (file actually NES ROM)
     stopEmulation();
-    emuThread = new EmulationThread(this, canvas, romPath);
+    emuThread = new EmulationThread(this, canvas, romPath, audioSpec);
     emuThread->Run();
 	SDL_PauseAudio(0);
 }
@@ -65,6 +108,8 @@ void EmuFrame::startEmulation(std::string romPath)
 void EmuFrame::stopEmulation()
 {
 	setAudioBuf(NULL, 0);
+    GetMenuBar()->Check(ID_RECORD_AUDIO, false);
+    GetMenuBar()->Check(ID_RECORD_MOVIE, false);
 	SDL_PauseAudio(1);
     if (emuThread)
     {
@@ -81,29 +126,32 @@ void EmuFrame::exit()
     Destroy();
 }
 
-void EmuFrame::setAudioBuf(uint16_t* buf, uint32_t bufSize)
+void EmuFrame::setAudioBuf(void* buf, uint32_t bufSize)
 {
     audioMutex.Lock();
-    bufferedAudio = buf;
-    audioBufSize = bufSize;
+    bufferedAudio = static_cast<uint8_t*>(buf);
+    audioBufSize = bufSize * audioFrameSize;
     audioBufPos = 0;
     audioMutex.Unlock();
 }
 
-void EmuFrame::outputAudio(uint16_t* stream, int len)
+void EmuFrame::outputAudio(uint8_t* stream, int len)
 {
     audioMutex.Lock();
     if (bufferedAudio)
     {
-        for (int i = 0; i < len; ++i)
+        while (len > 0)
         {
-            stream[i] = bufferedAudio[audioBufPos];
-            audioBufPos = (audioBufPos + 1) % audioBufSize;
+            int n = std::min<int>(len, audioBufSize - audioBufPos);
+            memcpy(stream, bufferedAudio + audioBufPos, n);
+            audioBufPos = (audioBufPos + n) % audioBufSize;
+            stream += n;
+            len -= n;
         }
     }
     else
     {
-        memset(stream, 0, len * 2);
+        memset(stream, 0, len);
     }
     audioMutex.Unlock();
 }
@@ -129,6 +177,58 @@ void EmuFrame::onFileOpen(wxCommandEvent& evt)
         startEmulation(diag.GetPath().ToStdString());
 }
 
+void EmuFrame::onRecordAudio(wxCommandEvent& evt)
+{
+    if (!emuThread)
+    {
+        GetMenuBar()->Check(ID_RECORD_AUDIO, false);
+        return;
+    }
+    if (emuThread->isRecording())
+    {
+        emuThread->stopRecording();
+        GetMenuBar()->Check(ID_RECORD_AUDIO, false);
+        return;
+    }
+
+    long style = wxFD_SAVE | wxFD_OVERWRITE_PROMPT;
+    std::string wildcard = "WAV files (*.wav)|*.wav|Raw PCM files (*.raw)|*.raw";
+    wxFileDialog diag(this, "Record audio to", "", "", wildcard, style);
+    bool recording = diag.ShowModal() == wxID_OK &&
+                     emuThread->startRecording(diag.GetPath().ToStdString());
+    GetMenuBar()->Check(ID_RECORD_AUDIO, recording);
+}
+
+void EmuFrame::onRecordMovie(wxCommandEvent& evt)
+{
+    if (!emuThread)
+    {
+        GetMenuBar()->Check(ID_RECORD_MOVIE, false);
+        return;
+    }
+    if (emuThread->isRecordingMovie())
+    {
+        emuThread->stopMovieRecording();
+        GetMenuBar()->Check(ID_RECORD_MOVIE, false);
+        return;
+    }
+
+    // Recording restarts the game, since movies are played back from power-on
+    long style = wxFD_SAVE | wxFD_OVERWRITE_PROMPT;
+    std::string wildcard = "FM2 movies (*.fm2)|*.fm2";
+    wxFileDialog diag(this, "Record movie to", "", "", wildcard, style);
+    bool recording = diag.ShowModal() == wxID_OK &&
+                     emuThread->startMovieRecording(diag.GetPath().ToStdString());
+    GetMenuBar()->Check(ID_RECORD_MOVIE, recording);
+}
+
+void EmuFrame::onAudioFilter(wxCommandEvent& evt)
+{
+    audioSpec.filter = evt.IsChecked() ? AUDIO_FILTER_NES : AUDIO_FILTER_NONE;
+    if (emuThread)
+        emuThread->setAudioFilter(audioSpec.filter);
+}
+
 void EmuFrame::onDropFiles(wxDropFilesEvent& evt)
 {
     std::string path = evt.GetFiles()[0].ToStdString();
@@ -149,6 +249,9 @@ wxBEGIN_EVENT_TABLE(EmuFrame, wxFrame)
     EVT_KEY_DOWN(EmuFrame::onKeyDown)
     EVT_KEY_UP(EmuFrame::onKeyUp)
     EVT_MENU(wxID_OPEN, EmuFrame::onFileOpen)
+    EVT_MENU(ID_RECORD_AUDIO, EmuFrame::onRecordAudio)
+    EVT_MENU(ID_RECORD_MOVIE, EmuFrame::onRecordMovie)
+    EVT_MENU(ID_AUDIO_FILTER, EmuFrame::onAudioFilter)
     EVT_DROP_FILES(EmuFrame::onDropFiles)
     EVT_MENU(wxID_EXIT, EmuFrame::onExit)
     EVT_CLOSE(EmuFrame::onClose)
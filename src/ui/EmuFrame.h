@@ -1,6 +1,7 @@
 #ifndef EMUFRAME_H
 #define EMUFRAME_H
 
+#include <algorithm>
 #include <cstdint>
 #include <string>
 
@@ -13,13 +14,15 @@ class EmuFrame : public wxFrame {
 	public:
         EmuFrame(const wxString& title, const wxPoint& pos, const wxSize& size, std::string romPath);
         virtual ~EmuFrame();
-        void setAudioBuf(uint16_t* buf, uint32_t bufSize);
-        void outputAudio(uint16_t* stream, int len);
+        void setAudioBuf(void* buf, uint32_t bufSize);
+        void outputAudio(uint8_t* stream, int len);
 	private:
         Canvas* canvas;
         EmulationThread* emuThread;
-        uint16_t* bufferedAudio;
-        uint32_t audioBufSize;
+        AudioSpec audioSpec;
+        uint32_t audioFrameSize;
+        uint8_t* bufferedAudio;
+        uint32_t audioBufSize;  // In bytes
         uint32_t audioBufPos;
         wxMutex audioMutex;
 
@@ -30,6 +33,9 @@ class EmuFrame : public wxFrame {
         void onKeyDown(wxKeyEvent& evt);
         void onKeyUp(wxKeyEvent& evt);
         void onFileOpen(wxCommandEvent& evt);
+        void onRecordAudio(wxCommandEvent& evt);
+        void onRecordMovie(wxCommandEvent& evt);
+        void onAudioFilter(wxCommandEvent& evt);
         void onDropFiles(wxDropFilesEvent& evt);
         void onExit(wxCommandEvent& evt);
         void onClose(wxCloseEvent& evt);
@@ -6,25 +6,38 @@ static void frameUpdateCallback(uint32_t* frame, void* userdata)
     static_cast<Canvas*>(userdata)->updateFrame(frame);
 }
 
-static void emuAudioCallback(uint16_t* readBuf, uint32_t bufSize, void* userdata)
+static void emuAudioCallback(void* readBuf, uint32_t bufSize, void* userdata)
 {
     static_cast<EmuFrame*>(userdata)->setAudioBuf(readBuf, bufSize);
 }
 
-EmulationThread::EmulationThread(EmuFrame* parentFrame, Canvas* renderCanvas, std::string romPath)
+EmulationThread::EmulationThread(EmuFrame* parentFrame, Canvas* renderCanvas, std::string romPath, AudioSpec audioSpec)
     : wxThread(wxTHREAD_JOINABLE)
 {
     // TODO: error checking
-    NESInitInfo init_info;
-    init_info.render_cb = frameUpdateCallback;
-    init_info.render_userdata = renderCanvas;
-    init_info.snd_cb = emuAudioCallback;
-    init_info.snd_userdata = parentFrame;
-    nes_init(&nes, &init_info);
-    nes_load_rom(&nes, const_cast<char*>(romPath.c_str()));
+    memset(&initInfo, 0, sizeof(initInfo));
+    initInfo.render_cb = frameUpdateCallback;
+    initInfo.render_userdata = renderCanvas;
+    initInfo.snd_cb = emuAudioCallback;
+    initInfo.snd_userdata = parentFrame;
+    initInfo.audio_spec = audioSpec;
+    nesReady = nes_init(&nes, &initInfo) == 0;
+    romLoaded = nesReady && nes_load_rom(&nes, const_cast<char*>(romPath.c_str())) == 0;
+    nes_set_latch_callback(&nes, latchCallback, this);
+    this->parentFrame = parentFrame;
+    this->romPath = romPath;
+    this->recorder = NULL;
+    this->recordingMovie = false;
+    this->buttons = 0;
     this->stoppingEmulation = false;
 }
 
+void EmulationThread::latchCallback(NES* nes, void* userdata)
+{
+    // Input only reaches the game when it latches the controllers
+    controller_set_buttons(&nes->c1, static_cast<EmulationThread*>(userdata)->buttons);
+}
+
 wxThread::ExitCode EmulationThread::Entry()
 {
     // TODO: error checking
@@ -38,14 +51,25 @@ wxThread::ExitCode EmulationThread::Entry()
         // TODO: better frame limiting
         wxLongLong cyclesNeeded = (wxGetUTCTimeMillis() - startMS) * cyclesPerMS;
         emuMutex.Lock();
-        while (cyclesEmulated < cyclesNeeded)
+        while (romLoaded && cyclesEmulated < cyclesNeeded)
+        {
             cyclesEmulated += nes_update(&nes);
+            if (recordingMovie)
+                movie_update(&movie, &nes);
+        }
 		//wxMilliSleep(1); // TODO: experiment
-        running = !stoppingEmulation;
+        running = !stoppingEmulation && romLoaded;
         emuMutex.Unlock();
     }
-    nes_unload_rom(&nes);
-    nes_cleanup(&nes);
+    stopRecording();
+    emuMutex.Lock();
+    if (recordingMovie)
+        finishMovie();
+    emuMutex.Unlock();
+    if (romLoaded)
+        nes_unload_rom(&nes);
+    if (nesReady)
+        nes_cleanup(&nes);
     running = false;
     return NULL;
 }
@@ -83,11 +107,138 @@ void EmulationThread::updateController(int wxKey, bool pressed)
     if (btn != CONTROLLER_NONE)
     {
         emuMutex.Lock();
-        controller_set_button(&nes.c1, btn, pressed);
+        buttons = pressed ? (buttons | btn) : (buttons & ~btn);
+        if (recordingMovie)
+            movie_set_buttons(&movie, 0, buttons);
         emuMutex.Unlock();
     }
 }
 
+bool EmulationThread::startRecording(std::string path)
+{
+    // Recording never blocks emulation. Samples are dropped if the disk can't keep up
+    RecorderFormat format = path.size() > 4 && path.compare(path.size() - 4, 4, ".raw") == 0 ?
+                            RECORDER_RAW : RECORDER_WAV;
+    Recorder* rec = recorder_open(path.c_str(), format, nes.apu.spec.sample_rate, nes.apu.spec.channels, 0);
+    if (!rec)
+        return false;
+
+    stopRecording();
+    emuMutex.Lock();
+    recorder = rec;
+    apu_set_recorder(&nes.apu, rec);
+    emuMutex.Unlock();
+    return true;
+}
+
+void EmulationThread::stopRecording()
+{
+    emuMutex.Lock();
+    Recorder* rec = recorder;
+    recorder = NULL;
+    apu_set_recorder(&nes.apu, NULL);
+    emuMutex.Unlock();
+
+    // The writer thread is joined outside of the lock so emulation can continue
+    if (rec)
+        recorder_close(rec);
+}
+
+bool EmulationThread::isRecording()
+{
+    bool recording;
+    emuMutex.Lock();
+    recording = recorder != NULL;
+    emuMutex.Unlock();
+    return recording;
+}
+
+bool EmulationThread::restartGame(bool volatileSaves)
+{
+    // Called with the lock held. The frame's audio points into the buffers freed here, so it is cleared first
+    parentFrame->setAudioBuf(NULL, 0);
+    if (romLoaded)
+        nes_unload_rom(&nes);
+    if (nesReady)
+        nes_cleanup(&nes);
+
+    initInfo.volatile_nvram = volatileSaves;
+    nesReady = nes_init(&nes, &initInfo) == 0;
+    romLoaded = nesReady && nes_load_rom(&nes, const_cast<char*>(romPath.c_str())) == 0;
+    if (nesReady)
+    {
+        apu_set_recorder(&nes.apu, recorder);
+        nes_set_latch_callback(&nes, latchCallback, this);
+    }
+    return romLoaded;
+}
+
+bool EmulationThread::finishMovie()
+{
+    // Called with the lock held. The frame is finished so the movie ends on a keyframe, for verification
+    std::string romName = romPath.substr(romPath.find_last_of("/\\") + 1);
+    nes_run_frame(&nes);
+    movie_add_keyframe(&movie, &nes);
+    movie_stop(&movie, &nes);
+    bool saved = movie_save(&movie, moviePath.c_str(), romName.c_str()) == 0;
+    movie_free(&movie);
+    nes_set_latch_callback(&nes, latchCallback, this);
+    recordingMovie = false;
+    return saved;
+}
+
+bool EmulationThread::startMovieRecording(std::string path)
+{
+    // Movies are played back from power-on with blank saves, so the game is restarted that way
+    emuMutex.Lock();
+    if (recordingMovie)
+        finishMovie();
+    bool started = restartGame(true) && movie_record(&movie, &nes) == 0;
+    if (started)
+    {
+        movie_set_buttons(&movie, 0, buttons);
+        moviePath = path;
+    }
+    else if (romLoaded)
+    {
+        restartGame(false);
+    }
+    recordingMovie = started;
+    emuMutex.Unlock();
+    return started;
+}
+
+bool EmulationThread::stopMovieRecording()
+{
+    // The saves were only kept in memory for the movie, so the game restarts with its save file again
+    emuMutex.Lock();
+    bool saved = true;
+    if (recordingMovie)
+    {
+        saved = finishMovie();
+        restartGame(false);
+    }
+    emuMutex.Unlock();
+    return saved;
+}
+
+bool EmulationThread::isRecordingMovie()
+{
+    bool recording;
+    emuMutex.Lock();
+    recording = recordingMovie;
+    emuMutex.Unlock();
+    return recording;
+}
+
+void EmulationThread::setAudioFilter(AudioFilterMode mode)
+{
+    emuMutex.Lock();
+    initInfo.audio_spec.filter = mode;
+    apu_set_filter(&nes.apu, mode);
+    emuMutex.Unlock();
+}
+
 bool EmulationThread::isRunning()
 {
     bool running;
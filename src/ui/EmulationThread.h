@@ -6,6 +6,7 @@
 #include <wx/wx.h>
 
 extern "C" {
+    #include "../core/movie.h"
     #include "../core/nes.h"
 }
 
@@ -15,17 +16,36 @@ class EmuFrame;
 
 class EmulationThread : public wxThread {
     public:
-        EmulationThread(EmuFrame* parentFrame, Canvas* renderCanvas, std::string romPath);
+        EmulationThread(EmuFrame* parentFrame, Canvas* renderCanvas, std::string romPath, AudioSpec audioSpec);
         virtual wxThread::ExitCode Entry();
         void updateController(int wxKey, bool pressed);
+        bool startRecording(std::string path);
+        void stopRecording();
+        bool isRecording();
+        bool startMovieRecording(std::string path);
+        bool stopMovieRecording();
+        bool isRecordingMovie();
+        void setAudioFilter(AudioFilterMode mode);
         bool isRunning();
         void terminate();
     private:
+        EmuFrame* parentFrame;
         NES nes;
+        NESInitInfo initInfo;
+        bool nesReady, romLoaded;
+        std::string romPath;
+        Recorder* recorder;
+        Movie movie;
+        std::string moviePath;
+        bool recordingMovie;
+        uint8_t buttons;
         wxMutex emuMutex;
         bool running, stoppingEmulation;
 
+        bool restartGame(bool volatileSaves);
+        bool finishMovie();
         static ControllerButton resolveNESButton(int wxKey);
+        static void latchCallback(NES* nes, void* userdata);
 }; 
 
 #endif